@@ -12,6 +12,21 @@ import warnings
 
 import _pysmu
 
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+
+def _as_array(samples):
+    """View captured samples as an array of shape (signals, samples) without copying.
+
+    Returns a NumPy array if NumPy is available, otherwise a memoryview.
+    """
+    if numpy is not None:
+        return numpy.asarray(samples)
+    return memoryview(samples)
+
 
 def _ctrl_transfer(dev_serial, bm_request_type, b_request, wValue, wIndex,
                    data, wLength, timeout):
@@ -29,6 +44,47 @@ def _ctrl_transfer(dev_serial, bm_request_type, b_request, wValue, wIndex,
         return ret
 
 
+class Stream(object):
+    """Continuous capture from one or more devices, iterated in blocks.
+
+    Samples are buffered per device outside the GIL; each iteration waits
+    (without holding the GIL) for the next block_size samples of every
+    device. Blocks are arrays of shape (4, n) holding channel A's voltages
+    and currents, then channel B's, or lists of them, one per device, when
+    streaming several devices. Iteration ends once the stream is closed, or
+    after a last partial block when a capture stops.
+    """
+
+    def __init__(self, serials, block_size, single=False):
+        self._streams = [_pysmu.stream_inputs(x, block_size) for x in serials]
+        self._single = single
+
+    def __iter__(self):
+        return self
+
+    def next(self):
+        blocks = [_as_array(x.next()) for x in self._streams]
+        return blocks[0] if self._single else blocks
+
+    __next__ = next
+
+    @property
+    def dropped(self):
+        """Samples per device lost because blocks weren't taken fast enough."""
+        return [x.dropped for x in self._streams] if not self._single else self._streams[0].dropped
+
+    def close(self):
+        """Stop streaming."""
+        for x in self._streams:
+            x.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+
 class Smu(object):
     """Enumerate and set up all supported devices."""
 
@@ -59,12 +115,34 @@ class Smu(object):
             "(removal on next major version)", DeprecationWarning)
         return _ctrl_transfer(*args, **kwargs)
 
+    def stream(self, block_size=1000):
+        """Stream samples from all devices, yielding a list of blocks per iteration.
+
+        Each device streams on its own and starts when its turn comes, so the
+        blocks of different devices in a list aren't sample aligned: they are
+        the next block_size samples of each device, taken at about, but not
+        exactly, the same time.
+
+        Args:
+            block_size (int): samples per device per block
+
+        Returns:
+            Stream of lists of (4, block_size) arrays, in device order.
+        """
+        return Stream([self.devices[i].serial for i in sorted(self.devices)], block_size)
+
     def __repr__(self):
         return 'Devices: ' + str(self.devices)
 
 
 class Device(object):
-    """Individual device handle."""
+    """Individual device handle.
+
+    Each device captures independently of the others and captures don't hold
+    the GIL, so different devices can be captured from parallel threads. A
+    device only runs one capture or stream at a time; starting another one
+    meanwhile raises RuntimeError.
+    """
 
     def __init__(self, serial, channels):
         self.serial = serial
@@ -80,6 +158,11 @@ class Device(object):
         """Return device's hardware revision."""
         return _pysmu.hwver(self.serial)
 
+    @property
+    def handle(self):
+        """Return device's session handle, stable across hotplug events."""
+        return _pysmu.handle(self.serial)
+
     def ctrl_transfer(self, bm_request_type, b_request, wValue, wIndex,
                       data, wLength, timeout):
         """Perform raw USB control transfers.
@@ -102,21 +185,48 @@ class Device(object):
         return _ctrl_transfer(
             self.serial, bm_request_type, b_request, wValue, wIndex, data, wLength, timeout)
 
-    def get_samples(self, n_samples):
+    def get_samples(self, n_samples, array=False):
         """Query the device for a given number of samples from all channels.
 
         Args:
             n_samples (int): number of samples
+            array (boolean): return the samples of each channel as an array of
+                shape (2, n) holding its voltages and currents, sharing memory
+                with the capture
+
+        Returns:
+            List of the samples of each of the device's channels. Each channel's
+            samples index as (voltage, current) tuples and support the buffer
+            protocol, e.g. numpy.asarray(), as an array of shape (2, n).
+        """
+        samples = _pysmu.get_all_inputs(self.serial, n_samples)
+        if array:
+            return [_as_array(x) for x in samples]
+        return samples
+
+    def stream(self, block_size=1000):
+        """Stream samples from the device in blocks.
+
+        Args:
+            block_size (int): samples per block
 
         Returns:
-            List of n samples from all the device's channels.
+            Stream of (4, block_size) arrays holding channel A's voltages and
+            currents, then channel B's.
         """
-        return _pysmu.get_all_inputs(self.serial, n_samples)
+        return Stream([self.serial], block_size, single=True)
 
     @property
     def samples(self):
-        """Iterable of samples from the device."""
-        return _pysmu.iterate_inputs(self.serial)
+        """Iterable of samples from the device, as ((v, i), (v, i)) per channel."""
+        def samples(stream):
+            try:
+                for block in stream:
+                    for av, ai, bv, bi in block.tolist():
+                        yield ((av, ai), (bv, bi))
+            finally:
+                stream.close()
+        return samples(_pysmu.stream_inputs(self.serial, 1000))
 
     @property
     def calibration(self):
@@ -168,22 +278,33 @@ class Channel(object):
         """Output an arbitrary waveform.
 
         Args:
-            waveform: sequence of raw waveform values (floats or ints)
+            waveform: raw waveform values, either as a buffer (e.g. a NumPy
+                array or array.array of numbers, or bytes holding native
+                float32 values) or as a sequence of floats or ints; contiguous
+                float32 buffers are sourced in place without copying and
+                mustn't be modified meanwhile
             repeat (boolean): repeat the waveform when arriving at the end of
                 its available samples
         """
         return _pysmu.set_output_buffer(waveform, self.dev, self.chan, self.mode, repeat)
 
-    def get_samples(self, n_samples):
+    def get_samples(self, n_samples, array=False):
         """Query the channel for a given number of samples.
 
         Args:
             n_samples (int): number of samples
+            array (boolean): return an array of shape (2, n) holding the
+                voltages and currents, sharing memory with the capture
 
         Returns:
-            List of n samples from all the channel.
+            The n samples of the channel. They index as (voltage, current)
+            tuples and support the buffer protocol, e.g. numpy.asarray(), as an
+            array of shape (2, n).
         """
-        return _pysmu.get_inputs(self.dev, self.chan, n_samples)
+        samples = _pysmu.get_inputs(self.dev, self.chan, n_samples)
+        if array:
+            return _as_array(samples)
+        return samples
 
     def constant(self, val):
         """Set output to a constant waveform."""
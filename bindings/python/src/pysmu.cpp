@@ -22,37 +22,323 @@
   #include <cmath>
 #endif
 
+#include <algorithm>
+#include <new>
+#include <atomic>
+#include <memory>
 #include <vector>
-#include <queue>
 #include <cstdint>
 #include <functional>
+#include <map>
+#include <set>
 #include <string>
 #include <condition_variable>
 #include <libusb.h>
 
 #include "libsmu.hpp"
+#include "ring_buffer.hpp"
 
-using namespace std::placeholders;
 using std::vector;
 using std::string;
-using std::queue;
 using std::mutex;
 
 static Session* session = NULL; // Global session variable
 static const uint32_t SAMPLE_RATE = 100000; // M1K sampling rate
-std::condition_variable samples_available;
-static mutex signal_mtx; // control continuous signal queue access
-static queue <float> signal0_0, signal0_1, signal1_0, signal1_1;
 
-// dummy struct for continuous mode iteration emulation
+// Each device gets a group of its own, so that captures on different devices run
+// independently and can be driven from parallel Python threads. Only touched with the
+// GIL held; blocking libsmu calls release it, and none of the callbacks registered with
+// libsmu call into Python, so they never need it.
+static std::map<Device*, Group*> device_groups;
+
+// Devices with a capture or stream running on their group. Groups aren't safe to drive
+// from several threads at once, so a device is claimed with the GIL held before its
+// group is used without it, and other captures of the device are refused meanwhile.
+static std::set<Device*> busy_devices;
+
+// A waveform given to set_output_buffer(). Signals only keep a pointer to the values they
+// source, so the binding owns them until the signal is given something else to source: a
+// float32 buffer is pinned and sourced in place, anything else is converted into `values`.
+struct SourceBuffer {
+	SourceBuffer() { view.obj = NULL; }
+	~SourceBuffer() { if (view.obj) PyBuffer_Release(&view); }
+	Device* dev;
+	Py_buffer view;
+	vector<float> values;
+};
+static std::map<Signal*, std::unique_ptr<SourceBuffer>> source_buffers;
+// Waveforms replaced while their device was busy, which the USB thread may still be
+// reading. Released along with the device.
+static std::map<Device*, vector<std::unique_ptr<SourceBuffer>>> retired_buffers;
+
+// Continuous capture from one device. The USB thread writes whole blocks of samples into
+// a lock-free ring and only wakes the reader; the reader waits without the GIL and hands
+// out blocks of samples at a time.
+struct StreamState {
+	StreamState(size_t capacity): ring(capacity) {}
+	Device* dev;
+	Group* group;
+	std::shared_ptr<Capture> capture;
+	RingBuffer<float> ring;
+	// samples per block handed to Python
+	size_t block_size;
+	// samples per signal dropped because the ring was full
+	std::atomic<uint64_t> dropped{0};
+	mutex lock;
+	std::condition_variable ready;
+	// interleaved samples read from the ring, by the reader
+	vector<float> scratch;
+};
+
 typedef struct {
 	PyObject_HEAD
-} inputs;
+	StreamState* state;
+} stream;
+
+// Captured samples of a number of signals, one contiguous row per signal. Devices write
+// straight into the rows and Python reads them through the buffer protocol as a 2-D
+// float32 array of shape (signals, samples), so that nothing is copied. Indexing and
+// iterating give a tuple of all signals' values per sample, as the lists returned
+// before did.
+typedef struct {
+	PyObject_HEAD
+	vector<float>* data;
+	Py_ssize_t shape[2];
+	Py_ssize_t strides[2];
+} samples;
+
+// Convert `len` bytes of values of type T to floats.
+template <typename T>
+static void
+convert_values(const void* buf, size_t len, vector<float>& values)
+{
+	const T* src = (const T*)buf;
+	values.resize(len / sizeof(T));
+	for (size_t i = 0; i < values.size(); i++)
+		values[i] = src[i];
+}
+
+// The type code of a struct module format for single native values, such as NumPy and
+// array.array use, or 0 for other formats.
+static char
+format_type(const char* format)
+{
+	static const uint16_t one = 1;
+	char little = *(const char*)&one ? '<' : '>';
+	if (*format == '@' || *format == '=' || *format == little)
+		format++;
+	return *format && !format[1] ? *format : 0;
+}
+
+// Convert `len` bytes of values in the struct module format `format` to floats. Returns
+// false for formats that aren't numbers.
+static bool
+convert_buffer(const void* buf, size_t len, const char* format, vector<float>& values)
+{
+	switch (format_type(format)) {
+	case 'f': convert_values<float>(buf, len, values); break;
+	case 'd': convert_values<double>(buf, len, values); break;
+	case 'b': convert_values<int8_t>(buf, len, values); break;
+	case 'B': convert_values<uint8_t>(buf, len, values); break;
+	case 'h': convert_values<short>(buf, len, values); break;
+	case 'H': convert_values<unsigned short>(buf, len, values); break;
+	case 'i': convert_values<int>(buf, len, values); break;
+	case 'I': convert_values<unsigned>(buf, len, values); break;
+	case 'l': convert_values<long>(buf, len, values); break;
+	case 'L': convert_values<unsigned long>(buf, len, values); break;
+	case 'q': convert_values<long long>(buf, len, values); break;
+	case 'Q': convert_values<unsigned long long>(buf, len, values); break;
+	default:
+		return false;
+	}
+	return true;
+}
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// start of the row of the given signal
+static float *
+samples_row(samples *self, size_t signal)
+{
+	return self->data->data() + signal * self->shape[1];
+}
+
+static void
+samples_dealloc(samples *self)
+{
+	delete self->data;
+	PyObject_Del(self);
+}
+
+static Py_ssize_t
+samples_length(samples *self)
+{
+	return self->shape[1];
+}
+
+static PyObject *
+samples_item(samples *self, Py_ssize_t i)
+{
+	if (i < 0 || i >= self->shape[1]) {
+		PyErr_SetString(PyExc_IndexError, "sample index out of range");
+		return NULL;
+	}
+	PyObject* item = PyTuple_New(self->shape[0]);
+	if (!item)
+		return NULL;
+	for (Py_ssize_t sig = 0; sig < self->shape[0]; sig++)
+		PyTuple_SET_ITEM(item, sig, PyFloat_FromDouble(samples_row(self, sig)[i]));
+	return item;
+}
+
+static PyObject *
+samples_slice(samples *self, Py_ssize_t lo, Py_ssize_t hi)
+{
+	lo = std::max<Py_ssize_t>(0, std::min(lo, self->shape[1]));
+	hi = std::max(lo, std::min(hi, self->shape[1]));
+	PyObject* list = PyList_New(hi - lo);
+	if (!list)
+		return NULL;
+	for (Py_ssize_t i = lo; i < hi; i++) {
+		PyObject* item = samples_item(self, i);
+		if (!item) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i - lo, item);
+	}
+	return list;
+}
+
+static PyObject *
+samples_tolist(samples *self, PyObject *args)
+{
+	return samples_slice(self, 0, self->shape[1]);
+}
+
+static PyObject *
+samples_repr(samples *self)
+{
+	return PyString_FromFormat("<pysmu samples: %zd signals x %zd samples>",
+		self->shape[0], self->shape[1]);
+}
+
+static int
+samples_getbuffer(samples *self, Py_buffer *view, int flags)
+{
+	view->buf = self->data->data();
+	view->obj = (PyObject*)self;
+	Py_INCREF(self);
+	view->len = self->data->size() * sizeof(float);
+	view->itemsize = sizeof(float);
+	view->readonly = 0;
+	view->format = (flags & PyBUF_FORMAT) ? (char*)"f" : NULL;
+	view->ndim = 2;
+	view->shape = (flags & PyBUF_ND) == PyBUF_ND ? self->shape : NULL;
+	view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+// old-style buffer interface, for consumers such as numpy.frombuffer() that predate the
+// new one: a single segment holding all rows
+static Py_ssize_t
+samples_getsegcount(samples *self, Py_ssize_t *len)
+{
+	if (len)
+		*len = self->data->size() * sizeof(float);
+	return 1;
+}
+
+static Py_ssize_t
+samples_getreadbuffer(samples *self, Py_ssize_t segment, void **ptr)
+{
+	if (segment != 0) {
+		PyErr_SetString(PyExc_SystemError, "accessing non-existent samples segment");
+		return -1;
+	}
+	*ptr = self->data->data();
+	return self->data->size() * sizeof(float);
+}
+
+static PySequenceMethods samples_as_sequence = {
+	(lenfunc)samples_length,       /* sq_length */
+	0,                             /* sq_concat */
+	0,                             /* sq_repeat */
+	(ssizeargfunc)samples_item,    /* sq_item */
+	(ssizessizeargfunc)samples_slice, /* sq_slice */
+};
+
+static PyBufferProcs samples_as_buffer = {
+	(readbufferproc)samples_getreadbuffer,  /* bf_getreadbuffer */
+	(writebufferproc)samples_getreadbuffer, /* bf_getwritebuffer */
+	(segcountproc)samples_getsegcount,      /* bf_getsegcount */
+	0,                                      /* bf_getcharbuffer */
+	(getbufferproc)samples_getbuffer,       /* bf_getbuffer */
+	0,                                      /* bf_releasebuffer */
+};
+
+static PyMethodDef samples_methods[] = {
+	{ "tolist", (PyCFunction)samples_tolist, METH_NOARGS, "get the samples as a list of per-sample tuples" },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyTypeObject samples_type = {
+	PyObject_HEAD_INIT(NULL)
+	0,                         /* ob_size */
+	"pysmu.Samples",           /* tp_name */
+	sizeof(samples),           /* tp_basicsize */
+	0,                         /* tp_itemsize */
+	(destructor)samples_dealloc, /* tp_dealloc */
+	0,                         /* tp_print */
+	0,                         /* tp_getattr */
+	0,                         /* tp_setattr */
+	0,                         /* tp_compare */
+	(reprfunc)samples_repr,    /* tp_repr */
+	0,                         /* tp_as_number */
+	&samples_as_sequence,      /* tp_as_sequence */
+	0,                         /* tp_as_mapping */
+	0,                         /* tp_hash  */
+	0,                         /* tp_call */
+	0,                         /* tp_str */
+	0,                         /* tp_getattro */
+	0,                         /* tp_setattro */
+	&samples_as_buffer,        /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+	"Captured samples, a (signals, samples) float32 array through the buffer protocol", /* tp_doc */
+	0,                         /* tp_traverse */
+	0,                         /* tp_clear */
+	0,                         /* tp_richcompare */
+	0,                         /* tp_weaklistoffset */
+	0,                         /* tp_iter */
+	0,                         /* tp_iternext */
+	samples_methods,           /* tp_methods */
+};
+
+static samples *
+samples_new(size_t nsignals, size_t nsamples)
+{
+	samples* self = PyObject_New(samples, &samples_type);
+	if (!self)
+		return NULL;
+	try {
+		self->data = new vector<float>(nsignals * nsamples);
+	} catch (std::bad_alloc&) {
+		self->data = NULL;
+		Py_DECREF(self);
+		PyErr_SetString(PyExc_MemoryError, "not enough memory for the requested samples");
+		return NULL;
+	}
+	self->shape[0] = nsignals;
+	self->shape[1] = nsamples;
+	self->strides[0] = nsamples * sizeof(float);
+	self->strides[1] = sizeof(float);
+	return self;
+}
+
 static PyObject *
 initSession(PyObject* self, PyObject* args)
 {
@@ -60,7 +346,9 @@ initSession(PyObject* self, PyObject* args)
 
 	if (session == NULL)
 		session = new Session();
+	Py_BEGIN_ALLOW_THREADS
 	ret = session->update_available_devices();
+	Py_END_ALLOW_THREADS
 	if (ret != 0)
 		Py_RETURN_FALSE;
 	Py_RETURN_TRUE;
@@ -69,18 +357,46 @@ initSession(PyObject* self, PyObject* args)
 static PyObject *
 cleanupSession(PyObject* self, PyObject* args)
 {
+	// groups still capturing on other threads are only told to stop; their owners end them
+	vector<Group*> idle, busy;
+	for (auto it: device_groups)
+		(busy_devices.count(it.first) ? busy : idle).push_back(it.second);
+	Py_BEGIN_ALLOW_THREADS
+	for (auto group: busy)
+		group->cancel();
+	for (auto group: idle)
+		group->end();
 	session->end();
+	Py_END_ALLOW_THREADS
+	// waveforms of devices still capturing are left to the process exiting
+	for (auto it = source_buffers.begin(); it != source_buffers.end();) {
+		if (busy_devices.count(it->second->dev))
+			++it;
+		else
+			it = source_buffers.erase(it);
+	}
 	Py_RETURN_NONE;
 }
 
+// Get the device's own group, moving the device into it if need be.
+static Group *
+device_group(Device* dev)
+{
+	Group*& group = device_groups[dev];
+	if (!group)
+		group = session->add_group();
+	if (!group->m_devices.count(dev))
+		group->add_device(dev);
+	return group;
+}
+
 static PyObject *
 getDevInfo(PyObject* self, PyObject* args)
 {
 	PyObject* data = PyList_New(0);
-	for (auto i: session->m_available_devices){
-		session->add_device(&*i);
-	}
-	for (auto dev: session->m_devices) {
+	for (auto i: session->m_available_devices) {
+		Device* dev = &*i;
+		device_group(dev);
 		auto dev_info = dev->info();
 		PyObject* dev_data = PyDict_New();
 		for (unsigned chan=0; chan < dev_info->channel_count; chan++) {
@@ -116,6 +432,8 @@ get_device(const char *dev_serial)
 		return NULL;
 	}
 	auto dev = session->get_device(dev_serial);
+	for (auto it = device_groups.begin(); !dev && it != device_groups.end(); ++it)
+		dev = it->second->get_device(dev_serial);
 	if (dev == NULL) {
 		PyErr_SetString(PyExc_ValueError, "device not found");
 		return NULL;
@@ -123,6 +441,39 @@ get_device(const char *dev_serial)
 	return dev;
 }
 
+// Claim the device for a capture, failing if one is running already.
+static bool
+claim_device(Device* dev)
+{
+	if (!busy_devices.insert(dev).second) {
+		PyErr_SetString(PyExc_RuntimeError, "device is busy with another capture or stream");
+		return false;
+	}
+	return true;
+}
+
+// Release a device claimed with claim_device(), along with the waveforms it stopped
+// sourcing meanwhile.
+static void
+release_device(Device* dev)
+{
+	busy_devices.erase(dev);
+	retired_buffers.erase(dev);
+}
+
+// Release the waveform set_output_buffer() gave the signal, if any, once the signal has
+// been given something else to source.
+static void
+drop_source_buffer(Device* dev, Signal* sgnl)
+{
+	auto it = source_buffers.find(sgnl);
+	if (it == source_buffers.end())
+		return;
+	if (busy_devices.count(dev))
+		retired_buffers[dev].push_back(std::move(it->second));
+	source_buffers.erase(it);
+}
+
 static PyObject *
 setMode(PyObject* self, PyObject* args)
 {
@@ -151,23 +502,26 @@ getInputs(PyObject* self, PyObject* args)
 	auto dev = get_device(dev_serial);
 	if (dev == NULL)
 		return NULL;
-	auto sgnl_v = dev->signal(chan_num, 0);
-	auto sgnl_i = dev->signal(chan_num, 1);
-	vector<float> buf_v;
-	vector<float> buf_i;
-	buf_v.resize(nsamples);
-	buf_i.resize(nsamples);
-	sgnl_v->measure_buffer(buf_v.data(), nsamples);
-	sgnl_i->measure_buffer(buf_i.data(), nsamples);
-	session->configure(SAMPLE_RATE);
-	session->run(nsamples);
-	PyObject* samples = PyList_New(0);
-	for (int i = 0; i < nsamples; i++) {
-		PyObject* sample_tuple = Py_BuildValue("(f,f)", buf_v[i], buf_i[i]);
-		PyList_Append(samples, sample_tuple);
-		Py_DECREF(sample_tuple);
+	if (nsamples < 0) {
+		PyErr_SetString(PyExc_ValueError, "number of samples must not be negative");
+		return NULL;
+	}
+	samples* buf = samples_new(2, nsamples);
+	if (!buf)
+		return NULL;
+	if (!claim_device(dev)) {
+		Py_DECREF(buf);
+		return NULL;
 	}
-	return samples;
+	dev->signal(chan_num, 0)->measure_buffer(samples_row(buf, 0), nsamples);
+	dev->signal(chan_num, 1)->measure_buffer(samples_row(buf, 1), nsamples);
+	Group* group = device_group(dev);
+	Py_BEGIN_ALLOW_THREADS
+	group->configure(SAMPLE_RATE);
+	group->run(nsamples);
+	Py_END_ALLOW_THREADS
+	release_device(dev);
+	return (PyObject*)buf;
 }
 
 static PyObject *
@@ -176,7 +530,6 @@ getAllInputs(PyObject* self, PyObject* args)
 	const char *dev_serial;
 	int nsamples; /* number of samples to acquire */
 	size_t num_channels; /* number of channels passed */
-	vector< vector<float> > buf_v, buf_i; /* 2d vector of voltage/current samples per channel */
 
 	if (!PyArg_ParseTuple(args, "si", &dev_serial, &nsamples))
 		return NULL;
@@ -184,31 +537,40 @@ getAllInputs(PyObject* self, PyObject* args)
 	auto dev = get_device(dev_serial);
 	if (dev == NULL)
 		return NULL;
+	if (nsamples < 0) {
+		PyErr_SetString(PyExc_ValueError, "number of samples must not be negative");
+		return NULL;
+	}
 
+	// voltage and current samples per channel
 	num_channels = dev->info()->channel_count;
-	buf_v.resize(num_channels);
-	buf_i.resize(num_channels);
+	PyObject* all_samples = PyList_New(num_channels);
+	if (!all_samples)
+		return NULL;
 	for (unsigned i = 0; i < num_channels; i++) {
-		buf_v[i].resize(nsamples);
-		buf_i[i].resize(nsamples);
-		dev->signal(i, 0)->measure_buffer(buf_v[i].data(), nsamples);
-		dev->signal(i, 1)->measure_buffer(buf_i[i].data(), nsamples);
+		samples* buf = samples_new(2, nsamples);
+		if (!buf) {
+			Py_DECREF(all_samples);
+			return NULL;
+		}
+		PyList_SET_ITEM(all_samples, i, (PyObject*)buf);
+	}
+	if (!claim_device(dev)) {
+		Py_DECREF(all_samples);
+		return NULL;
 	}
-
-	session->configure(SAMPLE_RATE);
-	session->run(nsamples);
-
-	PyObject* all_samples = PyList_New(0);
 	for (unsigned i = 0; i < num_channels; i++) {
-		PyObject* samples = PyList_New(0);
-		for (int j = 0; j < nsamples; j++) {
-			PyObject* sample_tuple = Py_BuildValue("(f,f)", buf_v[i][j], buf_i[i][j]);
-			PyList_Append(samples, sample_tuple);
-			Py_DECREF(sample_tuple);
-		}
-		PyList_Append(all_samples, samples);
-		Py_DECREF(samples);
+		samples* buf = (samples*)PyList_GET_ITEM(all_samples, i);
+		dev->signal(i, 0)->measure_buffer(samples_row(buf, 0), nsamples);
+		dev->signal(i, 1)->measure_buffer(samples_row(buf, 1), nsamples);
 	}
+
+	Group* group = device_group(dev);
+	Py_BEGIN_ALLOW_THREADS
+	group->configure(SAMPLE_RATE);
+	group->run(nsamples);
+	Py_END_ALLOW_THREADS
+	release_device(dev);
 	return all_samples;
 }
 
@@ -227,7 +589,12 @@ write_calibration(PyObject* self, PyObject* args)
 		return NULL;
 
 	if (strncmp(dev->info()->label, "ADALM1000", 9) == 0) {
+		if (!claim_device(dev))
+			return NULL;
+		Py_BEGIN_ALLOW_THREADS
 		ret = dev->write_calibration(file);
+		Py_END_ALLOW_THREADS
+		release_device(dev);
 		if (ret <= 0) {
 			if (ret == -EINVAL)
 				PyErr_SetString(PyExc_ValueError, "invalid calibration file");
@@ -305,6 +672,7 @@ setOutputWave(PyObject* self, PyObject* args)
 		sgnl->source_triangle(midpoint, peak, period, phase);
 	if (wave == SRC_SINE)
 		sgnl->source_sine(midpoint, peak, period, phase);
+	drop_source_buffer(dev, sgnl);
 	Py_RETURN_NONE;
 }
 
@@ -338,6 +706,21 @@ hwver(PyObject* self, PyObject* args)
 	return PyString_FromString(dev->hwver());
 }
 
+static PyObject*
+handle(PyObject* self, PyObject* args)
+{
+	const char *dev_serial;
+
+	if (!PyArg_ParseTuple(args, "s", &dev_serial))
+		return NULL;
+
+	auto dev = get_device(dev_serial);
+	if (dev == NULL)
+		return NULL;
+
+	return PyInt_FromSize_t(dev->handle());
+}
+
 static PyObject *
 setOutputConstant(PyObject* self, PyObject* args)
 {
@@ -354,14 +737,101 @@ setOutputConstant(PyObject* self, PyObject* args)
 	if (mode == SVMI) {
 		auto sgnl_v = dev->signal(chan_num, 0);
 		sgnl_v->source_constant(val);
+		drop_source_buffer(dev, sgnl_v);
 	}
 	if (mode == SIMV) {
 		auto sgnl_i = dev->signal(chan_num, 1);
 		sgnl_i->source_constant(val);
+		drop_source_buffer(dev, sgnl_i);
 	}
 	Py_RETURN_NONE;
 }
 
+// Take the values of a waveform: float32 buffers are pinned, other buffers converted in
+// one pass, and strings, bytearrays and other untyped buffers read as packed native
+// float32 values. Anything else is read as a sequence of numbers.
+static SourceBuffer *
+source_buffer_from(PyObject* obj)
+{
+	std::unique_ptr<SourceBuffer> src(new SourceBuffer());
+	bool untyped = PyString_Check(obj) || PyByteArray_Check(obj);
+
+	if (PyObject_CheckBuffer(obj)) {
+		bool contiguous = true;
+		if (PyObject_GetBuffer(obj, &src->view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+			// e.g. a slice of a NumPy array, which is copied
+			if (!PyErr_ExceptionMatches(PyExc_BufferError))
+				return NULL;
+			PyErr_Clear();
+			if (PyObject_GetBuffer(obj, &src->view, PyBUF_RECORDS_RO) < 0)
+				return NULL;
+			contiguous = false;
+		}
+		const char* format = untyped || !src->view.format ? "f" : src->view.format;
+		if (untyped && src->view.len % sizeof(float)) {
+			PyErr_SetString(PyExc_ValueError,
+				"set_output_buffer(): bytes must hold whole float32 values");
+			return NULL;
+		}
+		if (contiguous && format_type(format) == 'f')
+			return src.release();
+
+		bool ok;
+		if (contiguous) {
+			ok = convert_buffer(src->view.buf, src->view.len, format, src->values);
+		} else {
+			vector<char> bytes(src->view.len);
+			ok = PyBuffer_ToContiguous(bytes.data(), &src->view, bytes.size(), 'C') == 0 &&
+				convert_buffer(bytes.data(), bytes.size(), format, src->values);
+		}
+		PyBuffer_Release(&src->view);
+		src->view.obj = NULL;
+		if (!ok) {
+			if (!PyErr_Occurred())
+				PyErr_Format(PyExc_TypeError, "set_output_buffer(): unsupported buffer format '%s'", format);
+			return NULL;
+		}
+		return src.release();
+	}
+
+	// array.array only has the old buffer interface, with the format as its typecode
+	PyObject* typecode = PyObject_HasAttrString(obj, "typecode") ?
+		PyObject_GetAttrString(obj, "typecode") : NULL;
+	if (typecode && PyString_Check(typecode) && PyObject_CheckReadBuffer(obj)) {
+		const void* buf;
+		Py_ssize_t len;
+		bool ok = PyObject_AsReadBuffer(obj, &buf, &len) == 0 &&
+			convert_buffer(buf, len, PyString_AsString(typecode), src->values);
+		Py_DECREF(typecode);
+		if (!ok) {
+			if (!PyErr_Occurred())
+				PyErr_SetString(PyExc_TypeError, "set_output_buffer(): unsupported array type");
+			return NULL;
+		}
+		return src.release();
+	}
+	Py_XDECREF(typecode);
+	PyErr_Clear();
+
+	PyObject* seq = PySequence_Fast(obj, "set_output_buffer(): first arg must be a buffer or a sequence of floats or ints");
+	if (!seq)
+		return NULL;
+	Py_ssize_t len = PySequence_Fast_GET_SIZE(seq);
+	PyObject** items = PySequence_Fast_ITEMS(seq);
+	src->values.resize(len);
+	for (Py_ssize_t i = 0; i < len; i++) {
+		double value = PyFloat_AsDouble(items[i]);
+		if (value == -1.0 && PyErr_Occurred()) {
+			Py_DECREF(seq);
+			PyErr_SetString(PyExc_TypeError, "set_output_buffer(): first arg must be a buffer or a sequence of floats or ints");
+			return NULL;
+		}
+		src->values[i] = value;
+	}
+	Py_DECREF(seq);
+	return src.release();
+}
+
 static PyObject *
 setOutputArbitrary(PyObject* self, PyObject* args)
 {
@@ -371,40 +841,31 @@ setOutputArbitrary(PyObject* self, PyObject* args)
 	if (!PyArg_ParseTuple(args, "Osiii", &buf, &dev_serial, &chan_num, &mode, &repeat))
 		return NULL;
 
-	if (!PySequence_Check(buf)) {
-		PyErr_SetString(PyExc_TypeError, "set_output_buffer(): first arg must be a sequence of floats or ints");
+	auto dev = get_device(dev_serial);
+	if (dev == NULL)
 		return NULL;
-	}
 
-	size_t buf_len = PySequence_Length(buf);
-	float* dev_buf = (float*)(malloc(sizeof(float) * buf_len));
-	if (!dev_buf) {
-		PyErr_SetString(PyExc_MemoryError, "set_output_buffer(): sequence is too big to fit in memory");
+	std::unique_ptr<SourceBuffer> src(source_buffer_from(buf));
+	if (!src)
 		return NULL;
-	}
-
-	for (auto i = 0; i < buf_len; i++){
-		PyObject* val = PySequence_GetItem(buf, i);
-		if (!PyFloat_Check(val) && !PyInt_Check(val)) {
-			free(dev_buf);
-			PyErr_SetString(PyExc_TypeError, "set_output_buffer(): first arg must be a sequence of floats or ints");
-			return NULL;
-		}
-		dev_buf[i] = (float)PyFloat_AsDouble(val);
-	}
-
-	auto dev = get_device(dev_serial);
-	if (dev == NULL) {
-		free(dev_buf);
+	src->dev = dev;
+	float* values = src->view.obj ? (float*)src->view.buf : src->values.data();
+	size_t len = src->view.obj ? src->view.len / sizeof(float) : src->values.size();
+	if (len == 0) {
+		PyErr_SetString(PyExc_ValueError, "set_output_buffer(): waveform is empty");
 		return NULL;
 	}
+
 	auto sgnl =  dev->signal(chan_num, 0);
 	if (mode == SIMV)
 		sgnl = dev->signal(chan_num, 1);
 	bool flag = false;
 	if (repeat)
 		flag = true;
-	sgnl->source_buffer(dev_buf, buf_len, flag);
+	sgnl->source_buffer(values, len, flag);
+	// the waveform this replaces is no longer sourced
+	drop_source_buffer(dev, sgnl);
+	source_buffers[sgnl] = std::move(src);
 	Py_RETURN_NONE;
 }
 
@@ -431,7 +892,9 @@ ctrlTransfer(PyObject* self, PyObject* args)
 	auto dev = get_device(dev_serial);
 	if (dev == NULL)
 		return NULL;
+	Py_BEGIN_ALLOW_THREADS
 	ret = dev->ctrl_transfer(bmRequestType, bRequest, wValue, wIndex, data_use, wLength, timeout);
+	Py_END_ALLOW_THREADS
 	if (ret < 0) {
 		PyErr_SetString(PyExc_IOError, "USB control transfer failed");
 		return NULL;
@@ -439,49 +902,113 @@ ctrlTransfer(PyObject* self, PyObject* args)
 	return PyInt_FromSize_t(ret);
 }
 
-static PyObject *
-inputs_iternext(inputs *self)
+// Stop the stream's capture, if still running, and unregister its callback.
+static void
+stream_stop(StreamState* st)
 {
-	// don't read/pop values from the queues while adding to them
-	std::unique_lock<mutex> lock(signal_mtx);
+	if (!st->capture)
+		return;
+	Py_BEGIN_ALLOW_THREADS
+	st->group->cancel();
+	st->group->end();
+	Py_END_ALLOW_THREADS
+	st->group->m_completion_callback = nullptr;
+	st->dev->measure_blocks(nullptr);
+	st->capture.reset();
+	release_device(st->dev);
+}
 
-	// wait for complete samples to exist in the queue
-	while (signal0_0.empty() || signal0_1.empty() || signal1_0.empty() || signal1_1.empty()) {
-		samples_available.wait(lock);
+static void
+stream_dealloc(stream *self)
+{
+	if (self->state) {
+		stream_stop(self->state);
+		delete self->state;
 	}
+	PyObject_Del(self);
+}
+
+static PyObject *
+stream_iternext(stream *self)
+{
+	StreamState* st = self->state;
+	if (!st->capture)
+		return NULL;
 
-	PyObject* samples_tuple = Py_BuildValue("((f,f),(f,f))",
-		signal0_0.front(), signal0_1.front(), signal1_0.front(), signal1_1.front());
+	size_t frames = 0;
+	bool done = false;
+	while (true) {
+		// wait in slices, to notice Ctrl-C in between
+		Py_BEGIN_ALLOW_THREADS
+		std::unique_lock<mutex> lock(st->lock);
+		st->ready.wait_for(lock, std::chrono::milliseconds(100), [&]() {
+			return st->ring.size() >= st->block_size * BLOCK_SIGNALS || st->capture->done();
+		});
+		frames = std::min(st->ring.size() / BLOCK_SIGNALS, st->block_size);
+		done = st->capture->done();
+		Py_END_ALLOW_THREADS
+		if (frames == st->block_size || done)
+			break;
+		if (PyErr_CheckSignals())
+			return NULL;
+	}
 
-	signal0_0.pop();
-	signal0_1.pop();
-	signal1_0.pop();
-	signal1_1.pop();
-	lock.unlock();
+	if (frames == 0) {
+		// the capture ended and everything it delivered has been handed out
+		unsigned status = st->capture->status();
+		stream_stop(st);
+		if (status != 0 && status != LIBUSB_TRANSFER_CANCELLED) {
+			PyErr_Format(PyExc_IOError, "streaming stopped: %s", libusb_error_name((int)status));
+			return NULL;
+		}
+		return NULL;
+	}
 
-	return samples_tuple;
+	samples* block = samples_new(BLOCK_SIGNALS, frames);
+	if (!block)
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	st->ring.read(st->scratch.data(), frames * BLOCK_SIGNALS);
+	for (unsigned sig = 0; sig < BLOCK_SIGNALS; sig++) {
+		float* row = samples_row(block, sig);
+		for (size_t i = 0; i < frames; i++)
+			row[i] = st->scratch[i * BLOCK_SIGNALS + sig];
+	}
+	Py_END_ALLOW_THREADS
+	return (PyObject*)block;
 }
 
-static void
-inputs_dealloc(inputs *self)
+static PyObject *
+stream_close(stream *self, PyObject *args)
 {
-	session->cancel();
-	session->end();
+	stream_stop(self->state);
+	Py_RETURN_NONE;
+}
 
-	// flush buffer queues on iterator deallocation
-	signal0_0 = queue<float>();
-	signal0_1 = queue<float>();
-	signal1_0 = queue<float>();
-	signal1_1 = queue<float>();
+static PyObject *
+stream_get_dropped(stream *self, void *closure)
+{
+	return PyLong_FromUnsignedLongLong(self->state->dropped);
 }
 
-static PyTypeObject inputs_type = {
+static PyMethodDef stream_methods[] = {
+	{ "close", (PyCFunction)stream_close, METH_NOARGS, "stop streaming" },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef stream_getset[] = {
+	{ (char*)"dropped", (getter)stream_get_dropped, NULL,
+		(char*)"samples per signal lost because blocks weren't taken fast enough", NULL },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyTypeObject stream_type = {
 	PyObject_HEAD_INIT(NULL)
 	0,                         /* ob_size */
-	"inputs._MyIter",  /* tp_name */
-	sizeof(inputs),    /* tp_basicsize */
+	"pysmu.Stream",            /* tp_name */
+	sizeof(stream),            /* tp_basicsize */
 	0,                         /* tp_itemsize */
-	(destructor)inputs_dealloc, /* tp_dealloc */
+	(destructor)stream_dealloc, /* tp_dealloc */
 	0,                         /* tp_print */
 	0,                         /* tp_getattr */
 	0,                         /* tp_setattr */
@@ -499,51 +1026,72 @@ static PyTypeObject inputs_type = {
 	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_ITER,
 		/* tp_flags: Py_TPFLAGS_HAVE_ITER tells python to
 			use tp_iter and tp_iternext fields. */
-	"Signal inputs iterator",  /* tp_doc */
+	"Continuous stream of blocks of samples from a device", /* tp_doc */
 	0,  /* tp_traverse */
 	0,  /* tp_clear */
 	0,  /* tp_richcompare */
 	0,  /* tp_weaklistoffset */
 	(getiterfunc)PyObject_SelfIter,  /* tp_iter */
-	(iternextfunc)inputs_iternext,  /* tp_iternext: */
+	(iternextfunc)stream_iternext,  /* tp_iternext: */
+	stream_methods,            /* tp_methods */
+	0,                         /* tp_members */
+	stream_getset,             /* tp_getset */
 };
 
 static PyObject *
-inputs_iter(PyObject *self, PyObject *args)
+stream_inputs(PyObject *self, PyObject *args)
 {
 	const char *dev_serial;
-	inputs *p = NULL;
+	int block_size;
 
-	if (!PyArg_ParseTuple(args, "s", &dev_serial))
+	if (!PyArg_ParseTuple(args, "si", &dev_serial, &block_size))
+		return NULL;
+	if (block_size <= 0) {
+		PyErr_SetString(PyExc_ValueError, "block size must be positive");
 		return NULL;
+	}
 
 	auto dev = get_device(dev_serial);
 	if (dev == NULL)
 		return NULL;
 
-	p = PyObject_New(inputs, &inputs_type);
+	stream* p = PyObject_New(stream, &stream_type);
 	if (!p)
 		return NULL;
-
-	auto signal_callback = [](queue <float> *signal_q, float sample) {
-		std::unique_lock<mutex> lock(signal_mtx);
-		if ((*signal_q).size() < 1024)
-			(*signal_q).push(sample);
-		lock.unlock();
-		if ((signal0_0.size() == 1) && (signal0_1.size() == 1) &&
-				(signal1_0.size() == 1) && (signal1_1.size() == 1))
-			samples_available.notify_one();
+	p->state = NULL;
+	if (!claim_device(dev)) {
+		Py_DECREF(p);
+		return NULL;
+	}
+	// room for a second of samples or a few blocks, whichever is more
+	size_t capacity = std::max<size_t>(SAMPLE_RATE, 4 * block_size) * BLOCK_SIGNALS;
+	StreamState* st = p->state = new StreamState(capacity);
+	st->dev = dev;
+	st->group = device_group(dev);
+	st->block_size = block_size;
+	st->scratch.resize(block_size * BLOCK_SIGNALS);
+
+	// Wake the reader for new samples and when the capture stops. Taking the lock between
+	// changing what the reader waits for and notifying it makes sure it can't miss the
+	// wakeup between checking and starting to wait.
+	auto wake = [st]() {
+		{ std::lock_guard<mutex> lock(st->lock); }
+		st->ready.notify_one();
 	};
-
-	// setup signal callbacks
-	dev->signal(0, 0)->measure_callback(std::bind(signal_callback, &signal0_0, _1));
-	dev->signal(0, 1)->measure_callback(std::bind(signal_callback, &signal0_1, _1));
-	dev->signal(1, 0)->measure_callback(std::bind(signal_callback, &signal1_0, _1));
-	dev->signal(1, 1)->measure_callback(std::bind(signal_callback, &signal1_1, _1));
-
-	session->configure(SAMPLE_RATE);
+	dev->measure_blocks([st, wake](const float* samples, size_t count) {
+		if (st->ring.space() < count * BLOCK_SIGNALS) {
+			st->dropped += count;
+		} else {
+			st->ring.write(samples, count * BLOCK_SIGNALS);
+			wake();
+		}
+	});
+	st->group->m_completion_callback = [wake](unsigned) { wake(); };
+	Py_BEGIN_ALLOW_THREADS
+	st->group->configure(SAMPLE_RATE);
 	// run in continuous mode
-	session->start(0);
+	st->capture = st->group->start_async(0);
+	Py_END_ALLOW_THREADS
 
 	return (PyObject *)p;
 }
@@ -557,9 +1105,10 @@ static PyMethodDef pysmu_methods [] = {
 	{ "calibration", calibration, METH_VARARGS, "show calibration data"  },
 	{ "fwver", fwver, METH_VARARGS, "show a device's firmware revision"  },
 	{ "hwver", hwver, METH_VARARGS, "show a device's hardware revision"  },
+	{ "handle", handle, METH_VARARGS, "show a device's session handle"  },
 	{ "get_inputs", getInputs, METH_VARARGS, "get measured voltage and current from a channel"  },
 	{ "get_all_inputs", getAllInputs, METH_VARARGS, "get measured voltage and current from all channels"  },
-	{ "iterate_inputs", inputs_iter, METH_VARARGS, "iterate over measured voltage and current from selected channels"  },
+	{ "stream_inputs", stream_inputs, METH_VARARGS, "stream blocks of measured voltages and currents from all channels"  },
 	{ "set_output_constant", setOutputConstant, METH_VARARGS, "set channel output - constant"  },
 	{ "set_output_wave", setOutputWave, METH_VARARGS, "set channel output - wave"  },
 	{ "set_output_buffer", setOutputArbitrary, METH_VARARGS, "set channel output - arbitrary wave"  },
@@ -569,7 +1118,13 @@ static PyMethodDef pysmu_methods [] = {
 
 DL_EXPORT(void) init_pysmu(void)
 {
-	Py_InitModule("_pysmu", pysmu_methods);
+	PyObject* m = Py_InitModule("_pysmu", pysmu_methods);
+	if (!m || PyType_Ready(&samples_type) < 0 || PyType_Ready(&stream_type) < 0)
+		return;
+	Py_INCREF(&samples_type);
+	PyModule_AddObject(m, "Samples", (PyObject*)&samples_type);
+	Py_INCREF(&stream_type);
+	PyModule_AddObject(m, "Stream", (PyObject*)&stream_type);
 }
 
 #ifdef __cplusplus
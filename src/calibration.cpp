@@ -0,0 +1,252 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "calibration.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using std::vector;
+
+/// parse a float, skipping leading whitespace; returns the end of the number or NULL
+static const char* parse_float(const char* p, const char* end, float* val) {
+	char buf[64];
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	// strtof needs a terminated string, and numbers are short; strchr() would also match
+	// the terminator of its set, so stop at NUL bytes explicitly
+	size_t n = 0;
+	while (p + n < end && n < sizeof(buf) - 1 && p[n] != '\0' && strchr("+-.0123456789eE", p[n]))
+		n++;
+	if (n == 0)
+		return NULL;
+	memcpy(buf, p, n);
+	buf[n] = '\0';
+	char* num_end;
+	*val = strtof(buf, &num_end);
+	if (num_end != buf + n || !std::isfinite(*val))
+		return NULL;
+	return p + n;
+}
+
+/// parse a `<ref, val>` line
+static bool parse_point(const char* p, const char* end, std::pair<float, float>* point) {
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if (p == end || *p++ != '<')
+		return false;
+	if (!(p = parse_float(p, end, &point->first)))
+		return false;
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if (p == end || *p++ != ',')
+		return false;
+	if (!(p = parse_float(p, end, &point->second)))
+		return false;
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	return p < end && *p == '>';
+}
+
+/// whether a line holds nothing but whitespace
+static bool blank(const char* p, const char* end) {
+	for (; p < end; p++) {
+		if (*p != ' ' && *p != '\t')
+			return false;
+	}
+	return true;
+}
+
+static bool contains(const char* p, const char* end, const char* token) {
+	size_t n = strlen(token);
+	for (; p + n <= end; p++) {
+		if (memcmp(p, token, n) == 0)
+			return true;
+	}
+	return false;
+}
+
+int parse_calibration(const char* data, size_t len, vector<CalibrationRecord>& records) {
+	const char* p = data;
+	const char* end = data + len;
+	bool in_record = false;
+
+	records.clear();
+	while (p < end) {
+		const char* eol = (const char*)memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+		const char* line_end = eol;
+		if (line_end > p && line_end[-1] == '\r')
+			line_end--;
+
+		if (!in_record) {
+			if (contains(p, line_end, "</>")) {
+				records.emplace_back();
+				in_record = true;
+			}
+		} else if (contains(p, line_end, "<\\>")) {
+			if (records.back().points.empty())
+				return -EINVAL;
+			in_record = false;
+		} else if (!blank(p, line_end)) {
+			std::pair<float, float> point;
+			if (!parse_point(p, line_end, &point))
+				return -EINVAL;
+			records.back().points.push_back(point);
+		}
+		p = eol + 1;
+	}
+
+	// unterminated record
+	if (in_record)
+		return -EINVAL;
+	return 0;
+}
+
+int parse_calibration_file(const char* path, vector<CalibrationRecord>& records) {
+#ifndef WIN32
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return parse_calibration("", 0, records);
+	}
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return -errno;
+	int ret = parse_calibration((const char*)data, st.st_size, records);
+	munmap(data, st.st_size);
+	return ret;
+#else
+	std::ifstream file(path, std::ios::in | std::ios::binary);
+	if (!file.is_open())
+		return -ENOENT;
+	vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	return parse_calibration(data.data(), data.size(), records);
+#endif
+}
+
+static const char* record_names[CALIBRATION_RECORDS] = {
+	"Channel A, measure V", "Channel A, measure I", "Channel A, source V", "Channel A, source I",
+	"Channel B, measure V", "Channel B, measure I", "Channel B, source V", "Channel B, source I",
+};
+
+int write_calibration_file(const char* path, const vector<CalibrationRecord>& records) {
+	if (records.size() != CALIBRATION_RECORDS)
+		return -EINVAL;
+	FILE* file = fopen(path, "w");
+	if (!file)
+		return -errno;
+	for (unsigned i = 0; i < CALIBRATION_RECORDS; i++) {
+		fprintf(file, "# %s\n</>\n", record_names[i]);
+		for (auto& p: records[i].points)
+			fprintf(file, "<%.6f, %.6f>\n", p.first, p.second);
+		fprintf(file, "<\\>\n\n");
+	}
+	if (fclose(file) != 0)
+		return -errno;
+	return 0;
+}
+
+int calibration_coefficients(const vector<CalibrationRecord>& records, vector<vector<float>>& cal) {
+	if (records.size() != CALIBRATION_RECORDS)
+		return -EINVAL;
+
+	cal.resize(CALIBRATION_RECORDS);
+	for (unsigned i = 0; i < CALIBRATION_RECORDS; i++) {
+		const auto& points = records[i].points;
+		float offset = points[0].second - points[0].first;
+		float gain_p = 0, gain_n = 0;
+		int cnt_p = 0, cnt_n = 0;
+		for (size_t j = 1; j < points.size(); j++) {
+			float measured = points[j].second - offset;
+			if (measured == 0)
+				return -EINVAL;
+			if (points[j].first > 0) {
+				gain_p += points[j].first / measured;
+				cnt_p++;
+			} else {
+				gain_n += points[j].first / measured;
+				cnt_n++;
+			}
+		}
+		cal[i].resize(3);
+		cal[i][0] = offset;
+		cal[i][1] = cnt_p ? gain_p / cnt_p : 1.0f;
+		cal[i][2] = cnt_n ? gain_n / cnt_n : 1.0f;
+	}
+	return 0;
+}
+
+PiecewiseLinear::PiecewiseLinear(const CalibrationRecord& record) {
+	for (auto& p: record.points)
+		m_points.push_back(std::make_pair(p.second, p.first));
+	std::sort(m_points.begin(), m_points.end());
+	// a vertical segment has no slope to interpolate along
+	m_points.erase(std::unique(m_points.begin(), m_points.end(),
+		[](const std::pair<float, float>& a, const std::pair<float, float>& b) { return a.first == b.first; }),
+		m_points.end());
+}
+
+float PiecewiseLinear::operator()(float x) const {
+	if (m_points.size() == 1)
+		return x - (m_points[0].first - m_points[0].second);
+	// segment containing x, or the outermost one on either side
+	auto it = std::upper_bound(m_points.begin() + 1, m_points.end() - 1, x,
+		[](float x, const std::pair<float, float>& p) { return x < p.first; });
+	auto& a = *(it - 1);
+	auto& b = *it;
+	return a.second + (x - a.first) * (b.second - a.second) / (b.first - a.first);
+}
+
+int list_directory(const char* path, vector<std::string>& files) {
+	files.clear();
+#ifndef WIN32
+	DIR* dir = opendir(path);
+	if (!dir)
+		return -errno;
+	while (struct dirent* entry = readdir(dir)) {
+		std::string file = std::string(path) + "/" + entry->d_name;
+		struct stat st;
+		if (stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+			files.push_back(file);
+	}
+	closedir(dir);
+#else
+	WIN32_FIND_DATAA entry;
+	HANDLE dir = FindFirstFileA((std::string(path) + "\\*").c_str(), &entry);
+	if (dir == INVALID_HANDLE_VALUE)
+		return -ENOENT;
+	do {
+		if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			files.push_back(std::string(path) + "\\" + entry.cFileName);
+	} while (FindNextFileA(dir, &entry));
+	FindClose(dir);
+#endif
+	return 0;
+}
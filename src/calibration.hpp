@@ -0,0 +1,54 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#ifndef _LIBSMU_CALIBRATION_HPP
+#define _LIBSMU_CALIBRATION_HPP
+
+#include <string>
+#include <utility>
+#include <vector>
+
+/// One `</>` ... `<\>` block of a calibration file: pairs of reference and measured values.
+/// The first point is taken at zero and gives the offset.
+struct CalibrationRecord {
+	std::vector<std::pair<float, float>> points;
+};
+
+/// Number of records in a calibration file, one per channel and signal direction.
+#define CALIBRATION_RECORDS 8
+
+/// Parse calibration data in memory. Lines outside of records and blank lines are ignored,
+/// records may hold any number of points. Returns 0 or -EINVAL for malformed data.
+int parse_calibration(const char* data, size_t len, std::vector<CalibrationRecord>& records);
+
+/// Parse a calibration file, mapping it into memory where possible. Returns 0, -EINVAL for
+/// malformed data, or a negative errno value if the file can't be read.
+int parse_calibration_file(const char* path, std::vector<CalibrationRecord>& records);
+
+/// Write records as a calibration file readable by parse_calibration_file(), one record per
+/// channel and signal direction with a comment naming it. Returns 0 or a negative errno value.
+int write_calibration_file(const char* path, const std::vector<CalibrationRecord>& records);
+
+/// Compute [offset, positive gain, negative gain] for each record, the layout used by
+/// Device::calibration(). Returns 0 or -EINVAL if the records don't form a calibration.
+int calibration_coefficients(const std::vector<CalibrationRecord>& records,
+	std::vector<std::vector<float>>& cal);
+
+/// Piecewise-linear calibration through the points of a record, mapping measured or
+/// requested values to calibrated ones. Values outside the points are extrapolated from the
+/// outermost segments; a single point only gives an offset.
+class PiecewiseLinear {
+public:
+	explicit PiecewiseLinear(const CalibrationRecord& record);
+	float operator()(float x) const;
+
+private:
+	/// (measured, reference) pairs sorted by measured value, without duplicates
+	std::vector<std::pair<float, float>> m_points;
+};
+
+/// List the regular files in a directory. Returns 0 or a negative errno value.
+int list_directory(const char* path, std::vector<std::string>& files);
+
+#endif // _LIBSMU_CALIBRATION_HPP
@@ -0,0 +1,522 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "commands.hpp"
+#include "csv.hpp"
+#include "record.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef WIN32
+#include <windows.h>
+#include "getopt.h"
+#else
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+
+using std::cerr;
+using std::endl;
+using std::vector;
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ms(bench_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+static void bench_usage(void)
+{
+	printf("usage: smu bench <benchmark> [options]\n"
+		"\n"
+		"benchmarks, reported as JSON on stdout:\n"
+		"  reconfigure                  sweep sample rates, comparing full power cycles\n"
+		"                               between runs with reconfiguring powered devices\n"
+		"  start                        compare start latency of start() with arm() and fire()\n"
+		"  csv                          compare CSV formatting throughput of printf with the\n"
+		"                               library's formatter, on generated samples without devices\n"
+		"  stream                       stream continuously for a while, measuring achieved rate,\n"
+		"                               late transfers, CPU time per thread and transfer latency\n"
+		"\n"
+		"options:\n"
+		" -r, --rates <min:max:step>   sample rates to sweep (default 10000:100000:10000),\n"
+		"                               the start and stream benchmarks run at the minimum rate\n"
+		" -n, --samples <count>        samples captured per run (default 1000), or formatted\n"
+		"                               per iteration by the csv benchmark\n"
+		" -i, --iterations <count>     sweeps per configuration (default 3)\n"
+		" -t, --duration <seconds>     how long the stream benchmark streams (default 10)\n"
+		" -D, --devices <serial,...>   benchmark only the devices with the given serials\n"
+		" -o, --output <file>          have the stream benchmark record samples to <file> as\n"
+		"                               smu record does, instead of discarding them\n"
+		"\n"
+		"Channels source 0 V in SVMI mode while benchmarking.\n");
+}
+
+/// Time `iterations` sweeps over `rates`, either powering the devices off after every
+/// run (the default behavior of Session::run) or keeping them powered between runs.
+/// Returns the mean time per reconfiguration and run in milliseconds.
+static double sweep(Session* session, const vector<uint64_t>& rates, uint64_t samples,
+	unsigned iterations, bool power_off)
+{
+	auto start = bench_clock::now();
+	for (unsigned it = 0; it < iterations; it++) {
+		for (auto rate: rates) {
+			for (auto dev: session->m_devices) {
+				for (unsigned ch = 0; ch < dev->info()->channel_count; ch++) {
+					dev->set_mode(ch, SVMI);
+					dev->signal(ch, 0)->source_constant(0);
+				}
+			}
+			session->configure(rate);
+			session->run(samples, power_off);
+		}
+	}
+	if (!power_off) {
+		// leave the devices the way we found them, outside of the measurement
+		session->end();
+	}
+	return elapsed_ms(start) / (iterations * rates.size());
+}
+
+static int bench_reconfigure(Session* session, const vector<uint64_t>& rates,
+	uint64_t samples, unsigned iterations)
+{
+	// warm up, so the first timed run doesn't pay for claiming and first power on
+	sweep(session, vector<uint64_t>(1, rates.front()), samples, 1, true);
+
+	double cold = sweep(session, rates, samples, iterations, true);
+	double warm = sweep(session, rates, samples, iterations, false);
+
+	printf("{\"benchmark\": \"reconfigure\", \"devices\": %zu, \"rates\": %zu, "
+		"\"samples\": %llu, \"iterations\": %u, "
+		"\"cold_ms\": %.3f, \"warm_ms\": %.3f, \"saved_ms\": %.3f}\n",
+		session->m_devices.size(), rates.size(), (unsigned long long)samples, iterations,
+		cold, warm, cold - warm);
+	return EXIT_SUCCESS;
+}
+
+static double us_to_ms(std::chrono::microseconds us)
+{
+	return us.count() / 1000.0;
+}
+
+static int bench_start(Session* session, uint64_t rate, uint64_t samples, unsigned iterations)
+{
+	for (auto dev: session->m_devices) {
+		for (unsigned ch = 0; ch < dev->info()->channel_count; ch++) {
+			dev->set_mode(ch, SVMI);
+			dev->signal(ch, 0)->source_constant(0);
+		}
+	}
+	session->configure(rate);
+	// warm up, so the first timed run doesn't pay for claiming and first power on
+	session->run(samples);
+
+	// plain start(): everything happens on the start path
+	double start_ms = 0, start_data_ms = 0;
+	for (unsigned it = 0; it < iterations; it++) {
+		auto begin = bench_clock::now();
+		auto capture = session->start_async(samples);
+		start_ms += elapsed_ms(begin);
+		session->end();
+		start_data_ms += us_to_ms(capture->fire_to_data());
+	}
+
+	// arm() ahead of time, then fire()
+	double arm_ms = 0, fire_ms = 0, fire_data_ms = 0;
+	for (unsigned it = 0; it < iterations; it++) {
+		auto begin = bench_clock::now();
+		auto capture = session->arm(samples);
+		arm_ms += elapsed_ms(begin);
+		begin = bench_clock::now();
+		session->fire();
+		fire_ms += elapsed_ms(begin);
+		session->end();
+		fire_data_ms += us_to_ms(capture->fire_to_data());
+	}
+
+	printf("{\"benchmark\": \"start\", \"devices\": %zu, \"rate\": %llu, "
+		"\"samples\": %llu, \"iterations\": %u, "
+		"\"start_ms\": %.3f, \"start_to_data_ms\": %.3f, "
+		"\"arm_ms\": %.3f, \"fire_ms\": %.3f, \"fire_to_data_ms\": %.3f}\n",
+		session->m_devices.size(), (unsigned long long)rate, (unsigned long long)samples,
+		iterations, start_ms / iterations, start_data_ms / iterations,
+		arm_ms / iterations, fire_ms / iterations, fire_data_ms / iterations);
+	return EXIT_SUCCESS;
+}
+
+/// Format `frames` frames of 4 values each as CSV rows into `out`, with printf and
+/// `format` or with CsvFormat for a NULL format.
+static void csv_rows(const vector<float>& frames, const char* format, const CsvFormat& csv, std::string& out)
+{
+	out.clear();
+	if (!format) {
+		csv.rows(frames.data(), frames.size() / 4, 4, out);
+		return;
+	}
+	char line[128];
+	for (size_t f = 0; f < frames.size(); f += 4) {
+		int len = 0;
+		for (unsigned k = 0; k < 4; k++) {
+			len += snprintf(line + len, sizeof(line) - len, format, frames[f + k]);
+			line[len++] = k < 3 ? ',' : '\n';
+		}
+		out.append(line, len);
+	}
+}
+
+static int bench_csv(uint64_t samples, unsigned iterations)
+{
+	// samples shaped like a device's: voltages and currents with a few LSBs of noise
+	vector<float> frames(samples * 4);
+	const double two_pi = 8 * std::atan(1.0);
+	uint32_t seed = 1;
+	for (uint64_t i = 0; i < samples; i++) {
+		seed = seed * 1664525 + 1013904223;
+		float noise = (seed >> 16) / 65536.0f - 0.5f;
+		float phase = two_pi * i / 1000;
+		frames[i*4+0] = 2.5f + 2 * std::sin(phase) + noise * 1e-4f;
+		frames[i*4+1] = 0.1f * std::cos(phase) + noise * 1e-5f;
+		frames[i*4+2] = 1.25f + noise * 1e-4f;
+		frames[i*4+3] = noise * 1e-5f;
+	}
+
+	struct Method {
+		const char* name;
+		const char* printf_format;
+		int precision;
+	} methods[] = {
+		{"printf_f", "%f", 0},
+		{"printf_roundtrip", "%.9g", 0},
+		{"shortest", NULL, -1},
+		{"fixed6", NULL, 6},
+	};
+
+	printf("{\"benchmark\": \"csv\", \"samples\": %llu, \"iterations\": %u, \"methods\": {",
+		(unsigned long long)samples, iterations);
+	std::string out;
+	for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+		CsvFormat csv(',', methods[m].precision);
+		// warm up, so allocating the output isn't timed
+		csv_rows(frames, methods[m].printf_format, csv, out);
+		auto start = bench_clock::now();
+		for (unsigned it = 0; it < iterations; it++)
+			csv_rows(frames, methods[m].printf_format, csv, out);
+		double ms = elapsed_ms(start) / iterations;
+		printf("%s\"%s\": {\"ms\": %.3f, \"ns_per_value\": %.1f, \"mb_per_s\": %.1f, \"bytes\": %zu}",
+			m ? ", " : "", methods[m].name, ms, ms * 1e6 / (samples * 4),
+			out.size() / (ms * 1e3), out.size());
+	}
+	printf("}}\n");
+	return EXIT_SUCCESS;
+}
+
+/// CPU time used by the calling thread so far, in milliseconds.
+static double thread_cpu_ms()
+{
+#ifdef WIN32
+	FILETIME creation, exit, kernel, user;
+	GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+	// FILETIMEs count 100 ns intervals
+	return (((uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+		((uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime)) / 1e4;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+#endif
+}
+
+/// CPU time used by another thread of the process so far, in milliseconds.
+static double thread_cpu_ms(std::thread::native_handle_type thread)
+{
+#if defined(WIN32)
+	FILETIME creation, exit, kernel, user;
+	GetThreadTimes((HANDLE)thread, &creation, &exit, &kernel, &user);
+	return (((uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+		((uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime)) / 1e4;
+#elif defined(__APPLE__)
+	thread_basic_info_data_t info;
+	mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+	mach_port_t port = pthread_mach_thread_np(thread);
+	if (thread_info(port, THREAD_BASIC_INFO, (thread_info_t)&info, &count) != KERN_SUCCESS)
+		return 0;
+	return (info.user_time.seconds + info.system_time.seconds) * 1e3 +
+		(info.user_time.microseconds + info.system_time.microseconds) / 1e3;
+#else
+	clockid_t clock;
+	struct timespec ts;
+	if (pthread_getcpuclockid(thread, &clock) || clock_gettime(clock, &ts))
+		return 0;
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+#endif
+}
+
+/// CPU time used by the whole process so far, in milliseconds.
+static double process_cpu_ms()
+{
+#ifdef WIN32
+	FILETIME creation, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+	return (((uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+		((uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime)) / 1e4;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+#endif
+}
+
+/// CPU time used by the session worker thread so far, in milliseconds.
+static double worker_cpu_ms(Session* session)
+{
+	auto result = std::make_shared<std::promise<double>>();
+	session->post([=]() { result->set_value(thread_cpu_ms()); });
+	return result->get_future().get();
+}
+
+/// Arrivals of sample transfers from one device, recorded on the USB thread.
+struct TransferLog {
+	/// samples received by the end of each transfer and when the transfer arrived
+	vector<uint64_t> samples;
+	vector<bench_clock::time_point> arrived;
+};
+
+static int bench_stream(Session* session, const vector<Device*>& devices, uint64_t rate,
+	double duration, const char* output)
+{
+	for (auto dev: devices) {
+		for (unsigned ch = 0; ch < dev->info()->channel_count; ch++) {
+			dev->set_mode(ch, SVMI);
+			dev->signal(ch, 0)->source_constant(0);
+		}
+	}
+	session->configure(rate);
+	uint64_t nsamples = duration * rate + 0.5;
+
+	std::unique_ptr<Recorder> recorder;
+	if (output) {
+		vector<unsigned> signals = {0, 1, 2, 3};
+		recorder.reset(new Recorder(devices, signals, false, nsamples));
+		int ret = recorder->open(output, false, rate);
+		if (ret < 0) {
+			cerr << "smu bench: failed to create " << output << ": " << strerror(-ret) << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	vector<TransferLog> logs(devices.size());
+	for (size_t i = 0; i < devices.size(); i++) {
+		TransferLog* log = &logs[i];
+		// room for the whole run at the smallest transfer size, so the USB thread never allocates
+		log->samples.reserve(nsamples / 256 + 1);
+		log->arrived.reserve(nsamples / 256 + 1);
+		auto callback = [=](size_t count) {
+			log->arrived.push_back(bench_clock::now());
+			log->samples.push_back((log->samples.empty() ? 0 : log->samples.back()) + count);
+		};
+		if (output) {
+			// the recorder takes the calibrated samples, the log the raw ones
+			devices[i]->measure_raw_blocks([=](const uint16_t*, size_t count) { callback(count); });
+		} else {
+			devices[i]->measure_blocks([=](const float*, size_t count) { callback(count); });
+		}
+	}
+
+	if (recorder)
+		recorder->start();
+	double usb_cpu = thread_cpu_ms(session->usb_thread_handle());
+	double worker_cpu = worker_cpu_ms(session);
+	double main_cpu = thread_cpu_ms();
+	double process_cpu = process_cpu_ms();
+	auto start = bench_clock::now();
+	auto capture = session->start_async(nsamples);
+	while (!capture->wait(100)) {
+		if (recorder && recorder->failed()) {
+			capture->cancel();
+			break;
+		}
+	}
+	double elapsed = elapsed_ms(start);
+	session->end();
+	usb_cpu = thread_cpu_ms(session->usb_thread_handle()) - usb_cpu;
+	worker_cpu = worker_cpu_ms(session) - worker_cpu;
+	main_cpu = thread_cpu_ms() - main_cpu;
+	process_cpu = process_cpu_ms() - process_cpu;
+	int record_ret = recorder ? recorder->finish() : 0;
+	for (auto dev: devices) {
+		dev->measure_blocks(nullptr);
+		dev->measure_raw_blocks(nullptr);
+	}
+
+	// A transfer's latency is how much later it arrived, relative to the samples it carried,
+	// than the earliest arriving transfer of its device; it's late if it arrived after the
+	// next one was due.
+	vector<double> latencies;
+	uint64_t transfers = 0, late = 0, received = nsamples;
+	double achieved_rate = 0;
+	size_t transfer_samples = 0;
+	for (auto& log: logs) {
+		received = std::min<uint64_t>(received, log.samples.empty() ? 0 : log.samples.back());
+		if (log.samples.empty())
+			continue;
+		transfer_samples = log.samples[0];
+		double period_ms = 1e3 * transfer_samples / rate;
+		vector<double> offsets(log.samples.size());
+		for (size_t k = 0; k < log.samples.size(); k++) {
+			offsets[k] = std::chrono::duration<double, std::milli>(log.arrived[k] - start).count() -
+				1e3 * log.samples[k] / rate;
+		}
+		double baseline = *std::min_element(offsets.begin(), offsets.end());
+		for (auto offset: offsets) {
+			latencies.push_back(offset - baseline);
+			if (offset - baseline > period_ms)
+				late++;
+		}
+		transfers += log.samples.size();
+		if (log.samples.size() > 1) {
+			double span = std::chrono::duration<double>(log.arrived.back() - log.arrived.front()).count();
+			double dev_rate = (log.samples.back() - log.samples.front()) / span;
+			achieved_rate = achieved_rate ? std::min(achieved_rate, dev_rate) : dev_rate;
+		}
+	}
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&](double p) {
+		return latencies.empty() ? 0 : latencies[std::min<size_t>(latencies.size() - 1, p * latencies.size())];
+	};
+
+	printf("{\"benchmark\": \"stream\", \"devices\": %zu, \"rate\": %llu, \"duration_s\": %.3f, "
+		"\"sink\": \"%s\", \"status\": %u, \"elapsed_ms\": %.3f, "
+		"\"samples\": %llu, \"dropped_samples\": %llu, \"achieved_rate\": %.1f, "
+		"\"transfers\": %llu, \"transfer_samples\": %zu, \"late_transfers\": %llu, "
+		"\"latency_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}, "
+		"\"cpu_ms\": {\"usb\": %.3f, \"worker\": %.3f, \"main\": %.3f, \"other\": %.3f, \"process\": %.3f}, "
+		"\"cpu_percent\": %.1f}\n",
+		devices.size(), (unsigned long long)rate, duration, output ? "file" : "discard",
+		capture->status(), elapsed, (unsigned long long)received, (unsigned long long)(nsamples - received),
+		achieved_rate, (unsigned long long)transfers, transfer_samples, (unsigned long long)late,
+		percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999),
+		latencies.empty() ? 0 : latencies.back(),
+		usb_cpu, worker_cpu, main_cpu,
+		std::max(process_cpu - usb_cpu - worker_cpu - main_cpu, 0.0),
+		process_cpu, 100 * process_cpu / elapsed);
+
+	if (record_ret < 0) {
+		cerr << "smu bench: recording failed: " << recorder->error() << endl;
+		return EXIT_FAILURE;
+	}
+	return capture->status() == 0 && received == nsamples ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int bench(Session* session, int argc, char **argv)
+{
+	int opt;
+	int option_index = 0;
+	uint64_t rate_min = 10000, rate_max = 100000, rate_step = 10000;
+	uint64_t samples = 1000;
+	unsigned iterations = 3;
+	double duration = 10;
+	const char* serials = NULL;
+	const char* output = NULL;
+
+	static struct option long_options[] = {
+		{"help",       no_argument,       0, 'h'},
+		{"rates",      required_argument, 0, 'r'},
+		{"samples",    required_argument, 0, 'n'},
+		{"iterations", required_argument, 0, 'i'},
+		{"duration",   required_argument, 0, 't'},
+		{"devices",    required_argument, 0, 'D'},
+		{"output",     required_argument, 0, 'o'},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "hr:n:i:t:D:o:",
+			long_options, &option_index)) != -1) {
+		switch (opt) {
+			case 'r': {
+				unsigned long long min, max, step;
+				if (sscanf(optarg, "%llu:%llu:%llu", &min, &max, &step) != 3 ||
+						min == 0 || step == 0 || max < min) {
+					cerr << "smu bench: invalid rate range: " << optarg << endl;
+					return EXIT_FAILURE;
+				}
+				rate_min = min;
+				rate_max = max;
+				rate_step = step;
+				break;
+			}
+			case 'n':
+				samples = strtoull(optarg, NULL, 10);
+				break;
+			case 'i':
+				iterations = strtoul(optarg, NULL, 10);
+				break;
+			case 't':
+				duration = strtod(optarg, NULL);
+				break;
+			case 'D':
+				serials = optarg;
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'h':
+				bench_usage();
+				return EXIT_SUCCESS;
+			default:
+				bench_usage();
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc) {
+		bench_usage();
+		return EXIT_FAILURE;
+	}
+	const char* name = argv[optind];
+
+	if (samples == 0 || iterations == 0) {
+		cerr << "smu bench: sample and iteration counts must be nonzero" << endl;
+		return EXIT_FAILURE;
+	}
+
+	if (strcmp(name, "csv") == 0)
+		return bench_csv(samples, iterations);
+
+	vector<Device*> devices;
+	if (select_devices(session, serials, &devices))
+		return EXIT_FAILURE;
+
+	if (strcmp(name, "reconfigure") == 0) {
+		vector<uint64_t> rates;
+		for (uint64_t rate = rate_min; rate <= rate_max; rate += rate_step)
+			rates.push_back(rate);
+		return bench_reconfigure(session, rates, samples, iterations);
+	} else if (strcmp(name, "start") == 0) {
+		return bench_start(session, rate_min, samples, iterations);
+	} else if (strcmp(name, "stream") == 0) {
+		if (duration <= 0) {
+			cerr << "smu bench: duration must be positive" << endl;
+			return EXIT_FAILURE;
+		}
+		return bench_stream(session, devices, rate_min, duration, output);
+	}
+
+	cerr << "smu bench: unknown benchmark: " << name << endl;
+	return EXIT_FAILURE;
+}
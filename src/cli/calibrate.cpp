@@ -0,0 +1,130 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "commands.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#ifdef WIN32
+#include "getopt.h"
+#else
+#include <getopt.h>
+#endif
+
+using std::cerr;
+using std::endl;
+
+static const char* record_names[] = {
+	"Channel A, measure V", "Channel A, measure I", "Channel A, source V", "Channel A, source I",
+	"Channel B, measure V", "Channel B, measure I", "Channel B, source V", "Channel B, source I",
+};
+
+static void calibrate_usage(void)
+{
+	printf("usage: smu calibrate [options]\n"
+		"\n"
+		"Calibrate all attached devices at once against a shared reference voltage, prompting\n"
+		"for each change of wiring, and write the results to their EEPROMs.\n"
+		"\n"
+		"options:\n"
+		" -v, --reference <volts>      measured voltage of the reference (default 2.5)\n"
+		" -R, --resistance <ohms>      resistor between each channel and the reference used\n"
+		"                               for calibrating currents (default 10)\n"
+		" -n, --samples <count>        samples per reading (default 40000)\n"
+		" -o, --output <dir>           save each device's measurements to a calibration file\n"
+		"                               in <dir>, for use with --import-calibration\n"
+		" -y, --yes                    don't prompt, e.g. when the wiring is switched externally\n");
+}
+
+/// Print the instructions for the next stage and wait for the operator to confirm.
+static bool prompt_operator(const char* instructions)
+{
+	printf("%s\nPress enter to continue, or q to cancel: ", instructions);
+	fflush(stdout);
+	int c = getchar();
+	bool cont = c != 'q' && c != EOF;
+	while (c != '\n' && c != EOF)
+		c = getchar();
+	return cont;
+}
+
+int calibrate(Session* session, int argc, char **argv)
+{
+	int opt;
+	int option_index = 0;
+	CalibrationSetup setup;
+	bool prompt = true;
+
+	static struct option long_options[] = {
+		{"help",       no_argument,       0, 'h'},
+		{"reference",  required_argument, 0, 'v'},
+		{"resistance", required_argument, 0, 'R'},
+		{"samples",    required_argument, 0, 'n'},
+		{"output",     required_argument, 0, 'o'},
+		{"yes",        no_argument,       0, 'y'},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "hv:R:n:o:y",
+			long_options, &option_index)) != -1) {
+		switch (opt) {
+			case 'v':
+				setup.reference = strtof(optarg, NULL);
+				break;
+			case 'R':
+				setup.resistance = strtof(optarg, NULL);
+				break;
+			case 'n':
+				setup.samples = strtoull(optarg, NULL, 10);
+				break;
+			case 'o':
+				setup.dir = optarg;
+				break;
+			case 'y':
+				prompt = false;
+				break;
+			case 'h':
+				calibrate_usage();
+				return EXIT_SUCCESS;
+			default:
+				calibrate_usage();
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (session->m_devices.empty()) {
+		cerr << "smu: no supported devices plugged in" << endl;
+		return EXIT_FAILURE;
+	}
+
+	printf("smu: calibrating %zu device(s)\n", session->m_devices.size());
+	auto results = session->calibrate(setup, vector<Device*>(),
+		prompt ? prompt_operator : std::function<bool(const char*)>());
+
+	int failed = 0;
+	for (auto& r: results) {
+		if (r.status < 0) {
+			failed++;
+			if (r.status == -EINVAL && r.points.empty())
+				printf("%s: %s (check the reference voltage and resistance)\n",
+					r.serial.c_str(), r.error.c_str());
+			else
+				printf("%s: %s (error %i)\n", r.serial.c_str(), r.error.c_str(), r.status);
+			continue;
+		}
+		printf("%s: calibrated%s%s\n", r.serial.c_str(),
+			r.file.empty() ? "" : ", saved to ", r.file.c_str());
+		for (size_t i = 0; i < r.coefficients.size(); i++) {
+			printf("  %-22s offset %8.4f  p gain %.4f  n gain %.4f\n", record_names[i],
+				r.coefficients[i][0], r.coefficients[i][1], r.coefficients[i][2]);
+		}
+	}
+	if (failed)
+		printf("smu: %i of %zu device(s) failed calibration and kept their previous calibration\n",
+			failed, results.size());
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,35 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+// Subcommands of the smu command line utility. Each takes the session with all
+// available devices added and its own argument vector, argv[0] being the
+// subcommand name, and returns the process exit status.
+
+#ifndef _SMU_COMMANDS_HPP
+#define _SMU_COMMANDS_HPP
+
+#include "libsmu.hpp"
+#include <vector>
+
+/// smu bench: run benchmarks against the attached devices
+int bench(Session* session, int argc, char **argv);
+
+/// smu calibrate: calibrate the attached devices against a shared reference
+int calibrate(Session* session, int argc, char **argv);
+
+/// smu record: record samples of the attached devices to a file
+int record(Session* session, int argc, char **argv);
+
+/// smu play: source waveforms from files on the attached devices
+int play(Session* session, int argc, char **argv);
+
+/// smu stats: show live statistics of the attached devices' signals
+int stats(Session* session, int argc, char **argv);
+
+/// Select the devices with the given comma separated serials, or all devices for NULL,
+/// removing the others from the session. Reports errors on stderr and returns 0 or a
+/// negative errno value.
+int select_devices(Session* session, const char* serials, std::vector<Device*>* devices);
+
+#endif // _SMU_COMMANDS_HPP
@@ -0,0 +1,379 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "commands.hpp"
+#include "record.hpp"
+#include "ring_buffer.hpp"
+#include "stream.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef WIN32
+#include "getopt.h"
+#else
+#include <getopt.h>
+#endif
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+/// values taken from a source's ring buffer at a time on the USB thread
+static const size_t CACHE_SIZE = 256;
+/// values read from a file at a time
+static const size_t READ_SIZE = 16384;
+
+/// A waveform file played on one channel, read ahead on the reader thread into a ring
+/// buffer that the channel's source callback drains on the USB thread. Only a second or
+/// so of the file is ever in memory.
+class WaveformSource {
+public:
+	WaveformSource(FILE* file, StreamFormat format, bool current, bool repeat, size_t capacity):
+		m_file(file), m_format(format), m_current(current), m_repeat(repeat),
+		m_ring(capacity), m_cache(CACHE_SIZE), m_read(READ_SIZE) {}
+	~WaveformSource() { fclose(m_file); }
+
+	/// Reader thread: top up the ring buffer. Returns whether anything was read.
+	bool fill();
+
+	/// Whether the ring buffer is full or the whole file has been read.
+	bool primed() const { return m_eof || m_ring.space() < READ_SIZE; }
+
+	/// USB thread: the next value to source. Holds the last value once the file has been
+	/// played or if the reader has fallen behind, counting the latter as an underrun.
+	float next();
+
+	/// Whether the whole file has been played.
+	bool finished() const { return m_finished; }
+
+	/// Samples sourced while the reader had fallen behind.
+	uint64_t underruns() const { return m_underruns; }
+
+protected:
+	size_t parse(float* out, size_t count);
+
+	FILE* const m_file;
+	const StreamFormat m_format;
+	const bool m_current;
+	const bool m_repeat;
+	RingBuffer<float> m_ring;
+	std::atomic<bool> m_eof{false};
+	std::atomic<bool> m_finished{false};
+	std::atomic<uint64_t> m_underruns{0};
+
+	/// USB thread: values taken from the ring buffer and not yet sourced
+	vector<float> m_cache;
+	size_t m_cache_pos = 0;
+	size_t m_cache_len = 0;
+	float m_last = 0;
+
+	/// reader thread: values read from the file
+	vector<float> m_read;
+};
+
+/// Read up to `count` values from the file, converting them to volts or amps.
+size_t WaveformSource::parse(float* out, size_t count)
+{
+	switch (m_format) {
+	case FORMAT_F32:
+		return fread(out, sizeof(float), count, m_file);
+	case FORMAT_I16: {
+		// same units as smu --stream --format i16: voltages in 200 uV, currents in 10 uA
+		vector<int16_t> codes(count);
+		size_t n = fread(codes.data(), sizeof(int16_t), count, m_file);
+		for (size_t i = 0; i < n; i++)
+			out[i] = codes[i] * (m_current ? 1e-5f : 2e-4f);
+		return n;
+	}
+	default: {
+		// the first column of each line, skipping lines that don't start with a number such
+		// as a header row
+		char line[256];
+		size_t n = 0;
+		while (n < count && fgets(line, sizeof(line), m_file)) {
+			char* end;
+			float v = strtof(line, &end);
+			if (end != line)
+				out[n++] = v;
+			// the rest of an overlong line
+			while (!strchr(line, '\n') && fgets(line, sizeof(line), m_file))
+				;
+		}
+		return n;
+	}
+	}
+}
+
+bool WaveformSource::fill()
+{
+	if (m_eof)
+		return false;
+	size_t count = std::min(m_ring.space(), READ_SIZE);
+	if (count == 0)
+		return false;
+	size_t n = parse(m_read.data(), count);
+	if (n == 0 && m_repeat) {
+		rewind(m_file);
+		n = parse(m_read.data(), count);
+	}
+	if (n == 0) {
+		m_eof = true;
+		return false;
+	}
+	m_ring.write(m_read.data(), n);
+	return true;
+}
+
+float WaveformSource::next()
+{
+	if (m_cache_pos == m_cache_len) {
+		// check for the end before reading, so that values written just before it aren't missed
+		bool eof = m_eof;
+		m_cache_len = m_ring.read(m_cache.data(), CACHE_SIZE);
+		m_cache_pos = 0;
+		if (m_cache_len == 0) {
+			if (eof)
+				m_finished = true;
+			else
+				m_underruns++;
+			return m_last;
+		}
+	}
+	return m_last = m_cache[m_cache_pos++];
+}
+
+static void play_usage(void)
+{
+	printf("usage: smu play [options]\n"
+		"\n"
+		"Source waveforms read from files on the attached devices' channels at the sample rate,\n"
+		"streaming them from disk so that they can be far larger than memory. Play stops when\n"
+		"every file has been played, unless repeating.\n"
+		"\n"
+		"options:\n"
+		" -a, --channel-a <file>       waveform to source on channel A\n"
+		" -b, --channel-b <file>       waveform to source on channel B\n"
+		" -m, --mode <mode>[,<mode>]   what channels A and B source: v for voltage (SVMI,\n"
+		"                               default) or i for current (SIMV)\n"
+		"     --format <format>        format of the files: f32, i16 (200 uV, 10 uA units),\n"
+		"                               csv or tsv (first column); default by file extension,\n"
+		"                               f32 if unknown\n"
+		" -D, --devices <serial,...>   play on only the devices with the given serials\n"
+		" -r, --rate <Hz>              sample rate (default the devices' default rate)\n"
+		" -l, --repeat                 play the files over and over\n"
+		" -t, --duration <seconds>     stop after a number of seconds\n"
+		" -o, --output <file>          record all signals meanwhile, as smu record does\n");
+}
+
+/// Guess the format of a waveform file from its extension.
+static StreamFormat guess_format(const char* path)
+{
+	const char* ext = strrchr(path, '.');
+	StreamFormat format;
+	if (ext && parse_stream_format(ext + 1, &format) &&
+			format != FORMAT_TEXT && format != FORMAT_RAW)
+		return format;
+	return FORMAT_F32;
+}
+
+static volatile sig_atomic_t play_interrupted = 0;
+
+static void play_interrupt(int)
+{
+	play_interrupted = 1;
+}
+
+int play(Session* session, int argc, char **argv)
+{
+	int opt;
+	int option_index = 0;
+	const char* paths[2] = {NULL, NULL};
+	bool current[2] = {false, false};
+	bool format_given = false;
+	StreamFormat format = FORMAT_F32;
+	const char* serials = NULL;
+	uint64_t rate = 0;
+	bool repeat = false;
+	double duration = 0;
+	const char* output = NULL;
+
+	static struct option long_options[] = {
+		{"help",      no_argument,       0, 'h'},
+		{"channel-a", required_argument, 0, 'a'},
+		{"channel-b", required_argument, 0, 'b'},
+		{"mode",      required_argument, 0, 'm'},
+		{"format",    required_argument, 0, 'F'},
+		{"devices",   required_argument, 0, 'D'},
+		{"rate",      required_argument, 0, 'r'},
+		{"repeat",    no_argument,       0, 'l'},
+		{"duration",  required_argument, 0, 't'},
+		{"output",    required_argument, 0, 'o'},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "ha:b:m:D:r:lt:o:",
+			long_options, &option_index)) != -1) {
+		switch (opt) {
+			case 'a':
+				paths[0] = optarg;
+				break;
+			case 'b':
+				paths[1] = optarg;
+				break;
+			case 'm': {
+				unsigned ch = 0;
+				for (const char* p = optarg; *p && ch < 2; p++) {
+					if (*p == ',') {
+						ch++;
+					} else if (*p == 'v' || *p == 'V' || *p == 'i' || *p == 'I') {
+						current[ch] = *p == 'i' || *p == 'I';
+					} else {
+						cerr << "smu: unknown source mode: " << optarg << endl;
+						return EXIT_FAILURE;
+					}
+				}
+				break;
+			}
+			case 'F':
+				if (!parse_stream_format(optarg, &format) ||
+						format == FORMAT_TEXT || format == FORMAT_RAW) {
+					cerr << "smu: unsupported waveform format: " << optarg << endl;
+					return EXIT_FAILURE;
+				}
+				format_given = true;
+				break;
+			case 'D':
+				serials = optarg;
+				break;
+			case 'r':
+				rate = strtoull(optarg, NULL, 10);
+				break;
+			case 'l':
+				repeat = true;
+				break;
+			case 't':
+				duration = strtod(optarg, NULL);
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'h':
+				play_usage();
+				return EXIT_SUCCESS;
+			default:
+				play_usage();
+				return EXIT_FAILURE;
+		}
+	}
+	if ((!paths[0] && !paths[1]) || optind < argc) {
+		play_usage();
+		return EXIT_FAILURE;
+	}
+
+	vector<Device*> devices;
+	if (select_devices(session, serials, &devices))
+		return EXIT_FAILURE;
+	if (!rate)
+		rate = devices[0]->get_default_rate();
+	uint64_t nsamples = duration > 0 ? duration * rate + 0.5 : 0;
+
+	std::unique_ptr<Recorder> recorder;
+	if (output) {
+		vector<unsigned> signals = {0, 1, 2, 3};
+		recorder.reset(new Recorder(devices, signals, false, nsamples));
+		int ret = recorder->open(output, false, rate);
+		if (ret < 0) {
+			cerr << "smu: failed to create " << output << ": " << strerror(-ret) << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	// every device gets its own reader of each file, so that they all play it in full
+	vector<std::unique_ptr<WaveformSource>> sources;
+	vector<string> names;
+	for (auto dev: devices) {
+		for (unsigned ch = 0; ch < 2; ch++) {
+			if (!paths[ch]) {
+				dev->set_mode(ch, DISABLED);
+				continue;
+			}
+			FILE* file = fopen(paths[ch], "rb");
+			if (!file) {
+				cerr << "smu: failed to open " << paths[ch] << ": " << strerror(errno) << endl;
+				return EXIT_FAILURE;
+			}
+			WaveformSource* source = new WaveformSource(file, format_given ? format : guess_format(paths[ch]),
+				current[ch], repeat, std::max<uint64_t>(rate, READ_SIZE * 4));
+			sources.emplace_back(source);
+			names.push_back(string(dev->serial()) + " channel " + dev->channel_info(ch)->label);
+			dev->set_mode(ch, current[ch] ? SIMV : SVMI);
+			dev->signal(ch, current[ch])->source_callback([=](uint64_t) { return source->next(); });
+		}
+	}
+
+	// read ahead on a thread of our own; the first transfers are encoded as the capture
+	// starts, so the buffers must be full by then
+	std::atomic<bool> stop{false};
+	std::thread reader([&]() {
+		while (!stop) {
+			bool busy = false;
+			for (auto& source: sources)
+				busy = source->fill() || busy;
+			if (!busy)
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+	});
+	for (auto& source: sources) {
+		while (!source->primed())
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	session->configure(rate);
+	if (recorder)
+		recorder->start();
+	signal(SIGINT, play_interrupt);
+	session->start(nsamples);
+	while (!session->wait_for_completion(100)) {
+		bool finished = true;
+		for (auto& source: sources)
+			finished = finished && source->finished();
+		if (finished || play_interrupted || (recorder && recorder->failed())) {
+			session->cancel();
+			break;
+		}
+	}
+	session->end();
+	stop = true;
+	reader.join();
+	for (auto dev: devices) {
+		for (unsigned ch = 0; ch < 2; ch++)
+			dev->signal(ch, current[ch])->source_constant(0);
+	}
+
+	int ret = EXIT_SUCCESS;
+	if (recorder && recorder->finish() < 0) {
+		cerr << "smu: recording failed: " << recorder->error() << endl;
+		ret = EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < sources.size(); i++) {
+		if (sources[i]->underruns()) {
+			cerr << "smu: " << names[i] << " underran: the file couldn't be read fast enough for "
+				<< sources[i]->underruns() << " samples, which repeated the previous value" << endl;
+			ret = EXIT_FAILURE;
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,455 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "record.hpp"
+#include "commands.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+
+#ifdef WIN32
+#include "getopt.h"
+#else
+#include <getopt.h>
+#include <unistd.h>
+#endif
+
+using std::cerr;
+using std::endl;
+using std::vector;
+
+/// frames handed to the writer thread's callback at a time
+static const size_t READ_FRAMES = 4096;
+
+static size_t align_up(size_t size)
+{
+	return (size + RECORD_ALIGN - 1) / RECORD_ALIGN * RECORD_ALIGN;
+}
+
+/// Get a RECORD_ALIGN aligned, zeroed buffer of `size` bytes backed by `storage`.
+static char* aligned_buffer(vector<char>& storage, size_t size)
+{
+	storage.assign(size + RECORD_ALIGN, 0);
+	uintptr_t p = (uintptr_t)storage.data();
+	return (char*)((p + RECORD_ALIGN - 1) / RECORD_ALIGN * RECORD_ALIGN);
+}
+
+Recorder::Recorder(const vector<Device*>& devices, const vector<unsigned>& signals, bool raw,
+		uint64_t nsamples, size_t chunk_size):
+	m_devices(devices), m_signals(signals), m_raw(raw), m_nsamples(nsamples),
+	m_chunk_size(align_up(chunk_size))
+{
+	m_frame_size = devices.size() * signals.size() * (raw ? sizeof(uint16_t) : sizeof(float));
+}
+
+Recorder::~Recorder()
+{
+	if (m_writer)
+		m_writer->stop();
+	if (m_file)
+		fclose(m_file);
+}
+
+int Recorder::open(const char* path, bool direct, uint64_t sample_rate)
+{
+#ifdef O_DIRECT
+	int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+	if (fd < 0)
+		return -errno;
+	m_file = fdopen(fd, "wb");
+	if (!m_file) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+#else
+	(void)direct;
+	m_file = fopen(path, "wb");
+	if (!m_file)
+		return -errno;
+#endif
+	// chunks are already large, aligned writes; stdio buffering would only split them up
+	setvbuf(m_file, NULL, _IONBF, 0);
+
+	// two seconds of samples per device to ride out slow writes
+	size_t value_size = m_raw ? sizeof(uint16_t) : sizeof(float);
+	m_writer.reset(new FrameWriter(m_devices.size(), BLOCK_SIGNALS * value_size,
+		std::max<uint64_t>(sample_rate * 2, READ_FRAMES)));
+	m_chunk = aligned_buffer(m_storage, m_chunk_size);
+
+	// metadata, apart from the start time which is added by start()
+	m_metadata = "{\"version\": 2, \"sample_rate\": " + std::to_string(sample_rate) +
+		", \"format\": \"" + (m_raw ? "u16" : "f32") + "\", \"calibrated\": " +
+		(m_raw ? "false" : "true") + ", \"byte_order\": \"";
+	uint16_t probe = 1;
+	m_metadata += *(char*)&probe ? "little" : "big";
+	m_metadata += "\", \"devices\": [";
+	for (size_t i = 0; i < m_devices.size(); i++) {
+		Device* dev = m_devices[i];
+		m_metadata += std::string(i ? ", " : "") + "{\"serial\": \"" + dev->serial() +
+			"\", \"firmware\": \"" + dev->fwver() + "\", \"hardware\": \"" + dev->hwver() +
+			"\", \"signals\": [";
+		for (size_t s = 0; s < m_signals.size(); s++) {
+			unsigned ch = m_signals[s] / 2;
+			m_metadata += std::string(s ? ", " : "") + "\"" + dev->channel_info(ch)->label + " " +
+				dev->signal(ch, m_signals[s] % 2)->info()->label + "\"";
+		}
+		m_metadata += "], \"calibration\": [";
+		vector<vector<float>> cal;
+		dev->calibration(&cal);
+		for (size_t r = 0; r < cal.size(); r++) {
+			char values[96];
+			snprintf(values, sizeof(values), "%s[%.9g, %.9g, %.9g]", r ? ", " : "",
+				cal[r][0], cal[r][1], cal[r][2]);
+			m_metadata += values;
+		}
+		// host-side calibration replaces the EEPROM coefficients when loaded
+		vector<vector<std::pair<float, float>>> points;
+		dev->calibration_points(&points);
+		m_metadata += std::string("], \"calibration_model\": \"") +
+			(points.empty() ? "eeprom" : "piecewise_linear") + "\"";
+		if (!points.empty()) {
+			m_metadata += ", \"calibration_points\": [";
+			for (size_t r = 0; r < points.size(); r++) {
+				m_metadata += r ? ", [" : "[";
+				for (size_t k = 0; k < points[r].size(); k++) {
+					char values[64];
+					snprintf(values, sizeof(values), "%s[%.9g, %.9g]", k ? ", " : "",
+						points[r][k].first, points[r][k].second);
+					m_metadata += values;
+				}
+				m_metadata += "]";
+			}
+			m_metadata += "]";
+		}
+		m_metadata += "}";
+	}
+	m_metadata += "]";
+	return 0;
+}
+
+void Recorder::start()
+{
+	char start_time[64];
+	auto now = std::chrono::system_clock::now();
+	time_t secs = std::chrono::system_clock::to_time_t(now);
+	unsigned ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+	size_t len = strftime(start_time, sizeof(start_time), "%Y-%m-%dT%H:%M:%S", gmtime(&secs));
+	snprintf(start_time + len, sizeof(start_time) - len, ".%03uZ", ms);
+	m_metadata += std::string(", \"start_time\": \"") + start_time + "\"}";
+	if (!write_chunk("SMUR", m_metadata.data(), m_metadata.size(), 0))
+		return;
+
+	FrameWriter* writer = m_writer.get();
+	for (size_t i = 0; i < m_devices.size(); i++) {
+		if (m_raw) {
+			m_devices[i]->measure_raw_blocks([=](const uint16_t* codes, size_t count) {
+				writer->push(i, codes, count);
+			});
+		} else {
+			m_devices[i]->measure_blocks([=](const float* samples, size_t count) {
+				writer->push(i, samples, count);
+			});
+		}
+	}
+	m_writer->start([this](const char* const* samples, size_t frames) {
+		return write_frames(samples, frames);
+	}, READ_FRAMES, m_nsamples, nullptr, true);
+}
+
+int Recorder::finish()
+{
+	if (m_writer)
+		m_writer->stop();
+	for (auto dev: m_devices) {
+		if (m_raw)
+			dev->measure_raw_blocks(nullptr);
+		else
+			dev->measure_blocks(nullptr);
+	}
+	if (!m_file)
+		return m_errno ? -m_errno : -EBADF;
+
+	bool overrun = m_writer->dropped();
+	if (!m_failed)
+		write_data();
+	if (!m_failed) {
+		uint64_t frames = m_writer->frames();
+		std::string summary = "{\"frames\": " + std::to_string(frames) + ", \"stopped\": \"" +
+			(overrun ? "overrun" : m_nsamples && frames == m_nsamples ? "complete" : "interrupted") + "\"}";
+		write_chunk("END ", summary.data(), summary.size(), frames);
+	}
+	if (fclose(m_file) != 0 && !m_errno)
+		m_errno = errno;
+	m_file = NULL;
+	return m_errno ? -m_errno : overrun ? -ENOBUFS : 0;
+}
+
+std::string Recorder::error() const
+{
+	if (m_writer && m_writer->dropped())
+		return "disk couldn't keep up with the devices, samples were lost";
+	if (m_errno)
+		return strerror(m_errno);
+	return "";
+}
+
+/// Write a chunk of its own, padded to RECORD_ALIGN.
+bool Recorder::write_chunk(const char type[4], const void* payload, size_t payload_length, uint64_t first)
+{
+	size_t length = align_up(sizeof(RecordChunk) + payload_length);
+	vector<char> storage;
+	char* buf = aligned_buffer(storage, length);
+	RecordChunk header;
+	memcpy(header.type, type, 4);
+	header.header_length = sizeof(RecordChunk);
+	header.length = length;
+	header.payload_length = payload_length;
+	header.first = first;
+	memcpy(buf, &header, sizeof(header));
+	memcpy(buf + sizeof(header), payload, payload_length);
+	if (fwrite(buf, 1, length, m_file) != length) {
+		m_errno = errno;
+		m_failed = true;
+		return false;
+	}
+	m_bytes += length;
+	return true;
+}
+
+/// Write out the DATA chunk being filled, if it has any frames.
+bool Recorder::write_data()
+{
+	if (!m_chunk_frames)
+		return true;
+	size_t payload_length = m_chunk_frames * m_frame_size;
+	size_t length = align_up(sizeof(RecordChunk) + payload_length);
+	RecordChunk header;
+	memcpy(header.type, "DATA", 4);
+	header.header_length = sizeof(RecordChunk);
+	header.length = length;
+	header.payload_length = payload_length;
+	header.first = m_chunk_first;
+	memcpy(m_chunk, &header, sizeof(header));
+	memset(m_chunk + sizeof(header) + payload_length, 0, length - sizeof(header) - payload_length);
+	if (fwrite(m_chunk, 1, length, m_file) != length) {
+		m_errno = errno;
+		m_failed = true;
+		return false;
+	}
+	m_bytes += length;
+	m_chunk_first += m_chunk_frames;
+	m_chunk_frames = 0;
+	return true;
+}
+
+/// Copy frames into DATA chunks, writing out each one as it fills up. Returns false if
+/// writing failed.
+bool Recorder::write_frames(const char* const* samples, size_t frames)
+{
+	size_t chunk_capacity = (m_chunk_size - sizeof(RecordChunk)) / m_frame_size;
+	size_t value_size = m_raw ? sizeof(uint16_t) : sizeof(float);
+
+	for (size_t done = 0; done < frames; ) {
+		size_t count = std::min(frames - done, chunk_capacity - m_chunk_frames);
+
+		// pick the recorded signals out of each device's samples, interleaving the devices
+		char* out = m_chunk + sizeof(RecordChunk) + m_chunk_frames * m_frame_size;
+		for (size_t i = 0; i < m_devices.size(); i++) {
+			const char* in = samples[i] + done * BLOCK_SIGNALS * value_size;
+			char* dst = out + i * m_signals.size() * value_size;
+			for (size_t f = 0; f < count; f++) {
+				for (size_t s = 0; s < m_signals.size(); s++)
+					memcpy(dst + s * value_size, in + (f * BLOCK_SIGNALS + m_signals[s]) * value_size, value_size);
+				dst += m_frame_size;
+			}
+		}
+		m_chunk_frames += count;
+		done += count;
+		if (m_chunk_frames == chunk_capacity && !write_data())
+			return false;
+	}
+	return true;
+}
+
+static void record_usage(void)
+{
+	printf("usage: smu record -o <file> [options]\n"
+		"\n"
+		"Record samples from the attached devices to a file, written in large aligned chunks\n"
+		"by a thread of its own so that long captures are limited only by the disk.\n"
+		"\n"
+		"options:\n"
+		" -o, --output <file>          file to record to\n"
+		" -D, --devices <serial,...>   record only the devices with the given serials\n"
+		" -s, --signals <signal,...>   signals to record of each device, out of AV, AI, BV and BI\n"
+		"                               (default all)\n"
+		" -r, --rate <Hz>              sample rate (default the devices' default rate)\n"
+		" -n, --samples <count>        record a number of samples per device\n"
+		" -t, --duration <seconds>     record for a number of seconds\n"
+		"     --raw                    record uncalibrated 16-bit ADC codes instead of floats\n"
+		"     --direct                 bypass the page cache (O_DIRECT) where supported\n"
+		"\n"
+		"Recording runs until interrupted when neither --samples nor --duration is given.\n");
+}
+
+/// Parse a comma separated list of signal names into measure_blocks() sample indexes.
+static bool parse_signals(const char* list, vector<unsigned>* signals)
+{
+	static const char* names[] = {"AV", "AI", "BV", "BI"};
+	std::string s(list);
+	for (size_t pos = 0; pos <= s.size(); ) {
+		size_t end = s.find(',', pos);
+		if (end == std::string::npos)
+			end = s.size();
+		std::string name = s.substr(pos, end - pos);
+		for (auto& c: name)
+			c = toupper((unsigned char)c);
+		unsigned i = 0;
+		while (i < BLOCK_SIGNALS && name != names[i])
+			i++;
+		if (i == BLOCK_SIGNALS)
+			return false;
+		signals->push_back(i);
+		pos = end + 1;
+	}
+	return true;
+}
+
+static volatile sig_atomic_t record_interrupted = 0;
+
+static void record_interrupt(int)
+{
+	record_interrupted = 1;
+}
+
+int record(Session* session, int argc, char **argv)
+{
+	int opt;
+	int option_index = 0;
+	const char* path = NULL;
+	const char* serials = NULL;
+	vector<unsigned> signals;
+	uint64_t rate = 0;
+	uint64_t nsamples = 0;
+	double duration = 0;
+	bool raw = false;
+	bool direct = false;
+
+	static struct option long_options[] = {
+		{"help",     no_argument,       0, 'h'},
+		{"output",   required_argument, 0, 'o'},
+		{"devices",  required_argument, 0, 'D'},
+		{"signals",  required_argument, 0, 's'},
+		{"rate",     required_argument, 0, 'r'},
+		{"samples",  required_argument, 0, 'n'},
+		{"duration", required_argument, 0, 't'},
+		{"raw",      no_argument,       0, 'R'},
+		{"direct",   no_argument,       0, 'O'},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "ho:D:s:r:n:t:",
+			long_options, &option_index)) != -1) {
+		switch (opt) {
+			case 'o':
+				path = optarg;
+				break;
+			case 'D':
+				serials = optarg;
+				break;
+			case 's':
+				if (!parse_signals(optarg, &signals)) {
+					cerr << "smu: unknown signals: " << optarg << endl;
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'r':
+				rate = strtoull(optarg, NULL, 10);
+				break;
+			case 'n':
+				nsamples = strtoull(optarg, NULL, 10);
+				break;
+			case 't':
+				duration = strtod(optarg, NULL);
+				break;
+			case 'R':
+				raw = true;
+				break;
+			case 'O':
+				direct = true;
+				break;
+			case 'h':
+				record_usage();
+				return EXIT_SUCCESS;
+			default:
+				record_usage();
+				return EXIT_FAILURE;
+		}
+	}
+	if (!path || optind < argc) {
+		record_usage();
+		return EXIT_FAILURE;
+	}
+	if (signals.empty())
+		signals = {0, 1, 2, 3};
+
+	vector<Device*> devices;
+	if (select_devices(session, serials, &devices))
+		return EXIT_FAILURE;
+	for (auto dev: devices) {
+		for (unsigned ch = 0; ch < dev->info()->channel_count; ch++)
+			dev->set_mode(ch, DISABLED);
+	}
+	if (!rate)
+		rate = devices[0]->get_default_rate();
+	if (duration > 0)
+		nsamples = duration * rate + 0.5;
+
+	Recorder recorder(devices, signals, raw, nsamples);
+	int ret = recorder.open(path, direct, rate);
+	if (ret < 0) {
+		cerr << "smu: failed to create " << path << ": " << strerror(-ret) << endl;
+		return EXIT_FAILURE;
+	}
+
+	session->configure(rate);
+	recorder.start();
+	signal(SIGINT, record_interrupt);
+	auto start = std::chrono::steady_clock::now();
+	auto reported = start;
+	session->start(nsamples);
+	while (!session->wait_for_completion(100)) {
+		if (record_interrupted || recorder.failed()) {
+			session->cancel();
+			break;
+		}
+		auto now = std::chrono::steady_clock::now();
+		if (now - reported >= std::chrono::seconds(1)) {
+			std::chrono::duration<double> elapsed = now - start;
+			fprintf(stderr, "\rsmu: %.0f s, %llu samples, %.1f MiB", elapsed.count(),
+				(unsigned long long)recorder.frames(), recorder.bytes() / 1048576.0);
+			reported = now;
+		}
+	}
+	session->end();
+	ret = recorder.finish();
+	if (reported != start)
+		fprintf(stderr, "\n");
+
+	if (ret < 0) {
+		cerr << "smu: recording failed: " << recorder.error() << endl;
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "smu: recorded %llu samples per device to %s\n",
+		(unsigned long long)recorder.frames(), path);
+	return EXIT_SUCCESS;
+}
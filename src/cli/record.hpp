@@ -0,0 +1,116 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+// Recording of samples to disk for the smu command line utility.
+//
+// Recordings are a sequence of chunks, each starting with a RecordChunk header and padded
+// to a multiple of RECORD_ALIGN bytes so that they can be written with O_DIRECT:
+//
+//   "SMUR"  JSON metadata: format version, sample rate, start time, sample format, whether
+//           samples are calibrated and, per device, serial, firmware and hardware versions,
+//           the signals recorded and the calibration: the EEPROM coefficients, the model
+//           applied ("eeprom" or "piecewise_linear") and, for host-side piecewise-linear
+//           calibration, the (reference, measured) points of each record
+//   "DATA"  frames of samples, `first` being the number of the first one; a frame holds
+//           the recorded signals of every device in metadata order, as 32-bit floats or,
+//           for raw recordings, uncalibrated 16-bit ADC codes, in the byte order named
+//           by the metadata
+//   "END "  JSON summary: frames recorded and why recording stopped
+//
+// Readers skip chunks of unknown types using their `length`.
+
+#ifndef _SMU_RECORD_HPP
+#define _SMU_RECORD_HPP
+
+#include "libsmu.hpp"
+#include "frame_writer.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// Chunks are padded to multiples of this, and data is written in whole chunks.
+#define RECORD_ALIGN 4096
+
+/// Header of every chunk in a recording, in the byte order of the samples.
+struct RecordChunk {
+	/// chunk type, e.g. "DATA"
+	char type[4];
+	/// size of this header in bytes
+	uint32_t header_length;
+	/// size of the whole chunk including this header and padding
+	uint64_t length;
+	/// size of the payload following this header, excluding padding
+	uint64_t payload_length;
+	/// for DATA chunks, the number of the first frame in the chunk
+	uint64_t first;
+};
+
+/// Records the samples of a set of devices to a file on a thread of its own, in chunks of
+/// `chunk_size` bytes written in one go.
+class Recorder {
+public:
+	/// Record the signals with indexes `signals` (into a measure_blocks() sample) of each of
+	/// `devices`, stopping after `nsamples` samples per device, or never for 0.
+	Recorder(const std::vector<Device*>& devices, const std::vector<unsigned>& signals, bool raw,
+		uint64_t nsamples, size_t chunk_size = 4 << 20);
+	~Recorder();
+
+	/// Create `path`, bypassing the page cache with `direct` where supported, and gather the
+	/// metadata. Returns 0 or a negative errno value.
+	int open(const char* path, bool direct, uint64_t sample_rate);
+
+	/// Write the metadata stamped with the current time, register the devices' sample
+	/// callbacks and start the writer thread. Call right before starting the capture.
+	void start();
+
+	/// Write out the samples received so far, close the recording and stop the writer thread.
+	/// Unregisters the sample callbacks; call after the capture has ended. Returns 0 or a
+	/// negative errno value.
+	int finish();
+
+	/// Whether recording failed, either writing or because the disk didn't keep up and
+	/// samples were lost. Recording stops at the first failure.
+	bool failed() const { return m_failed || (m_writer && m_writer->failed()); }
+
+	/// Description of the failure.
+	std::string error() const;
+
+	/// Frames written so far.
+	uint64_t frames() const { return m_writer ? m_writer->frames() : 0; }
+
+	/// Bytes written so far.
+	uint64_t bytes() const { return m_bytes; }
+
+protected:
+	bool write_frames(const char* const* samples, size_t frames);
+	bool write_chunk(const char type[4], const void* payload, size_t payload_length, uint64_t first);
+	bool write_data();
+
+	const std::vector<Device*> m_devices;
+	const std::vector<unsigned> m_signals;
+	const bool m_raw;
+	const uint64_t m_nsamples;
+	const size_t m_chunk_size;
+	size_t m_frame_size;
+
+	FILE* m_file = NULL;
+	std::string m_metadata;
+	/// chunk being filled, aligned to RECORD_ALIGN within m_storage
+	std::vector<char> m_storage;
+	char* m_chunk = NULL;
+	size_t m_chunk_frames = 0;
+	uint64_t m_chunk_first = 0;
+
+	std::atomic<bool> m_failed{false};
+	int m_errno = 0;
+	std::atomic<uint64_t> m_bytes{0};
+
+	/// samples received per device, by the USB thread, as floats or raw codes
+	std::unique_ptr<FrameWriter> m_writer;
+};
+
+#endif // _SMU_RECORD_HPP
@@ -5,14 +5,22 @@
 //   Ian Daniher <itdaniher@gmail.com>
 
 #include "libsmu.hpp"
+#include "commands.hpp"
+#include "stream.hpp"
+#include <algorithm>
+#include <csignal>
 #include <iostream>
 #include <cstdint>
 #include <vector>
 #include <thread>
+#include <mutex>
+#include <chrono>
 #include <string.h>
 #include <libusb.h>
 
 #ifdef WIN32
+#include <fcntl.h>
+#include <io.h>
 #include "getopt.h"
 #else
 #include <getopt.h>
@@ -44,31 +52,120 @@ static void display_usage(void)
 		" -h, --help                   print this help message and exit\n"
 		" -l, --list                   list supported devices currently attached to the system\n"
 		" -p, --hotplug                simple session device hotplug testing\n"
-		" -s, --stream                 stream samples to stdout from a single attached device\n"
+		" -s, --stream                 stream samples to stdout from all attached devices\n"
+		"     --format <format>        stream format: text (default), raw for uncalibrated\n"
+		"                               16-bit codes, f32, i16 (200 uV, 10 uA units), csv or tsv\n"
+		"     --precision <digits>     digits after the point for csv and tsv, instead of the\n"
+		"                               fewest digits that exactly identify each value\n"
+		"     --columns <n,...>        columns to write for csv and tsv, numbered from 1\n"
+		" -n, --samples <count>        stream a number of samples per device\n"
+		" -t, --duration <seconds>     stream for a number of seconds\n"
+		" -D, --devices <serial,...>   stream only the devices with the given serials\n"
 		" -d, --display-calibration    display calibration data from all attached devices\n"
 		" -r, --reset-calibration      reset calibration data to the defaults on all attached devices\n"
 		" -w, --write-calibration <cal file> write calibration data to a single attached device\n"
-		" -f, --flash <firmware image> flash firmware image to a single attached device\n");
+		" -i, --import-calibration <dir> write calibration data to all attached devices from\n"
+		"                               files in <dir> named after their serial numbers\n"
+		" -f, --flash <firmware image> flash firmware image to a single attached device\n"
+		" -F, --flash-all <firmware image> flash firmware image to all attached devices at once\n"
+		"\n"
+		"commands:\n"
+		" bench <benchmark>            run benchmarks against all attached devices\n"
+		" calibrate                    calibrate all attached devices at once\n"
+		" play                         source waveforms from files on the attached devices\n"
+		" record                       record samples from the attached devices to a file\n"
+		" stats                        show live statistics of the attached devices' signals\n");
 }
 
-static void stream_samples(Session* session)
+static volatile sig_atomic_t stream_interrupted = 0;
+
+static void stream_interrupt(int)
 {
-	auto dev = *(session->m_devices.begin());
-	auto dev_info = dev->info();
-	for (unsigned ch_i=0; ch_i < dev_info->channel_count; ch_i++) {
-		auto ch_info = dev->channel_info(ch_i);
-		dev->set_mode(ch_i, DISABLED);
-		for (unsigned sig_i=0; sig_i < ch_info->signal_count; sig_i++) {
-			auto sig = dev->signal(ch_i, sig_i);
-			auto sig_info = sig->info();
-			sig->measure_callback([=](float d){
-				printf("Channel %s, %s: %f\n", ch_info->label, sig_info->label, d);
-			});
+	stream_interrupted = 1;
+}
+
+int select_devices(Session* session, const char* serials, vector<Device*>* devices)
+{
+	if (serials) {
+		string list(serials);
+		for (size_t pos = 0; pos <= list.size(); ) {
+			size_t end = list.find(',', pos);
+			if (end == string::npos)
+				end = list.size();
+			string serial = list.substr(pos, end - pos);
+			Device* dev = session->get_device(serial.c_str());
+			if (!dev) {
+				cerr << "smu: no such device: " << serial << endl;
+				return -ENODEV;
+			}
+			devices->push_back(dev);
+			pos = end + 1;
+		}
+		// only the selected devices take part in the capture
+		vector<Device*> all(session->m_devices.begin(), session->m_devices.end());
+		for (auto dev: all) {
+			if (std::find(devices->begin(), devices->end(), dev) == devices->end())
+				session->remove_device(dev);
+		}
+	} else {
+		devices->assign(session->m_devices.begin(), session->m_devices.end());
+	}
+	if (devices->empty()) {
+		cerr << "smu: no supported devices plugged in" << endl;
+		return -ENODEV;
+	}
+	return 0;
+}
+
+/// Stream samples of the devices with the given comma separated serials, or of all devices,
+/// to stdout. Streams `nsamples` samples, or for `duration` seconds, or until interrupted
+/// when both are 0. Returns the process exit status.
+static int stream_samples(Session* session, StreamFormat format, const CsvFormat& csv,
+	uint64_t nsamples, double duration, const char* serials)
+{
+	vector<Device*> devices;
+	if (select_devices(session, serials, &devices))
+		return EXIT_FAILURE;
+
+	for (auto col: csv.columns) {
+		if (col >= devices.size() * 4) {
+			cerr << "smu: column " << col + 1 << " out of range, there are " << devices.size() * 4 << endl;
+			return EXIT_FAILURE;
 		}
 	}
-	session->configure(dev->get_default_rate());
-	session->start(0);
-	while ( 1 == 1 ) {session->wait_for_completion();};
+
+	for (auto dev: devices) {
+		for (unsigned ch = 0; ch < dev->info()->channel_count; ch++)
+			dev->set_mode(ch, DISABLED);
+	}
+	uint64_t rate = devices[0]->get_default_rate();
+	if (duration > 0)
+		nsamples = duration * rate + 0.5;
+
+#ifdef WIN32
+	if (format != FORMAT_TEXT && format != FORMAT_CSV && format != FORMAT_TSV)
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	StreamWriter writer(stdout, format, devices, nsamples, csv);
+	session->configure(rate);
+	writer.start(rate);
+	signal(SIGINT, stream_interrupt);
+	session->start(nsamples);
+	while (!session->wait_for_completion(100)) {
+		if (stream_interrupted || writer.failed()) {
+			session->cancel();
+			break;
+		}
+	}
+	session->end();
+	writer.finish();
+
+	if (writer.failed()) {
+		cerr << "smu: streaming failed: " << writer.error() << endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
 }
 
 int write_calibration(Session* session, const char *file)
@@ -115,6 +212,29 @@ void display_calibration(Session* session)
 	}
 }
 
+int import_calibration(Session* session, const char *dir)
+{
+	int failed = 0;
+	auto results = session->import_calibration(dir);
+	for (auto& r: results) {
+		if (r.status > 0) {
+			printf("%s: wrote %s\n", r.serial.c_str(), r.file.c_str());
+			continue;
+		}
+		failed++;
+		if (r.file.empty())
+			printf("%s: no calibration file found\n", r.serial.c_str());
+		else if (r.status == -EINVAL)
+			printf("%s: %s: invalid calibration data format\n", r.serial.c_str(), r.file.c_str());
+		else if (r.status == LIBUSB_ERROR_PIPE)
+			printf("%s: firmware version doesn't support calibration (update to 2.06 or later)\n", r.serial.c_str());
+		else
+			printf("%s: %s: failed to write calibration data (error %i)\n",
+				r.serial.c_str(), r.file.c_str(), r.status);
+	}
+	return failed ? 1 : 0;
+}
+
 int reset_calibration(Session* session)
 {
 	int ret;
@@ -131,10 +251,60 @@ int reset_calibration(Session* session)
 	return 0;
 }
 
+int flash_all(Session* session, const char *file)
+{
+	std::mutex output_lock;
+	vector<FlashResult> results;
+
+	if (session->m_devices.empty()) {
+		cerr << "smu: no supported devices plugged in" << endl;
+		return 1;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	try {
+		results = session->flash_firmware_all(file, vector<Device*>(),
+			[&](const FlashResult& dev, unsigned pages, unsigned total) {
+				// report every 10%
+				if (pages * 10 / total == (pages - 1) * 10 / total)
+					return;
+				std::lock_guard<std::mutex> lock(output_lock);
+				printf("%s (%s): %u%%\n", dev.serial.c_str(), dev.path.c_str(), pages * 100 / total);
+			});
+	} catch (const std::exception& e) {
+		cout << "smu: failed updating firmware: " << e.what() << endl;
+		return 1;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	unsigned failed = 0;
+	for (auto& r: results) {
+		if (r.ok) {
+			printf("%s (%s): updated, %u of %u pages rewritten\n",
+				r.serial.c_str(), r.path.c_str(), r.written, r.pages);
+		} else {
+			printf("%s (%s): failed: %s\n", r.serial.c_str(), r.path.c_str(), r.error.c_str());
+			failed++;
+		}
+	}
+	printf("smu: updated firmware on %zu of %zu devices in %.1f s\n",
+		results.size() - failed, results.size(), elapsed.count());
+	if (failed)
+		return 1;
+	cout << "Please unplug and replug the devices to finish the process." << endl;
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	int opt;
 	int option_index = 0;
+	bool stream = false;
+	StreamFormat stream_format = FORMAT_TEXT;
+	uint64_t stream_nsamples = 0;
+	double stream_duration = 0;
+	const char* stream_serials = NULL;
+	CsvFormat stream_csv;
 
 	// display usage info if no arguments are specified
 	if (argc == 1) {
@@ -155,25 +325,55 @@ int main(int argc, char **argv)
 	session->m_completion_callback = [=](unsigned status){};
 	session->m_progress_callback = [=](uint64_t n){};
 
+	// subcommands take over the rest of the arguments
+	if (argv[1][0] != '-') {
+		int ret;
+		if (strcmp(argv[1], "bench") == 0) {
+			ret = bench(session, argc - 1, argv + 1);
+		} else if (strcmp(argv[1], "calibrate") == 0) {
+			ret = calibrate(session, argc - 1, argv + 1);
+		} else if (strcmp(argv[1], "play") == 0) {
+			ret = play(session, argc - 1, argv + 1);
+		} else if (strcmp(argv[1], "record") == 0) {
+			ret = record(session, argc - 1, argv + 1);
+		} else if (strcmp(argv[1], "stats") == 0) {
+			ret = stats(session, argc - 1, argv + 1);
+		} else {
+			cerr << "smu: unknown command: " << argv[1] << endl;
+			display_usage();
+			ret = EXIT_FAILURE;
+		}
+		delete session;
+		return ret;
+	}
+
 	// map long options to short ones
 	static struct option long_options[] = {
 		{"help",     no_argument, 0, 'a'},
 		{"hotplug",  no_argument, 0, 'p'},
 		{"list",     no_argument, 0, 'l'},
 		{"stream",   no_argument, 0, 's'},
+		{"format",   required_argument, 0, 'O'},
+		{"samples",  required_argument, 0, 'n'},
+		{"duration", required_argument, 0, 't'},
+		{"devices",  required_argument, 0, 'D'},
+		{"precision", required_argument, 0, 'P'},
+		{"columns",  required_argument, 0, 'C'},
 		{"display-calibration", no_argument, 0, 'd'},
 		{"reset-calibration", no_argument, 0, 'r'},
 		{"write-calibration", required_argument, 0, 'w'},
+		{"import-calibration", required_argument, 0, 'i'},
 		{"flash", required_argument, 0, 'f'},
+		{"flash-all", required_argument, 0, 'F'},
 		{0, 0, 0, 0}
 	};
 
-	while ((opt = getopt_long(argc, argv, "hplsdrw:f:",
+	while ((opt = getopt_long(argc, argv, "hplsO:n:t:D:P:C:drw:i:f:F:",
 			long_options, &option_index)) != -1) {
 		switch (opt) {
 			case 'p':
 				session->m_hotplug_detach_callback = [=](Device* device){
-					session->cancel();
+					// other devices keep streaming, only drop the one that left
 					session->remove_device(device);
 					printf("removed device: %s: serial %s: fw %s: hw %s\n",
 							device->info()->label, device->serial(),
@@ -196,14 +396,41 @@ int main(int argc, char **argv)
 				list_devices(session);
 				break;
 			case 's':
-				// stream samples from an attached device to stdout
-				if (!session->m_devices.empty()) {
-					stream_samples(session);
-				} else {
-					cerr << "smu: no supported devices plugged in" << endl;
+				// stream samples to stdout once all stream options are known
+				stream = true;
+				break;
+			case 'O':
+				if (!parse_stream_format(optarg, &stream_format)) {
+					cerr << "smu: unknown stream format: " << optarg << endl;
 					return EXIT_FAILURE;
 				}
 				break;
+			case 'n':
+				stream_nsamples = strtoull(optarg, NULL, 10);
+				break;
+			case 't':
+				stream_duration = strtod(optarg, NULL);
+				break;
+			case 'D':
+				stream_serials = optarg;
+				break;
+			case 'P':
+				stream_csv.precision = atoi(optarg);
+				if (stream_csv.precision < 0 || stream_csv.precision > 9) {
+					cerr << "smu: precision must be between 0 and 9 digits" << endl;
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'C':
+				for (char* col = strtok(optarg, ","); col; col = strtok(NULL, ",")) {
+					int n = atoi(col);
+					if (n < 1) {
+						cerr << "smu: invalid column: " << col << endl;
+						return EXIT_FAILURE;
+					}
+					stream_csv.columns.push_back(n - 1);
+				}
+				break;
 			case 'd':
 				// display calibration data from all attached m1k devices
 				display_calibration(session);
@@ -233,17 +460,40 @@ int main(int argc, char **argv)
 					return EXIT_FAILURE;
 				cout << "smu: successfully updated calibration data" << endl;
 				break;
+			case 'i':
+				// write calibration data to all attached m1k devices from per-serial files
+				if (session->m_devices.empty()) {
+					cerr << "smu: no supported devices plugged in" << endl;
+					return EXIT_FAILURE;
+				}
+				if (import_calibration(session, optarg))
+					return EXIT_FAILURE;
+				break;
 			case 'f':
 				// flash firmware image to an attached m1k device
-				try {
-					session->flash_firmware(optarg);
-				} catch (const std::exception& e) {
-					cout << "smu: failed updating firmware: " << e.what() << endl;
-					return EXIT_FAILURE;
+				{
+					auto start = std::chrono::steady_clock::now();
+					auto job = session->flash_firmware_async(optarg, NULL, [](const FlashProgress& p) {
+						fprintf(stderr, "\rsmu: flashing: %3u%% (%u pages rewritten, %.0f s left)  ",
+							p.pages * 100 / p.total_pages, p.written, p.eta);
+					});
+					FlashResult result = job->result();
+					fprintf(stderr, "\n");
+					if (!result.ok) {
+						cout << "smu: failed updating firmware: " << result.error << endl;
+						return EXIT_FAILURE;
+					}
+					std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+					printf("smu: successfully updated firmware in %.1f s, %u of %u pages rewritten\n",
+						elapsed.count(), result.written, result.pages);
 				}
-				cout << "smu: successfully updated firmware" << endl;
 				cout << "Please unplug and replug the device to finish the process." << endl;
 				break;
+			case 'F':
+				// flash firmware image to all attached m1k devices
+				if (flash_all(session, optarg))
+					return EXIT_FAILURE;
+				break;
 			case 'h':
 				display_usage();
 				break;
@@ -253,6 +503,13 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (stream) {
+		int ret = stream_samples(session, stream_format, stream_csv, stream_nsamples, stream_duration,
+			stream_serials);
+		delete session;
+		return ret;
+	}
+
 	delete session;
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,216 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "commands.hpp"
+#include "ring_buffer.hpp"
+#include "stats.hpp"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#ifdef WIN32
+#include <io.h>
+#include "getopt.h"
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include <getopt.h>
+#include <unistd.h>
+#endif
+
+using std::cerr;
+using std::endl;
+using std::vector;
+
+/// Statistics of one device over a window of samples, as handed from the USB thread to
+/// the display.
+struct StatsWindow {
+	/// when the last sample of the window arrived
+	std::chrono::steady_clock::time_point end;
+	SignalStats signals[BLOCK_SIGNALS];
+};
+
+/// Per device state of smu stats. The USB thread accumulates into `current` and queues
+/// each completed window, so all the main thread ever does is print.
+struct DeviceStats {
+	DeviceStats(): windows(16) {}
+	RingBuffer<StatsWindow> windows;
+	StatsWindow current;
+	/// latest window taken from the queue and when the one before it ended
+	StatsWindow latest;
+	std::chrono::steady_clock::time_point previous_end;
+	bool fresh = false;
+};
+
+static void stats_usage(void)
+{
+	printf("usage: smu stats [options]\n"
+		"\n"
+		"Show a table of the mean, RMS, minimum and maximum of every signal of the attached\n"
+		"devices and the sample rate achieved, refreshed every window.\n"
+		"\n"
+		"options:\n"
+		" -D, --devices <serial,...>   show only the devices with the given serials\n"
+		" -r, --rate <Hz>              sample rate (default the devices' default rate)\n"
+		" -w, --window <seconds>       time each row summarizes (default 1)\n"
+		" -t, --duration <seconds>     stop after a number of seconds instead of when interrupted\n");
+}
+
+static volatile sig_atomic_t stats_interrupted = 0;
+
+static void stats_interrupt(int)
+{
+	stats_interrupted = 1;
+}
+
+static void print_table(const vector<Device*>& devices, vector<std::unique_ptr<DeviceStats>>& stats,
+	bool redraw)
+{
+	if (redraw)
+		printf("\033[H\033[J");
+	printf("%-28s %-10s %12s %12s %12s %12s %10s\n",
+		"device", "signal", "mean", "rms", "min", "max", "rate");
+	for (size_t i = 0; i < devices.size(); i++) {
+		const StatsWindow& w = stats[i]->latest;
+		double secs = std::chrono::duration<double>(w.end - stats[i]->previous_end).count();
+		for (unsigned s = 0; s < BLOCK_SIGNALS; s++) {
+			const SignalStats& st = w.signals[s];
+			const char* unit = s % 2 ? "A" : "V";
+			char name[32];
+			snprintf(name, sizeof(name), "%s %s", devices[i]->channel_info(s / 2)->label,
+				devices[i]->signal(s / 2, s % 2)->info()->label);
+			printf("%-28s %-10s %10.6f %s %10.6f %s %10.6f %s %10.6f %s %10.0f\n",
+				s ? "" : devices[i]->serial(), name,
+				st.mean(), unit, st.rms(), unit, st.min, unit, st.max, unit,
+				secs > 0 ? st.count / secs : 0.0);
+		}
+	}
+	fflush(stdout);
+}
+
+int stats(Session* session, int argc, char **argv)
+{
+	int opt;
+	int option_index = 0;
+	const char* serials = NULL;
+	uint64_t rate = 0;
+	double window_s = 1;
+	double duration = 0;
+
+	static struct option long_options[] = {
+		{"help",     no_argument,       0, 'h'},
+		{"devices",  required_argument, 0, 'D'},
+		{"rate",     required_argument, 0, 'r'},
+		{"window",   required_argument, 0, 'w'},
+		{"duration", required_argument, 0, 't'},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "hD:r:w:t:",
+			long_options, &option_index)) != -1) {
+		switch (opt) {
+			case 'D':
+				serials = optarg;
+				break;
+			case 'r':
+				rate = strtoull(optarg, NULL, 10);
+				break;
+			case 'w':
+				window_s = strtod(optarg, NULL);
+				break;
+			case 't':
+				duration = strtod(optarg, NULL);
+				break;
+			case 'h':
+				stats_usage();
+				return EXIT_SUCCESS;
+			default:
+				stats_usage();
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind < argc) {
+		stats_usage();
+		return EXIT_FAILURE;
+	}
+
+	vector<Device*> devices;
+	if (select_devices(session, serials, &devices))
+		return EXIT_FAILURE;
+	for (auto dev: devices) {
+		for (unsigned ch = 0; ch < dev->info()->channel_count; ch++)
+			dev->set_mode(ch, DISABLED);
+	}
+	if (!rate)
+		rate = devices[0]->get_default_rate();
+	uint64_t window = window_s * rate + 0.5;
+	if (window == 0) {
+		cerr << "smu: window must be at least one sample" << endl;
+		return EXIT_FAILURE;
+	}
+	uint64_t nsamples = duration > 0 ? duration * rate + 0.5 : 0;
+
+	vector<std::unique_ptr<DeviceStats>> stats;
+	for (auto dev: devices) {
+		DeviceStats* ds = new DeviceStats();
+		stats.emplace_back(ds);
+		dev->measure_blocks([=](const float* samples, size_t count) {
+			while (count) {
+				size_t n = std::min<uint64_t>(count, window - ds->current.signals[0].count);
+				for (unsigned s = 0; s < BLOCK_SIGNALS; s++)
+					ds->current.signals[s].add(samples + s, n, BLOCK_SIGNALS);
+				samples += n * BLOCK_SIGNALS;
+				count -= n;
+				if (ds->current.signals[0].count == window) {
+					ds->current.end = std::chrono::steady_clock::now();
+					// a display that fell behind misses windows rather than holding up the USB thread
+					ds->windows.write(&ds->current, 1);
+					ds->current = StatsWindow();
+				}
+			}
+		});
+	}
+
+	bool redraw = isatty(fileno(stdout));
+	session->configure(rate);
+	signal(SIGINT, stats_interrupt);
+	auto start = std::chrono::steady_clock::now();
+	for (auto& ds: stats)
+		ds->latest.end = start;
+	session->start(nsamples);
+	while (true) {
+		bool done = session->wait_for_completion(50);
+		// show a new table once every device has completed another window
+		bool fresh = true;
+		for (auto& ds: stats) {
+			StatsWindow w;
+			while (ds->windows.read(&w, 1)) {
+				ds->previous_end = ds->latest.end;
+				ds->latest = w;
+				ds->fresh = true;
+			}
+			fresh = fresh && ds->fresh;
+		}
+		if (fresh) {
+			print_table(devices, stats, redraw);
+			for (auto& ds: stats)
+				ds->fresh = false;
+		}
+		if (done)
+			break;
+		if (stats_interrupted) {
+			session->cancel();
+			break;
+		}
+	}
+	session->end();
+	for (auto dev: devices)
+		dev->measure_blocks(nullptr);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,214 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "stream.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+using std::vector;
+
+/// frames encoded per pass of the writer thread
+static const size_t CHUNK_FRAMES = 4096;
+/// encoded bytes collected before writing them out
+static const size_t WRITE_SIZE = 1 << 18;
+
+bool parse_stream_format(const char* name, StreamFormat* format)
+{
+	static const struct { const char* name; StreamFormat format; } formats[] = {
+		{"text", FORMAT_TEXT}, {"raw", FORMAT_RAW}, {"f32", FORMAT_F32},
+		{"i16", FORMAT_I16}, {"csv", FORMAT_CSV}, {"tsv", FORMAT_TSV},
+	};
+	for (auto& f: formats) {
+		if (strcmp(name, f.name) == 0) {
+			*format = f.format;
+			return true;
+		}
+	}
+	return false;
+}
+
+StreamWriter::StreamWriter(FILE* out, StreamFormat format, const vector<Device*>& devices, uint64_t nsamples,
+		const CsvFormat& csv):
+	m_out(out), m_format(format), m_devices(devices), m_nsamples(nsamples), m_csv(csv)
+{
+	m_csv.delimiter = format == FORMAT_TSV ? '\t' : ',';
+}
+
+StreamWriter::~StreamWriter()
+{
+	if (m_writer)
+		m_writer->stop();
+}
+
+void StreamWriter::start(uint64_t sample_rate)
+{
+	// a second of samples per device to ride out the writer being held up
+	size_t value_size = m_format == FORMAT_RAW ? sizeof(uint16_t) : sizeof(float);
+	m_writer.reset(new FrameWriter(m_devices.size(), BLOCK_SIGNALS * value_size,
+		std::max<uint64_t>(sample_rate, CHUNK_FRAMES)));
+	FrameWriter* writer = m_writer.get();
+	for (size_t i = 0; i < m_devices.size(); i++) {
+		if (m_format == FORMAT_RAW) {
+			m_devices[i]->measure_raw_blocks([=](const uint16_t* codes, size_t count) {
+				writer->push(i, codes, count);
+			});
+		} else {
+			m_devices[i]->measure_blocks([=](const float* samples, size_t count) {
+				writer->push(i, samples, count);
+			});
+		}
+	}
+
+	if (m_format == FORMAT_CSV || m_format == FORMAT_TSV) {
+		vector<std::string> names;
+		for (auto dev: m_devices) {
+			for (unsigned ch = 0; ch < dev->info()->channel_count; ch++) {
+				for (unsigned sig = 0; sig < dev->channel_info(ch)->signal_count; sig++) {
+					names.push_back(std::string(dev->serial()) + " " + dev->channel_info(ch)->label + " " +
+						dev->signal(ch, sig)->info()->label);
+				}
+			}
+		}
+		m_csv.header(names, m_buf);
+		m_frames_buf.resize(CHUNK_FRAMES * m_devices.size() * BLOCK_SIGNALS);
+	}
+
+	m_writer->start([this](const char* const* samples, size_t frames) {
+		encode(samples, frames);
+		return m_buf.size() < WRITE_SIZE || flush();
+	}, CHUNK_FRAMES, m_nsamples, [this]() {
+		// keep interactive output flowing without turning idle passes into small writes
+		return std::chrono::steady_clock::now() - m_flushed <= std::chrono::milliseconds(50) || flush();
+	}, true);
+}
+
+void StreamWriter::finish()
+{
+	if (m_writer)
+		m_writer->stop();
+	for (auto dev: m_devices) {
+		if (m_format == FORMAT_RAW)
+			dev->measure_raw_blocks(nullptr);
+		else
+			dev->measure_blocks(nullptr);
+	}
+	if (!m_failed)
+		flush();
+}
+
+std::string StreamWriter::error() const
+{
+	if (m_writer && m_writer->dropped())
+		return "output couldn't keep up with the devices, samples were lost";
+	if (m_errno)
+		return strerror(m_errno);
+	return "";
+}
+
+/// Append `frames` frames to the output buffer, `samples[i]` holding those of device i.
+void StreamWriter::encode(const char* const* samples, size_t frames)
+{
+	size_t width = m_devices.size() * BLOCK_SIGNALS;
+	switch (m_format) {
+	case FORMAT_RAW: {
+		size_t pos = m_buf.size();
+		m_buf.resize(pos + frames * width * sizeof(uint16_t));
+		uint16_t* out = (uint16_t*)&m_buf[pos];
+		for (size_t f = 0; f < frames; f++) {
+			for (size_t i = 0; i < m_devices.size(); i++) {
+				memcpy(out, (const uint16_t*)samples[i] + f * BLOCK_SIGNALS, BLOCK_SIGNALS * sizeof(uint16_t));
+				out += BLOCK_SIGNALS;
+			}
+		}
+		break;
+	}
+	case FORMAT_F32: {
+		size_t pos = m_buf.size();
+		m_buf.resize(pos + frames * width * sizeof(float));
+		float* out = (float*)&m_buf[pos];
+		for (size_t f = 0; f < frames; f++) {
+			for (size_t i = 0; i < m_devices.size(); i++) {
+				memcpy(out, (const float*)samples[i] + f * BLOCK_SIGNALS, BLOCK_SIGNALS * sizeof(float));
+				out += BLOCK_SIGNALS;
+			}
+		}
+		break;
+	}
+	case FORMAT_I16: {
+		size_t pos = m_buf.size();
+		m_buf.resize(pos + frames * width * sizeof(int16_t));
+		int16_t* out = (int16_t*)&m_buf[pos];
+		for (size_t f = 0; f < frames; f++) {
+			for (size_t i = 0; i < m_devices.size(); i++) {
+				const float* s = (const float*)samples[i] + f * BLOCK_SIGNALS;
+				for (unsigned k = 0; k < BLOCK_SIGNALS; k++) {
+					// voltages in 200 uV, currents in 10 uA
+					float v = std::round(s[k] * (k & 1 ? 1e5f : 5e3f));
+					*out++ = (int16_t)std::max(-32768.0f, std::min(32767.0f, v));
+				}
+			}
+		}
+		break;
+	}
+	case FORMAT_CSV:
+	case FORMAT_TSV: {
+		float* out = m_frames_buf.data();
+		for (size_t f = 0; f < frames; f++) {
+			for (size_t i = 0; i < m_devices.size(); i++) {
+				memcpy(out, (const float*)samples[i] + f * BLOCK_SIGNALS, BLOCK_SIGNALS * sizeof(float));
+				out += BLOCK_SIGNALS;
+			}
+		}
+		m_csv.rows(m_frames_buf.data(), frames, width, m_buf);
+		break;
+	}
+	case FORMAT_TEXT: {
+		char value[FORMAT_FLOAT_MAX + 1];
+		for (size_t f = 0; f < frames; f++) {
+			for (size_t i = 0; i < m_devices.size(); i++) {
+				Device* dev = m_devices[i];
+				const float* s = (const float*)samples[i] + f * BLOCK_SIGNALS;
+				for (unsigned k = 0; k < BLOCK_SIGNALS; k++) {
+					// prefix the serial when streaming several devices
+					if (m_devices.size() > 1) {
+						m_buf += dev->serial();
+						m_buf += ": ";
+					}
+					m_buf += "Channel ";
+					m_buf += dev->channel_info(k / 2)->label;
+					m_buf += ", ";
+					m_buf += dev->signal(k / 2, k % 2)->info()->label;
+					m_buf += ": ";
+					m_buf.append(value, format_float_fixed(value, s[k], 6));
+					m_buf += '\n';
+				}
+			}
+		}
+		break;
+	}
+	}
+}
+
+/// Write out the output buffer, returning false if that failed.
+bool StreamWriter::flush()
+{
+	if (!m_buf.empty()) {
+		if (fwrite(m_buf.data(), 1, m_buf.size(), m_out) != m_buf.size()) {
+			m_errno = errno;
+			m_failed = true;
+			return false;
+		}
+		m_buf.clear();
+	}
+	m_flushed = std::chrono::steady_clock::now();
+	if (fflush(m_out) != 0) {
+		m_errno = errno;
+		m_failed = true;
+		return false;
+	}
+	return true;
+}
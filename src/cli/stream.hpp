@@ -0,0 +1,93 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+// Streaming of samples from the USB thread to a file or pipe for the smu command line
+// utility. Samples of each device are handed to a writer thread through a FrameWriter, so
+// that formatting and writing never hold up USB transfers.
+
+#ifndef _SMU_STREAM_HPP
+#define _SMU_STREAM_HPP
+
+#include "libsmu.hpp"
+#include "frame_writer.hpp"
+#include "csv.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// Output formats of smu --stream
+enum StreamFormat {
+	/// "Channel A, Voltage: 1.234567" lines, one per signal
+	FORMAT_TEXT,
+	/// uncalibrated 16-bit ADC codes, native byte order
+	FORMAT_RAW,
+	/// 32-bit floats in volts and amps, native byte order
+	FORMAT_F32,
+	/// 16-bit signed integers in units of 200 uV and 10 uA, native byte order
+	FORMAT_I16,
+	/// comma separated values with a header row naming the columns
+	FORMAT_CSV,
+	/// tab separated values with a header row naming the columns
+	FORMAT_TSV,
+};
+
+/// Parse a format name, returning false if it isn't one.
+bool parse_stream_format(const char* name, StreamFormat* format);
+
+/// Writes the samples of a set of devices to a file on a thread of its own. Output is
+/// written frame by frame, a frame being one sample of every signal of every device, the
+/// devices in the order given and each device's signals in measure_blocks() order, so the
+/// devices must be sampled in the same group.
+class StreamWriter {
+public:
+	/// Stream up to `nsamples` samples per device, or all samples for 0, to `out`. `csv`
+	/// selects the columns and number format of the CSV and TSV formats.
+	StreamWriter(FILE* out, StreamFormat format, const std::vector<Device*>& devices, uint64_t nsamples,
+		const CsvFormat& csv = CsvFormat());
+	~StreamWriter();
+
+	/// Register the devices' sample callbacks and start the writer thread. Call before
+	/// starting the capture, with the sample rate configured.
+	void start(uint64_t sample_rate);
+
+	/// Write out the samples received so far and stop the writer thread. Unregisters the
+	/// sample callbacks; call after the capture has ended.
+	void finish();
+
+	/// Whether streaming failed, either writing the output or because the writer didn't keep
+	/// up with the devices and samples were lost. Output stops at the first failure.
+	bool failed() const { return m_failed || (m_writer && m_writer->failed()); }
+
+	/// Description of the failure.
+	std::string error() const;
+
+	/// Frames written so far.
+	uint64_t frames() const { return m_writer ? m_writer->frames() : 0; }
+
+protected:
+	void encode(const char* const* samples, size_t frames);
+	bool flush();
+
+	FILE* const m_out;
+	const StreamFormat m_format;
+	const std::vector<Device*> m_devices;
+	const uint64_t m_nsamples;
+	CsvFormat m_csv;
+
+	/// frames merged from all devices, for the CSV and TSV formats
+	std::vector<float> m_frames_buf;
+	/// encoded output not yet written
+	std::string m_buf;
+	std::chrono::steady_clock::time_point m_flushed;
+	std::atomic<bool> m_failed{false};
+	int m_errno = 0;
+
+	/// samples received per device, by the USB thread, as floats or raw codes
+	std::unique_ptr<FrameWriter> m_writer;
+};
+
+#endif // _SMU_STREAM_HPP
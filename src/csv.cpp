@@ -0,0 +1,326 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "csv.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+/// Powers of ten as correctly rounded doubles, covering the scales format_float() needs.
+static const double pow10_table[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+	1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22, 1e23, 1e24, 1e25, 1e26, 1e27, 1e28, 1e29, 1e30,
+	1e31, 1e32, 1e33, 1e34, 1e35, 1e36, 1e37, 1e38, 1e39, 1e40, 1e41, 1e42, 1e43, 1e44, 1e45,
+	1e46, 1e47, 1e48, 1e49, 1e50, 1e51, 1e52, 1e53, 1e54, 1e55, 1e56, 1e57, 1e58, 1e59, 1e60,
+};
+
+/// x * 10^n, with a single rounding for |n| <= 22 and a few ulps of error otherwise
+static double scale10(double x, int n)
+{
+	return n >= 0 ? x * pow10_table[n] : x / pow10_table[-n];
+}
+
+static unsigned count_digits(uint64_t d)
+{
+	unsigned n = 1;
+	while (d >= 10) {
+		d /= 10;
+		n++;
+	}
+	return n;
+}
+
+/// Write digits of `d` (`ndigits` of them) for the value d * 10^-n, in plain or exponent
+/// notation, whichever is shorter.
+static size_t write_decimal(char* buf, bool neg, uint64_t d, unsigned ndigits, int n)
+{
+	char digits[20];
+	for (unsigned i = ndigits; i > 0; i--) {
+		digits[i - 1] = '0' + d % 10;
+		d /= 10;
+	}
+
+	int exp = (int)ndigits - 1 - n;
+	unsigned exp_digits = std::abs(exp) >= 10 ? 2 + (std::abs(exp) >= 100) : 2;
+	unsigned sci_len = ndigits + (ndigits > 1) + 2 + exp_digits;
+	unsigned fixed_len;
+	if (exp >= 0)
+		fixed_len = (int)ndigits <= exp + 1 ? exp + 1 : ndigits + 1;
+	else
+		fixed_len = 2 + (-exp - 1) + ndigits;
+
+	char* p = buf;
+	if (neg)
+		*p++ = '-';
+	if (fixed_len <= sci_len) {
+		if (exp >= 0) {
+			for (int i = 0; i <= exp; i++)
+				*p++ = i < (int)ndigits ? digits[i] : '0';
+			if ((int)ndigits > exp + 1) {
+				*p++ = '.';
+				memcpy(p, digits + exp + 1, ndigits - exp - 1);
+				p += ndigits - exp - 1;
+			}
+		} else {
+			*p++ = '0';
+			*p++ = '.';
+			for (int i = 0; i < -exp - 1; i++)
+				*p++ = '0';
+			memcpy(p, digits, ndigits);
+			p += ndigits;
+		}
+	} else {
+		*p++ = digits[0];
+		if (ndigits > 1) {
+			*p++ = '.';
+			memcpy(p, digits + 1, ndigits - 1);
+			p += ndigits - 1;
+		}
+		*p++ = 'e';
+		*p++ = exp < 0 ? '-' : '+';
+		unsigned e = std::abs(exp);
+		if (e >= 100)
+			*p++ = '0' + e / 100;
+		*p++ = '0' + e / 10 % 10;
+		*p++ = '0' + e % 10;
+	}
+	return p - buf;
+}
+
+static size_t write_special(char* buf, float value)
+{
+	const char* text = std::isnan(value) ? "nan" : value < 0 ? "-inf" : "inf";
+	size_t len = strlen(text);
+	memcpy(buf, text, len);
+	return len;
+}
+
+size_t format_float(char* buf, float value)
+{
+	if (!std::isfinite(value))
+		return write_special(buf, value);
+	bool neg = std::signbit(value);
+	float f = std::fabs(value);
+	if (f == 0) {
+		char* p = buf;
+		if (neg)
+			*p++ = '-';
+		*p++ = '0';
+		return p - buf;
+	}
+
+	// Everything a float rounds from lies strictly between the midpoints to its neighbors,
+	// both of which are exact in double precision. Scaled so that the float has nine integer
+	// digits, the shortest decimal is the multiple of the largest power of ten inside the
+	// interval.
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	float next_f, prev_f;
+	uint32_t next_bits = bits + 1, prev_bits = bits - 1;
+	memcpy(&next_f, &next_bits, sizeof(next_f));
+	memcpy(&prev_f, &prev_bits, sizeof(prev_f));
+	double x = f;
+	double lo = (x + prev_f) / 2;
+	double hi = std::isinf(next_f) ? x + (x - prev_f) / 2 : (x + (double)next_f) / 2;
+
+	// decimal exponent from the binary one, which is exact for normal floats and a lower
+	// bound for subnormal ones
+	int exp2 = bits >> 23 ? (int)(bits >> 23) - 127 : -149;
+	int exp10 = (int)std::floor(exp2 * 0.30102999566398120);
+	while (scale10(x, -exp10) >= 10)
+		exp10++;
+
+	int n = 8 - exp10;
+	double t = scale10(x, n);
+	double t_lo = scale10(lo, n);
+	double t_hi = scale10(hi, n);
+	// The scaled values carry a few ulps of error. Unless that could matter, the digits are
+	// found with integer arithmetic: narrow the integers inside the interval to the fewest
+	// digits that still leave one, then take the one nearest the value.
+	double tolerance = t_hi * 1e-14;
+	if (std::fabs(t_lo - std::round(t_lo)) > tolerance && std::fabs(t_hi - std::round(t_hi)) > tolerance) {
+		uint64_t a = (uint64_t)std::floor(t_lo) + 1;
+		uint64_t b = (uint64_t)std::ceil(t_hi) - 1;
+		int drop = 0;
+		while (b / 10 >= (a + 9) / 10) {
+			a = (a + 9) / 10;
+			b /= 10;
+			drop++;
+		}
+		uint64_t d = std::llround(t / pow10_table[drop]);
+		d = std::min(std::max(d, a), b);
+		n -= drop;
+		while (d % 10 == 0) {
+			d /= 10;
+			n--;
+		}
+		return write_decimal(buf, neg, d, count_digits(d), n);
+	}
+
+	// otherwise try candidates with more and more digits, checking those close to either
+	// end of the interval by parsing them back
+	auto inside = [&](double cand, int digits_n) {
+		if (std::fabs(cand - t_lo) > tolerance && std::fabs(cand - t_hi) > tolerance)
+			return cand > t_lo && cand < t_hi;
+		char text[FORMAT_FLOAT_MAX + 1];
+		uint32_t d = (uint32_t)(cand / pow10_table[n - digits_n]);
+		size_t len = write_decimal(text, false, d, count_digits(d), digits_n);
+		text[len] = '\0';
+		return strtof(text, NULL) == f;
+	};
+
+	for (int drop = 8; drop >= 0; drop--) {
+		double unit = pow10_table[drop];
+		double below = std::floor(t / unit) * unit;
+		double above = below + unit;
+		bool in_below = below > 0 && inside(below, n - drop);
+		bool in_above = inside(above, n - drop);
+		if (!in_below && !in_above)
+			continue;
+		double cand;
+		if (in_below && in_above) {
+			double d_below = t - below, d_above = above - t;
+			cand = d_below < d_above || (d_below == d_above && std::fmod(below / unit, 2) == 0) ? below : above;
+		} else {
+			cand = in_below ? below : above;
+		}
+		uint32_t d = (uint32_t)(cand / unit);
+		int digits_n = n - drop;
+		while (d % 10 == 0) {
+			d /= 10;
+			digits_n--;
+		}
+		return write_decimal(buf, neg, d, count_digits(d), digits_n);
+	}
+
+	// nine significant digits always identify a float
+	int len = snprintf(buf, FORMAT_FLOAT_MAX + 1, "%.9g", value);
+	return len > 0 ? len : 0;
+}
+
+size_t format_float_fixed(char* buf, float value, unsigned decimals)
+{
+	if (!std::isfinite(value))
+		return write_special(buf, value);
+	decimals = std::min(decimals, 9u);
+	// exact: a float's 24-bit mantissa times 5^9 fits in a double's
+	double scaled = std::fabs((double)value) * pow10_table[decimals];
+	if (scaled >= 9e15) {
+		int len = snprintf(buf, FORMAT_FLOAT_MAX + 1, "%.*f", decimals, value);
+		return len > 0 ? std::min(len, FORMAT_FLOAT_MAX) : 0;
+	}
+
+	// round half to even, as printf does with the exact binary value
+	uint64_t r = (uint64_t)std::floor(scaled);
+	double rest = scaled - r;
+	if (rest > 0.5 || (rest == 0.5 && r % 2))
+		r++;
+	uint64_t unit = (uint64_t)pow10_table[decimals];
+	uint64_t whole = r / unit;
+	uint64_t frac = r % unit;
+
+	char digits[24];
+	unsigned n = 0;
+	do {
+		digits[n++] = '0' + whole % 10;
+		whole /= 10;
+	} while (whole);
+
+	char* p = buf;
+	if (std::signbit(value))
+		*p++ = '-';
+	while (n)
+		*p++ = digits[--n];
+	if (decimals) {
+		*p++ = '.';
+		for (unsigned i = decimals; i > 0; i--) {
+			p[i - 1] = '0' + frac % 10;
+			frac /= 10;
+		}
+		p += decimals;
+	}
+	return p - buf;
+}
+
+void CsvFormat::header(const std::vector<std::string>& names, std::string& out) const
+{
+	size_t count = columns.empty() ? names.size() : columns.size();
+	for (size_t i = 0; i < count; i++) {
+		unsigned col = columns.empty() ? i : columns[i];
+		if (i)
+			out += delimiter;
+		if (col < names.size())
+			out += names[col];
+	}
+	out += '\n';
+}
+
+void CsvFormat::rows(const float* frames, size_t count, size_t width, std::string& out) const
+{
+	size_t ncols = columns.empty() ? width : columns.size();
+	size_t pos = out.size();
+	out.resize(pos + count * ncols * (FORMAT_FLOAT_MAX + 1));
+	char* start = &out[0];
+	char* p = start + pos;
+
+	for (size_t f = 0; f < count; f++) {
+		const float* frame = frames + f * width;
+		for (size_t i = 0; i < ncols; i++) {
+			unsigned col = columns.empty() ? i : columns[i];
+			float value = col < width ? frame[col] : NAN;
+			if (precision < 0)
+				p += format_float(p, value);
+			else
+				p += format_float_fixed(p, value, precision);
+			*p++ = i + 1 < ncols ? delimiter : '\n';
+		}
+	}
+	out.resize(p - start);
+}
+
+/// frames formatted at a time and bytes of text collected before writing them out
+static const size_t CSV_CHUNK_FRAMES = 4096;
+static const size_t CSV_WRITE_SIZE = 1 << 18;
+
+CsvWriter::CsvWriter(FILE* out, size_t width, const CsvFormat& format, size_t capacity):
+	m_out(out), m_width(width), m_format(format), m_writer(1, width * sizeof(float), capacity)
+{
+	m_writer.start([this](const char* const* frames, size_t count) {
+		m_format.rows((const float*)frames[0], count, m_width, m_text);
+		return m_text.size() < CSV_WRITE_SIZE || write_text();
+	}, CSV_CHUNK_FRAMES, 0, [this]() { return write_text(); });
+}
+
+CsvWriter::~CsvWriter()
+{
+	close();
+}
+
+bool CsvWriter::push(const float* frames, size_t count)
+{
+	return m_writer.push(0, frames, count);
+}
+
+int CsvWriter::close()
+{
+	m_writer.stop();
+	write_text();
+	if (fflush(m_out) != 0 && !m_error)
+		m_error = -errno;
+	return m_error;
+}
+
+/// Write out the text formatted so far, returning false if writing failed.
+bool CsvWriter::write_text()
+{
+	if (!m_text.empty()) {
+		if (!m_error && fwrite(m_text.data(), 1, m_text.size(), m_out) != m_text.size())
+			m_error = -errno;
+		m_text.clear();
+	}
+	return !m_error;
+}
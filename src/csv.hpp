@@ -0,0 +1,86 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#ifndef _LIBSMU_CSV_HPP
+#define _LIBSMU_CSV_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "frame_writer.hpp"
+
+/// Longest text written by format_float() and format_float_fixed() for up to 9 decimals,
+/// without a terminating NUL: a sign, the 39 integer digits of FLT_MAX, the point and
+/// 9 decimals.
+#define FORMAT_FLOAT_MAX 50
+
+/// Write the shortest decimal text that reads back as exactly `value` into `buf`, which
+/// must have room for FORMAT_FLOAT_MAX + 1 characters, choosing plain or exponent notation
+/// by which is shorter, as std::to_chars() does. Returns the number of characters written;
+/// no NUL is appended.
+size_t format_float(char* buf, float value);
+
+/// Write `value` rounded to `decimals` digits after the point (at most 9) into `buf`, which
+/// must have room for FORMAT_FLOAT_MAX + 1 characters, as printf("%.*f") would, rounding
+/// halfway cases to even. Returns the number of characters written; no NUL is appended.
+size_t format_float_fixed(char* buf, float value, unsigned decimals);
+
+/// Formatting of frames of samples as delimited text, one row per frame.
+class CsvFormat {
+public:
+	explicit CsvFormat(char delimiter = ',', int precision = -1):
+		delimiter(delimiter), precision(precision) {}
+
+	/// separator between columns, e.g. ',' or '\t'
+	char delimiter;
+	/// digits after the point, or -1 for the shortest text that reads back as the same value
+	int precision;
+	/// indexes into each frame of the columns to write, in order; empty for all
+	std::vector<unsigned> columns;
+
+	/// Append a header row from the names of all columns of a frame.
+	void header(const std::vector<std::string>& names, std::string& out) const;
+
+	/// Append `count` frames of `width` values each as rows.
+	void rows(const float* frames, size_t count, size_t width, std::string& out) const;
+};
+
+/// Writes frames of samples as delimited text to a file on a thread of its own, so that
+/// formatting never holds up the producer. A single producer thread, e.g. a
+/// Device::measure_blocks() callback, hands frames over without blocking.
+class CsvWriter {
+public:
+	/// Write frames of `width` values to `out`, buffering up to `capacity` frames. `out` is
+	/// only written by the writer thread from here on, so write any header row, e.g. from
+	/// CsvFormat::header(), before constructing the writer.
+	CsvWriter(FILE* out, size_t width, const CsvFormat& format = CsvFormat(), size_t capacity = 1 << 18);
+	/// Closes the writer.
+	~CsvWriter();
+
+	/// Producer: queue `count` frames for writing. If the writer has fallen so far behind
+	/// that they don't fit, they are dropped and false is returned.
+	bool push(const float* frames, size_t count);
+
+	/// Write out all frames pushed so far and stop the writer thread. Returns 0 or a
+	/// negative errno value if writing failed.
+	int close();
+
+	/// Frames dropped by push().
+	uint64_t dropped() const { return m_writer.dropped(); }
+
+protected:
+	bool write_text();
+
+	FILE* const m_out;
+	const size_t m_width;
+	const CsvFormat m_format;
+	std::string m_text;
+	int m_error = 0;
+	/// last, so that the writer thread stops before the state it formats into goes away
+	FrameWriter m_writer;
+};
+
+#endif // _LIBSMU_CSV_HPP
@@ -27,8 +27,6 @@ const unsigned out_packet_size = chunk_size * 2 * 2;
 const unsigned in_packet_size = chunk_size * 4 * 2;
 
 const int m_min_per = 0x18;
-volatile uint16_t m_sof_start = 0;
-int m_sam_per = 0;
 
 #ifdef _WIN32
 const double BUFFER_TIME = 0.050;
@@ -56,7 +54,8 @@ M1000_Device::M1000_Device(Session* s, libusb_device* device):
 		{Signal(&m1000_signal_info[0]), Signal(&m1000_signal_info[1])},
 		{Signal(&m1000_signal_info[0]), Signal(&m1000_signal_info[1])},
 	},
-	m_mode{0,0}
+	m_mode{0,0},
+	m_mode_valid{false,false}
 {	}
 
 M1000_Device::~M1000_Device() {}
@@ -102,6 +101,79 @@ void M1000_Device::read_calibration() {
 			m_cal.gain_n[i] = 1.0f;
 		}
 	}
+	build_luts();
+}
+
+/// Compile the calibration into tables indexed by raw codes, so that decoding and encoding a
+/// sample is a table lookup whichever calibration model is in use.
+void M1000_Device::build_luts() {
+	vector<PiecewiseLinear> pwl;
+	for (auto& record: m_host_cal)
+		pwl.emplace_back(record);
+
+	// Calibration function for record i. Without host-side calibration this is the EEPROM
+	// offset and gains; voltages only have a positive gain.
+	auto cal = [&](unsigned i, bool bipolar, float x) -> float {
+		if (m_bypass_cal)
+			return x;
+		if (!pwl.empty())
+			return pwl[i](x);
+		return (x - m_cal.offset[i]) * (bipolar && x <= 0 ? m_cal.gain_n[i] : m_cal.gain_p[i]);
+	};
+
+	// A voltage, A current, B voltage, B current
+	static const unsigned in_records[4] = {0, 1, 4, 5};
+	vector<float> in_lut[4];
+	for (unsigned k = 0; k < 4; k++) {
+		bool current = k & 1;
+		in_lut[k].resize(65536);
+		for (unsigned c = 0; c < 65536; c++) {
+			float val = current ? ((c / 65535.0 * 0.4) - 0.195) * 1.25 : c / 65535.0 * 5.0;
+			in_lut[k][c] = cal(in_records[k], current, val);
+		}
+	}
+
+	vector<uint16_t> out_lut[2][2];
+	for (unsigned chan = 0; chan < 2; chan++) {
+		out_lut[chan][0].resize(65536);
+		out_lut[chan][1].resize(65536);
+		for (unsigned c = 0; c < 65536; c++) {
+			float val = cal(chan*4+2, false, c * 5.0 / 65535);
+			val = constrain(val, 0, 5.0);
+			out_lut[chan][0][c] = lround(65535*val/5.0);
+
+			val = cal(chan*4+3, true, (c / 65536.0 - 2./5.) / (0.8*0.2*20.*0.5));
+			val = constrain(val, -current_limit, current_limit);
+			out_lut[chan][1][c] = constrain(lround(65536*(2./5. + 0.8*0.2*20.*0.5*val)), 0, 65535);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(m_state);
+	for (unsigned k = 0; k < 4; k++)
+		m_in_lut[k].swap(in_lut[k]);
+	for (unsigned chan = 0; chan < 2; chan++) {
+		m_out_lut[chan][0].swap(out_lut[chan][0]);
+		m_out_lut[chan][1].swap(out_lut[chan][1]);
+	}
+}
+
+int M1000_Device::load_calibration(const char* cal_file_name) {
+	vector<CalibrationRecord> records;
+	if (cal_file_name) {
+		int ret = parse_calibration_file(cal_file_name, records);
+		if (ret < 0)
+			return ret;
+		if (records.size() != CALIBRATION_RECORDS)
+			return -EINVAL;
+	}
+	m_host_cal.swap(records);
+	build_luts();
+	return 0;
+}
+
+void M1000_Device::bypass_calibration(bool bypass) {
+	m_bypass_cal = bypass;
+	build_luts();
 }
 
 // Provide external read access to EEPROM calibration data.
@@ -115,78 +187,45 @@ void M1000_Device::calibration(vector<vector<float>>* cal) {
 	}
 }
 
+void M1000_Device::calibration_points(vector<vector<std::pair<float, float>>>* points) {
+	points->clear();
+	for (auto& record: m_host_cal)
+		points->push_back(record.points);
+}
+
 int M1000_Device::write_calibration(const char* cal_file_name) {
-	int cal_records_no = 0;
+	vector<vector<float>> cal;
 	int ret;
-	FILE* fp;
-	char str[128];
-	float ref[16], val[16];
-	int rec_idx;
-	int cnt_n, cnt_p;
-	float gain_p, gain_n;
 
 	// reset calibration to the defaults if NULL is passed
 	if (cal_file_name == NULL) {
-		for(int i = 0; i < 8; i++) {
-			m_cal.offset[i] = 0.0f;
-			m_cal.gain_p[i] = 1.0f;
-			m_cal.gain_n[i] = 1.0f;
-		}
-		cal_records_no = 8;
-		goto write_cal;
-	}
-
-	fp = fopen(cal_file_name, "r");
-	if(!fp) {
-		return -1;
-	}
-
-	while(fgets(str, 128, fp) != NULL) {
-		if(strstr(str, "</>")) {
-			rec_idx = 0;
-			while(fgets(str, 128, fp) != NULL) {
-				if(strstr(str, "<\\>") && rec_idx) {
-					gain_p = 0;
-					gain_n = 0;
-					cnt_n = 0;
-					cnt_p = 0;
-					m_cal.offset[cal_records_no] = val[0] - ref[0];
-					for(int i = 1; i < rec_idx; i++) {
-						if(ref[i] > 0) {
-							gain_p += ref[i] / (val[i] - m_cal.offset[cal_records_no]);
-							cnt_p++;
-						}
-						else {
-							gain_n += ref[i] / (val[i] - m_cal.offset[cal_records_no]);
-							cnt_n++;
-						}
-
-					}
-					m_cal.gain_p[cal_records_no] = cnt_p ? gain_p / (cnt_p) : 1.0f;
-					m_cal.gain_n[cal_records_no] = cnt_n ? gain_n / (cnt_n) : 1.0f;
-					cal_records_no++;
-					break;
-				}
-				else {
-					sscanf(str, "<%f, %f>", &ref[rec_idx], &val[rec_idx]);
-					rec_idx++;
-				}
-			}
-		}
+		cal.assign(8, vector<float>{0.0f, 1.0f, 1.0f});
+		return set_calibration(cal);
 	}
 
-	fclose(fp);
+	vector<CalibrationRecord> records;
+	ret = parse_calibration_file(cal_file_name, records);
+	if (ret < 0)
+		return ret;
+	ret = calibration_coefficients(records, cal);
+	if (ret < 0)
+		return ret;
+	return set_calibration(cal);
+}
 
-write_cal:
-	if(cal_records_no != 8) {
-		// invalid calibration file
-		ret = -EINVAL;
-	} else {
-		m_cal.eeprom_valid = EEPROM_VALID;
-		ret = ctrl_transfer(0x40, 0x02, 0, 0, (unsigned char*)&m_cal, sizeof(EEPROM_cal), 100);
+int M1000_Device::set_calibration(const vector<vector<float>>& cal) {
+	if (cal.size() != 8)
+		return -EINVAL;
+	for (int i = 0; i < 8; i++) {
+		if (cal[i].size() != 3)
+			return -EINVAL;
+		m_cal.offset[i] = cal[i][0];
+		m_cal.gain_p[i] = cal[i][1];
+		m_cal.gain_n[i] = cal[i][2];
 	}
-
-	return ret;
+	m_cal.eeprom_valid = EEPROM_VALID;
+	build_luts();
+	return ctrl_transfer(0x40, 0x02, 0, 0, (unsigned char*)&m_cal, sizeof(EEPROM_cal), 100);
 }
 
 /// Runs in USB thread
@@ -204,17 +243,24 @@ void M1000_Device::in_completion(libusb_transfer *t) {
 	std::lock_guard<std::mutex> lock(m_state);
 	m_in_transfers.num_active--;
 
+	// removed from its group mid-run, let the remaining transfers drain
+	if (!m_active)
+		return;
+
 	if (t->status == LIBUSB_TRANSFER_COMPLETED) {
 		handle_in_transfer(t);
 		// m_cancellation == 0, everything OK
-		if (m_session->m_cancellation == 0) {
+		if (m_group->m_cancellation == 0) {
 			submit_in_transfer(t);
 		}
+	} else if (t->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		lost();
 	} else if (t->status != LIBUSB_TRANSFER_CANCELLED) {
-		m_session->handle_error(t->status, "M1000_Device::in_completion");
+		m_group->handle_error(t->status, "M1000_Device::in_completion");
 	}
 	if (m_out_transfers.num_active == 0 && m_in_transfers.num_active == 0) {
-		m_session->completion();
+		m_active = false;
+		m_group->completion();
 	}
 }
 
@@ -233,15 +279,30 @@ void M1000_Device::out_completion(libusb_transfer *t) {
 	std::lock_guard<std::mutex> lock(m_state);
 	m_out_transfers.num_active--;
 
+	if (!m_active)
+		return;
+
 	if (t->status == LIBUSB_TRANSFER_COMPLETED) {
-		if (m_session->m_cancellation == 0) {
+		if (m_group->m_cancellation == 0) {
 			submit_out_transfer(t);
 		}
+	} else if (t->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		lost();
 	} else if (t->status != LIBUSB_TRANSFER_CANCELLED) {
-		 m_session->handle_error(t->status, "M1000_Device::out_completion");
+		 m_group->handle_error(t->status, "M1000_Device::out_completion");
 	}
 	if (m_out_transfers.num_active == 0 && m_in_transfers.num_active == 0) {
-		m_session->completion();
+		m_active = false;
+		m_group->completion();
+	}
+}
+
+/// The device was unplugged mid-run. Only this device stops; the rest of its group keeps
+/// streaming and stops waiting on its progress. Called with m_state held.
+void M1000_Device::lost() {
+	if (!m_detached) {
+		m_detached = true;
+		m_group->device_lost(this);
 	}
 }
 
@@ -269,70 +330,76 @@ void M1000_Device::configure(uint64_t rate) {
 	m_out_transfers.alloc(transfers, m_usb, EP_OUT, LIBUSB_TRANSFER_TYPE_BULK,
 		m_packets_per_transfer*out_packet_size, 10000, m1000_out_completion, this);
 	m_in_transfers.num_active = m_out_transfers.num_active = 0;
+	m_block.resize(m_packets_per_transfer*chunk_size*4);
+	m_raw_block.resize(m_packets_per_transfer*chunk_size*4);
 }
 
 /// encode output samples
 inline uint16_t M1000_Device::encode_out(unsigned chan) {
-	int v = 0;
+	// requested values are quantized to the nearest uncalibrated code and corrected from there
 	if (m_mode[chan] == SVMI) {
 		float val = m_signals[chan][0].get_sample();
-		val = (val - m_cal.offset[chan*4+2]) * m_cal.gain_p[chan*4+2];
 		val = constrain(val, 0, 5.0);
-		v = 65535*val/5.0;
+		return m_out_lut[chan][0][(unsigned)(val * (65535 / 5.0) + 0.5)];
 	} else if (m_mode[chan] == SIMV) {
 		float val = m_signals[chan][1].get_sample();
-		if(val > 0) {
-			val = (val - m_cal.offset[chan*4+3]) * m_cal.gain_p[chan*4+3];
-		}
-		else {
-			val = (val - m_cal.offset[chan*4+3]) * m_cal.gain_n[chan*4+3];
-		}
-		val = constrain(val, -current_limit, current_limit);
-		v = 65536*(2./5. + 0.8*0.2*20.*0.5*val);
+		float code = constrain(65536 * (2./5. + 0.8*0.2*20.*0.5*val) + 0.5, 0, 65535);
+		return m_out_lut[chan][1][(unsigned)code];
 	} else if (m_mode[chan] == DISABLED) {
-		v = 32768*4/5;
+		return 32768*4/5;
 	}
-	if (v > 65535) v = 65535;
-	if (v < 0) v = 0;
-	return v;
+	return 0;
 }
 
-/// submit data transfers to usb thread - from host to device
-bool M1000_Device::submit_out_transfer(libusb_transfer* t) {
-	if (m_sample_count == 0 || m_out_sampleno < m_sample_count) {
-		for (unsigned p=0; p<m_packets_per_transfer; p++) {
-			uint8_t* buf = (uint8_t*) (t->buffer + p*out_packet_size);
-			for (unsigned i=0; i < chunk_size; i++) {
-				if (strncmp(this->m_fw_version, "2.", 2) == 0) {
-					uint16_t a = encode_out(0);
-					buf[i*4+0] = a >> 8;
-					buf[i*4+1] = a & 0xff;
-					uint16_t b = encode_out(1);
-					buf[i*4+2] = b >> 8;
-					buf[i*4+3] = b & 0xff;
-				} else {
-					uint16_t a = encode_out(0);
-					buf[(i+chunk_size*0)*2	] = a >> 8;
-					buf[(i+chunk_size*0)*2+1] = a & 0xff;
-					uint16_t b = encode_out(1);
-					buf[(i+chunk_size*1)*2	] = b >> 8;
-					buf[(i+chunk_size*1)*2+1] = b & 0xff;
-				}
-				m_out_sampleno++;
+/// fill an OUT transfer with the next samples, returns false once all samples have been sent
+bool M1000_Device::encode_out_transfer(libusb_transfer* t) {
+	if (m_sample_count != 0 && m_out_sampleno >= m_sample_count)
+		return false;
+	bool interleaved = strncmp(this->m_fw_version, "2.", 2) == 0;
+	for (unsigned p=0; p<m_packets_per_transfer; p++) {
+		uint8_t* buf = (uint8_t*) (t->buffer + p*out_packet_size);
+		for (unsigned i=0; i < chunk_size; i++) {
+			if (interleaved) {
+				uint16_t a = encode_out(0);
+				buf[i*4+0] = a >> 8;
+				buf[i*4+1] = a & 0xff;
+				uint16_t b = encode_out(1);
+				buf[i*4+2] = b >> 8;
+				buf[i*4+3] = b & 0xff;
+			} else {
+				uint16_t a = encode_out(0);
+				buf[(i+chunk_size*0)*2	] = a >> 8;
+				buf[(i+chunk_size*0)*2+1] = a & 0xff;
+				uint16_t b = encode_out(1);
+				buf[(i+chunk_size*1)*2	] = b >> 8;
+				buf[(i+chunk_size*1)*2+1] = b & 0xff;
 			}
+			m_out_sampleno++;
 		}
-		int r = libusb_submit_transfer(t);
-		if (r != 0) {
-			m_out_transfers.failed(t);
-			// writes to t->status is illegal
-			// t->status = (libusb_transfer_status) r;
-			m_session->handle_error(r, "M1000_Device::submit_out_transfer");
-			return false;
-		}
-		m_out_transfers.num_active++;
-		return true;
 	}
-	return false;
+	return true;
+}
+
+/// submit an encoded OUT transfer to the usb thread
+bool M1000_Device::queue_out_transfer(libusb_transfer* t) {
+	int r = libusb_submit_transfer(t);
+	if (r != 0) {
+		m_out_transfers.failed(t);
+		// writes to t->status is illegal
+		// t->status = (libusb_transfer_status) r;
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			lost();
+		else
+			m_group->handle_error(r, "M1000_Device::submit_out_transfer");
+		return false;
+	}
+	m_out_transfers.num_active++;
+	return true;
+}
+
+/// submit data transfers to usb thread - from host to device
+bool M1000_Device::submit_out_transfer(libusb_transfer* t) {
+	return encode_out_transfer(t) && queue_out_transfer(t);
 }
 
 
@@ -343,7 +410,10 @@ bool M1000_Device::submit_in_transfer(libusb_transfer* t) {
 		if (r != 0) {
 			m_in_transfers.failed(t);
 			//t->status = (libusb_transfer_status) r;
-			m_session->handle_error(r, "M1000_Device::submit_in_transfer");
+			if (r == LIBUSB_ERROR_NO_DEVICE)
+				lost();
+			else
+				m_group->handle_error(r, "M1000_Device::submit_in_transfer");
 			return false;
 		}
 		m_in_transfers.num_active++;
@@ -355,35 +425,55 @@ bool M1000_Device::submit_in_transfer(libusb_transfer* t) {
 
 /// reformat received data - integer to float conversion
 void M1000_Device::handle_in_transfer(libusb_transfer* t) {
-	float val;
+	float* block = m_block_callback ? m_block.data() : NULL;
+	uint16_t* raw_block = m_raw_block_callback ? m_raw_block.data() : NULL;
+	bool interleaved = strncmp(this->m_fw_version, "2.", 2) == 0;
+	const float* lut_av = m_in_lut[0].data();
+	const float* lut_ai = m_in_lut[1].data();
+	const float* lut_bv = m_in_lut[2].data();
+	const float* lut_bi = m_in_lut[3].data();
 	for (unsigned p=0; p<m_packets_per_transfer; p++) {
 		uint8_t* buf = (uint8_t*) (t->buffer + p*in_packet_size);
 
 		for (unsigned i=0; i<chunk_size; i++) {
-			if (strncmp(this->m_fw_version, "2.", 2) == 0) {
-				val = (buf[i*8+0] << 8 | buf[i*8+1]) / 65535.0 * 5.0;
-				m_signals[0][0].put_sample((val - m_cal.offset[0]) * m_cal.gain_p[0]);
-				val = (((buf[i*8+2] << 8 | buf[i*8+3]) / 65535.0 * 0.4 ) - 0.195)*1.25;
-				m_signals[0][1].put_sample((val - m_cal.offset[1]) * (val > 0 ? m_cal.gain_p[1] : m_cal.gain_n[1]));
-				val = (buf[i*8+4] << 8 | buf[i*8+5]) / 65535.0 * 5.0;
-				m_signals[1][0].put_sample((val - m_cal.offset[4]) * m_cal.gain_p[4]);
-				val = (((buf[i*8+6] << 8 | buf[i*8+7]) / 65535.0 * 0.4 ) - 0.195)*1.25;
-				m_signals[1][1].put_sample((val - m_cal.offset[5]) * (val > 0 ? m_cal.gain_p[5] : m_cal.gain_n[5]));
+			uint16_t c[4];
+			if (interleaved) {
+				for (unsigned k = 0; k < 4; k++)
+					c[k] = buf[i*8+k*2] << 8 | buf[i*8+k*2+1];
 			} else {
-				val = (buf[(i+chunk_size*0)*2] << 8 | buf[(i+chunk_size*0)*2+1]) / 65535.0 * 5.0;
-				m_signals[0][0].put_sample((val - m_cal.offset[0]) * m_cal.gain_p[0]);
-				val = (((buf[(i+chunk_size*1)*2] << 8 | buf[(i+chunk_size*1)*2+1]) / 65535.0 * 0.4 ) - 0.195)*1.25;
-				m_signals[0][1].put_sample((val - m_cal.offset[1]) * (val > 0 ? m_cal.gain_p[1] : m_cal.gain_n[1]));
-				val = (buf[(i+chunk_size*2)*2] << 8 | buf[(i+chunk_size*2)*2+1]) / 65535.0 * 5.0;
-				m_signals[1][0].put_sample((val - m_cal.offset[4]) * m_cal.gain_p[4]);
-				val = (((buf[(i+chunk_size*3)*2] << 8 | buf[(i+chunk_size*3)*2+1]) / 65535.0 * 0.4) - 0.195)*1.25;
-				m_signals[1][1].put_sample((val - m_cal.offset[5]) * (val > 0 ? m_cal.gain_p[5] : m_cal.gain_n[5]));
+				for (unsigned k = 0; k < 4; k++)
+					c[k] = buf[(i+chunk_size*k)*2] << 8 | buf[(i+chunk_size*k)*2+1];
+			}
+			float s[4];
+			s[0] = lut_av[c[0]];
+			s[1] = lut_ai[c[1]];
+			s[2] = lut_bv[c[2]];
+			s[3] = lut_bi[c[3]];
+			m_signals[0][0].put_sample(s[0]);
+			m_signals[0][1].put_sample(s[1]);
+			m_signals[1][0].put_sample(s[2]);
+			m_signals[1][1].put_sample(s[3]);
+			if (block) {
+				memcpy(block, s, sizeof(s));
+				block += 4;
+			}
+			if (raw_block) {
+				memcpy(raw_block, c, sizeof(c));
+				raw_block += 4;
 			}
 			m_in_sampleno++;
 		}
 	}
 
-	m_session->progress();
+	if (m_block_callback) {
+		m_block_callback(m_block.data(), m_packets_per_transfer*chunk_size);
+	}
+	if (m_raw_block_callback) {
+		m_raw_block_callback(m_raw_block.data(), m_packets_per_transfer*chunk_size);
+	}
+
+	uint64_t prev = m_progress.exchange(m_in_sampleno, std::memory_order_relaxed);
+	m_group->progress(prev, m_in_sampleno);
 }
 
 // get device info struct
@@ -410,7 +500,11 @@ Signal* M1000_Device::signal(unsigned channel, unsigned signal) {
 /// set output mode
 void M1000_Device::set_mode(unsigned chan, unsigned mode) {
 	if (chan < 2) {
+		// the device is already in this mode, skip the control transfers
+		if (m_mode_valid[chan] && m_mode[chan] == mode)
+			return;
 		m_mode[chan] = mode;
+		m_mode_valid[chan] = true;
 	}
 	// set feedback potentiometers with mode heuristics
 	unsigned pset;
@@ -427,36 +521,70 @@ void M1000_Device::set_mode(unsigned chan, unsigned mode) {
 
 /// turn on power supplies, clear sampling state
 void M1000_Device::on() {
+	// still powered from the previous run, only stop sampling
+	if (m_powered) {
+		libusb_control_transfer(m_usb, 0x40, 0xC5, 0, 0, 0, 0, 100);
+		return;
+	}
+
 	libusb_set_interface_alt_setting(m_usb, 0, 1);
 
 	libusb_control_transfer(m_usb, 0x40, 0xC5, 0, 0, 0, 0, 100);
 	libusb_control_transfer(m_usb, 0x40, 0xCC, 0, 0, 0, 0, 100);
+	// don't trust cached channel modes across a power cycle
+	m_mode_valid[A] = m_mode_valid[B] = false;
+	m_powered = true;
+}
+
+/// get the USB frame index `delay` milliseconds in the future
+uint16_t M1000_Device::start_frame(unsigned delay) {
+	uint16_t sof = 0;
+	libusb_control_transfer(m_usb, 0xC0, 0x6F, 0, 0, (unsigned char*)&sof, 2, 100);
+	return (((sof >> 3) + delay) & 0x7FF) << 3;
 }
 
-/// get current microframe index, set m_sof_start to be time in the future
+/// get current microframe index, set the group's start frame to be time in the future
 void M1000_Device::sync() {
-	libusb_control_transfer(m_usb, 0xC0, 0x6F, 0, 0, (unsigned char*)&m_sof_start, 2, 100);
-	m_sof_start = (((m_sof_start >> 3) + 0x1f) & 0x7FF) << 3;
+	m_group->m_sof_start = start_frame(0x1f);
 }
 
-/// command device to start sampling
-void M1000_Device::start_run(uint64_t samples) {
-	int ret = libusb_control_transfer(m_usb, 0x40, 0xC5, m_sam_per, m_sof_start, 0, 0, 100);
+/// reset the sample counters and encode the first OUT transfers ahead of starting
+void M1000_Device::arm(uint64_t samples, uint64_t sampleno) {
+	std::lock_guard<std::mutex> lock(m_state);
+	m_sample_count = samples;
+	m_requested_sampleno = m_in_sampleno = m_out_sampleno = sampleno;
+	m_progress = sampleno;
+	m_detached = false;
+	m_out_armed = 0;
+	for (auto i: m_out_transfers) {
+		if (!encode_out_transfer(i)) break;
+		m_out_armed++;
+	}
+}
+
+/// command an armed device to start sampling at USB frame `sof`
+bool M1000_Device::fire(uint16_t sof) {
+	int ret = libusb_control_transfer(m_usb, 0x40, 0xC5, m_sam_per, sof, 0, 0, 100);
 	if (ret < 0) {
 		smu_debug("control transfer failed with code %i\n", ret);
-		return;
+		return false;
 	}
 	std::lock_guard<std::mutex> lock(m_state);
-	m_sample_count = samples;
-	m_requested_sampleno = m_in_sampleno = m_out_sampleno = 0;
+	m_active = true;
 
 	for (auto i: m_in_transfers) {
-		if (submit_in_transfer(i) != 0) break;
+		if (!submit_in_transfer(i)) break;
 	}
 
-	for (auto i: m_out_transfers) {
-		if (submit_out_transfer(i) != 0) break;
+	for (unsigned i = 0; i < m_out_armed; i++) {
+		if (!queue_out_transfer(m_out_transfers.m_transfers[i])) break;
+	}
+	// nothing in flight to report completion later, e.g. the device is already gone
+	if (m_out_transfers.num_active == 0 && m_in_transfers.num_active == 0) {
+		m_active = false;
+		m_group->completion();
 	}
+	return true;
 }
 
 /// cancel pending libusb transactions
@@ -472,4 +600,5 @@ void M1000_Device::off() {
 	set_mode(A, DISABLED);
 	set_mode(B, DISABLED);
 	libusb_control_transfer(m_usb, 0x40, 0xC5, 0, 0, 0, 0, 100);
+	m_powered = false;
 }
@@ -10,6 +10,7 @@
 #include <mutex>
 #include "libsmu.hpp"
 #include "internal.hpp"
+#include "calibration.hpp"
 #include <vector>
 
 using std::vector;
@@ -30,7 +31,10 @@ public:
 	virtual void set_mode(unsigned channel, unsigned mode);
 	virtual void sync();
 	virtual int write_calibration(const char* cal_file_name);
+	virtual int set_calibration(const vector<vector<float>>& cal);
+	virtual int load_calibration(const char* cal_file_name);
 	virtual void calibration(vector<vector<float>>* cal);
+	virtual void calibration_points(vector<vector<std::pair<float, float>>>* points);
 
 protected:
 	friend class Session;
@@ -43,23 +47,31 @@ protected:
 	virtual int added();
 	virtual int removed();
 	virtual void configure(uint64_t sampleRate);
-	virtual void start_run(uint64_t nsamples);
+	virtual void arm(uint64_t nsamples, uint64_t sampleno = 0);
+	virtual bool fire(uint16_t sof);
+	virtual uint16_t start_frame(unsigned delay);
 	virtual void cancel();
 	virtual void on();
 	virtual void off();
+	virtual void bypass_calibration(bool bypass);
 
 	void in_completion(libusb_transfer *t);
 	void out_completion(libusb_transfer *t);
 
+	bool encode_out_transfer(libusb_transfer* t);
+	bool queue_out_transfer(libusb_transfer* t);
 	bool submit_out_transfer(libusb_transfer* t);
 	bool submit_in_transfer(libusb_transfer* t);
 	void handle_in_transfer(libusb_transfer* t);
+	void lost();
 
 	uint16_t encode_out(unsigned chan);
 
 	unsigned m_packets_per_transfer;
 	Transfers m_in_transfers;
 	Transfers m_out_transfers;
+	/// number of OUT transfers encoded by arm(), submitted as-is by fire()
+	unsigned m_out_armed = 0;
 
 	struct EEPROM_cal{
 		uint32_t eeprom_valid;
@@ -71,10 +83,26 @@ protected:
 	void read_calibration();
 	EEPROM_cal m_cal;
 
+	/// host-side multi-point calibration, empty to use the EEPROM coefficients
+	vector<CalibrationRecord> m_host_cal;
+	/// whether calibration is bypassed to take raw readings
+	bool m_bypass_cal = false;
+	/// calibrated value for each raw ADC code of A voltage, A current, B voltage, B current
+	vector<float> m_in_lut[4];
+	/// output code for each uncalibrated output code, by channel, for voltage and current
+	vector<uint16_t> m_out_lut[2][2];
+	void build_luts();
+
 	uint64_t m_sample_count = 0;
+	/// sampling period in SAM3U timer ticks
+	int m_sam_per = 0;
 
 	Signal m_signals[2][2];
 	unsigned m_mode[2];
+	/// whether m_mode reflects the mode last written to the device
+	bool m_mode_valid[2];
+	/// whether the device is powered on from a previous run
+	bool m_powered = false;
 };
 
 #endif // _LIBSMU_DEVICE_M1000_HPP
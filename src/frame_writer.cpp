@@ -0,0 +1,96 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "frame_writer.hpp"
+#include <algorithm>
+#include <chrono>
+
+FrameWriter::FrameWriter(size_t sources, size_t frame_size, size_t capacity):
+	m_frame_size(frame_size), m_buffers(sources), m_pointers(sources)
+{
+	for (size_t i = 0; i < sources; i++)
+		m_rings.emplace_back(new RingBuffer<char>(capacity * frame_size));
+}
+
+FrameWriter::~FrameWriter()
+{
+	stop();
+}
+
+bool FrameWriter::push(size_t source, const void* frames, size_t count)
+{
+	RingBuffer<char>* ring = m_rings[source].get();
+	if (m_done)
+		return false;
+	if (ring->space() < count * m_frame_size) {
+		m_dropped += count;
+		return false;
+	}
+	ring->write((const char*)frames, count * m_frame_size);
+	return true;
+}
+
+void FrameWriter::start(WriteFunc write, size_t chunk, uint64_t limit, IdleFunc idle, bool stop_on_drop)
+{
+	m_write = write;
+	m_idle = idle;
+	m_chunk = chunk;
+	m_limit = limit;
+	m_stop_on_drop = stop_on_drop;
+	for (auto& buf: m_buffers)
+		buf.resize(chunk * m_frame_size);
+	m_stop = false;
+	m_done = false;
+	m_thread = std::thread(&FrameWriter::run, this);
+}
+
+void FrameWriter::stop()
+{
+	if (m_thread.joinable()) {
+		m_stop = true;
+		m_thread.join();
+	}
+}
+
+void FrameWriter::run()
+{
+	while (true) {
+		// stop only once everything pushed before being told to has been written
+		bool stopping = m_stop;
+
+		if (m_stop_on_drop && m_dropped) {
+			m_failed = true;
+			break;
+		}
+
+		size_t count = m_rings.empty() ? 0 : m_chunk;
+		for (auto& ring: m_rings)
+			count = std::min(count, ring->size() / m_frame_size);
+		if (m_limit)
+			count = std::min<uint64_t>(count, m_limit - m_frames);
+
+		if (count == 0) {
+			if (stopping || (m_limit && m_frames == m_limit))
+				break;
+			if (m_idle && !m_idle()) {
+				m_failed = true;
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			continue;
+		}
+
+		for (size_t i = 0; i < m_rings.size(); i++) {
+			m_rings[i]->read(m_buffers[i].data(), count * m_frame_size);
+			m_pointers[i] = m_buffers[i].data();
+		}
+		bool ok = m_write(m_pointers.data(), count);
+		m_frames += count;
+		if (!ok) {
+			m_failed = true;
+			break;
+		}
+	}
+	m_done = true;
+}
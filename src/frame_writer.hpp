@@ -0,0 +1,81 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#ifndef _LIBSMU_FRAME_WRITER_HPP
+#define _LIBSMU_FRAME_WRITER_HPP
+
+#include "ring_buffer.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/// Hands frames of samples from producers to a thread of its own that writes them out, so
+/// that writing never holds up the producers, e.g. Device::measure_blocks() callbacks on the
+/// USB thread. Each source, e.g. a device, has a lock-free ring buffer with a single producer,
+/// and the writer thread takes the same number of frames from every source at a time.
+class FrameWriter {
+public:
+	/// Called on the writer thread with `count` frames of every source, those of source i
+	/// starting at `frames[i]`. Returns false to stop writing, e.g. on failure.
+	typedef std::function<bool(const char* const* frames, size_t count)> WriteFunc;
+	/// Called on the writer thread when no frames are waiting. Returns false to stop writing.
+	typedef std::function<bool()> IdleFunc;
+
+	/// Buffer up to `capacity` frames of `frame_size` bytes for each of `sources` sources.
+	FrameWriter(size_t sources, size_t frame_size, size_t capacity);
+	/// Stops the writer thread.
+	~FrameWriter();
+
+	/// Producer of `source`: queue `count` frames. If the writer has fallen so far behind
+	/// that they don't fit, they are dropped and false is returned. Frames pushed once the
+	/// writer thread has finished are ignored.
+	bool push(size_t source, const void* frames, size_t count);
+
+	/// Start the writer thread, handing frames to `write` at most `chunk` at a time and
+	/// `limit` in total, or without limit for 0. With `stop_on_drop`, writing stops as soon
+	/// as push() has dropped frames.
+	void start(WriteFunc write, size_t chunk, uint64_t limit = 0, IdleFunc idle = nullptr,
+		bool stop_on_drop = false);
+
+	/// Let the writer thread hand over all frames pushed so far, then stop it.
+	void stop();
+
+	/// Whether writing stopped early, because `write` or `idle` failed or frames were dropped
+	/// with `stop_on_drop`.
+	bool failed() const { return m_failed; }
+
+	/// Frames handed to `write` so far.
+	uint64_t frames() const { return m_frames; }
+
+	/// Frames dropped by push() while the writer thread was running.
+	uint64_t dropped() const { return m_dropped; }
+
+protected:
+	void run();
+
+	const size_t m_frame_size;
+	std::vector<std::unique_ptr<RingBuffer<char>>> m_rings;
+	/// one chunk of frames per source, on the writer thread
+	std::vector<std::vector<char>> m_buffers;
+	std::vector<const char*> m_pointers;
+
+	WriteFunc m_write;
+	IdleFunc m_idle;
+	size_t m_chunk = 0;
+	uint64_t m_limit = 0;
+	bool m_stop_on_drop = false;
+
+	std::thread m_thread;
+	std::atomic<bool> m_stop{false};
+	std::atomic<bool> m_failed{false};
+	/// set when the writer thread has finished, after which nothing is read from the rings
+	std::atomic<bool> m_done{false};
+	std::atomic<uint64_t> m_frames{0};
+	std::atomic<uint64_t> m_dropped{0};
+};
+
+#endif // _LIBSMU_FRAME_WRITER_HPP
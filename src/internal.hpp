@@ -22,14 +22,23 @@ inline static float constrain(float val, float lo, float hi){
 struct Transfers {
 	std::vector<libusb_transfer*> m_transfers;
 
-	/// allocates a new collection of libusb transfers
+	/// allocates a new collection of libusb transfers, reusing the existing ones when there
+	/// are as many of them and their buffers are large enough
 	void alloc(unsigned count, libusb_device_handle* handle,
 			   unsigned char endpoint, unsigned char type, size_t buf_size,
 			   unsigned timeout, libusb_transfer_cb_fn callback, void* user_data) {
-		clear();
-		m_transfers.resize(count, NULL);
+		bool reuse = m_transfers.size() == count && buf_size <= m_buf_size;
+		if (!reuse) {
+			clear();
+			m_transfers.resize(count, NULL);
+			m_buf_size = buf_size;
+		}
 		for (size_t i=0; i<count; i++) {
-			auto t = m_transfers[i] = libusb_alloc_transfer(0);
+			if (!reuse) {
+				m_transfers[i] = libusb_alloc_transfer(0);
+				m_transfers[i]->buffer = (uint8_t*) malloc(buf_size);
+			}
+			auto t = m_transfers[i];
 			t->dev_handle = handle;
 			t->flags = LIBUSB_TRANSFER_FREE_BUFFER;
 			t->endpoint = endpoint;
@@ -38,7 +47,6 @@ struct Transfers {
 			t->length = buf_size;
 			t->callback = callback;
 			t->user_data = user_data;
-			t->buffer = (uint8_t*) malloc(buf_size);
 		}
 	}
 
@@ -60,6 +68,7 @@ struct Transfers {
 		if (num_active != 0)
 			smu_debug("num_active after free: %i\n", num_active);
 		m_transfers.clear();
+		m_buf_size = 0;
 	}
 
 	/// signal cleanup - stop streaming and cleanup libusb state
@@ -99,6 +108,9 @@ struct Transfers {
 
 	// count of pending transfers
 	int32_t num_active;
+
+	// size of each allocated transfer buffer
+	size_t m_buf_size = 0;
 };
 
 #endif // _LIBSMU_INTERNAL_HPP
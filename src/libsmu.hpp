@@ -17,6 +17,12 @@
 #include <thread>
 #include <cmath>
 #include <vector>
+#include <functional>
+#include <unordered_map>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <utility>
 
 using std::vector;
 
@@ -36,6 +42,10 @@ using std::vector;
 
 class Device;
 class Signal;
+class Group;
+class Session;
+class Capture;
+class FlashJob;
 struct libusb_device;
 struct libusb_device_handle;
 struct libusb_context;
@@ -92,109 +102,496 @@ typedef struct sl_device_info {
 	size_t channel_count;
 } sl_device_info;
 
-class Session {
-public:
-	Session();
-	~Session();
+/// Timeout for Group::wait_for_completion(), Capture::wait() and FlashJob::wait() that waits
+/// for completion however long it takes. A timeout of 0 only checks, without blocking.
+static const unsigned WAIT_FOREVER = ~0u;
 
-	static const char* get_libsmu_version() { return LIBSMU_VERSION; };
+/// A set of devices that is configured, started and stopped together. Devices in a group
+/// share a sample rate and start synchronized; different groups in the same session run
+/// independently of each other on the session's USB thread. The Session itself is the
+/// default group.
+class Group {
+public:
+	virtual ~Group() {}
 
-	int update_available_devices();
-	unsigned m_active_devices;
+	unsigned m_active_devices = 0;
 
-	/// Devices that are present on the system, but aren't necessarily in bound to this session.
-	/// Only `Device::serial` and `Device::info` may be called on a Device that is not added to
-	/// the session.
-	vector<std::shared_ptr<Device>> m_available_devices;
-
-	/// Add a device (from m_available_devices) to the session.
-	/// This method may not be called while the session is active.
+	/// Add a device (from Session::m_available_devices) to the group, removing it from any
+	/// other group it belongs to.
+	/// This method may not be called while either group is active.
 	Device* add_device(Device*);
 
-	/// Devices that are part of this session. These devices will be started when start() is called.
+	/// Devices that are part of this group. These devices will be started when start() is called.
 	/// Use `add_device` and `remove_device` to manipulate this list.
 	std::set<Device*> m_devices;
 
-	/// get the device matching a given serial from the session
+	/// get the device matching a given serial from the group
 	Device* get_device(const char* serial);
 
-	/// Remove a device from the session.
-	/// This method may not be called while the session is active
-	void remove_device(Device*);
+	/// get the device attached at a given USB port path (e.g. "1-2.3") from the group
+	Device* get_device_by_path(const char* path);
 
-	/// Remove a device from the list of available devices.
-	/// Devices are automatically added to this list on attach.
-	/// Devies must be removed from this list on detach.
-	/// This method may not be called while the session is active
-	void destroy_available(Device*);
+	/// get the device matching a given handle from the group
+	Device* get_device_by_handle(unsigned handle);
 
-	/// Configure the session's sample rate.
-	/// This method may not be called while the session is active.
+	/// Remove a device from the group. A device may be removed while the group is active,
+	/// e.g. after it has been unplugged; its transfers are cancelled and the rest of the
+	/// group keeps running.
+	void remove_device(Device*);
+
+	/// Add a device to the group while a capture is running, starting it so that its first
+	/// sample is sample number `sampleno` of the running capture. Devices start on USB frame
+	/// boundaries, so `sampleno` must be far enough in the future for the device to be set
+	/// up but less than about two seconds ahead, and the device must be on the same USB bus
+	/// as the rest of the group.
+	///
+	/// In groups of several devices, which start on a common USB frame, the device is started
+	/// from the frame counters and its first sample is exactly `sampleno`, which must then
+	/// fall on a frame boundary (a multiple of the sample rate / 1000). A single device starts
+	/// as soon as it can rather than on a known frame, so joining its group is only aligned
+	/// by the host clock and may be a few milliseconds' worth of samples off.
+	///
+	/// Returns 0 on success or a negative errno value.
+	int join(Device*, uint64_t sampleno);
+
+	/// Configure the group's sample rate.
+	/// This method may not be called while the group is active.
 	void configure(uint64_t sampleRate);
 
-	/// Run the currently configured capture and wait for it to complete
-	void run(uint64_t nsamples);
+	/// Run the currently configured capture and wait for it to complete. With `power_off`
+	/// false the devices are left powered as for end(false).
+	void run(uint64_t nsamples, bool power_off = true);
 
 	/// Start the currently configured capture, but do not wait for it to complete. Once started,
-	/// the only allowed Session methods are cancel() and end() until the session has stopped.
+	/// the only allowed Group methods are cancel() and end() until the group has stopped.
 	void start(uint64_t nsamples);
 
+	/// Start the currently configured capture and return a handle that can be polled, waited
+	/// on with a timeout, cancelled, or used to chain further captures. The same restrictions
+	/// as for start() apply until the capture has completed.
+	std::shared_ptr<Capture> start_async(uint64_t nsamples);
+
+	/// Prepare a capture of `nsamples` without starting it: the devices are powered on, their
+	/// counters reset and their first outgoing transfers encoded from the current signal
+	/// sources, so that fire() only has to send one start request per device. Set up modes and
+	/// sources before arming. Returns a handle to the capture, which runs once fired.
+	/// Until then the only allowed Group methods are fire() and cancel().
+	std::shared_ptr<Capture> arm(uint64_t nsamples);
+
+	/// Start the capture prepared by arm(). Does not wait for it to complete.
+	void fire();
+
 	/// Cancel capture and block waiting for it to complete
 	void cancel();
 
-	/// Update device firmware for a given device. When device is NULL the
-	/// first attached device will be used instead.
-	void flash_firmware(const char *file, Device* device = NULL);
-
 	/// internal: Called by devices on the USB thread when they are complete
 	void completion();
 
 	/// internal: Called by devices on the USB thread when a device encounters an error
 	void handle_error(int status, const char * tag);
 
-	/// internal: Called by devices on the USB thread with progress updates
-	void progress();
-	/// internal: called by hotplug events on the USB thread
-	void attached(libusb_device* device);
-	void detached(libusb_device* device);
+	/// internal: Called by devices on the USB thread when they have disappeared mid-run
+	void device_lost(Device* device);
+
+	/// internal: Called by devices on the USB thread after a device's progress moved from
+	/// `prev` to `sampleno` samples
+	void progress(uint64_t prev, uint64_t sampleno);
+
+	/// Check whether all devices have completed without blocking.
+	bool done();
 
-	/// Block until all devices have completed
-	void wait_for_completion();
+	/// Block until all devices have completed or `timeout` milliseconds have passed, or
+	/// without a timeout for WAIT_FOREVER. Returns true if all devices have completed.
+	bool wait_for_completion(unsigned timeout = WAIT_FOREVER);
 
-	/// Block until all devices have completed, then turn off the devices
-	void end();
+	/// Block until all devices have completed, then turn off the devices. Gives up waiting
+	/// one second after the configured number of samples should have been captured.
+	/// With `power_off` false the devices stay powered in their current modes, so that a
+	/// following configure() and start() can skip powering them on again.
+	void end(bool power_off = true);
 
 	/// Callback called on the USB thread with the sample number as samples are received
 	std::function<void(uint64_t)> m_progress_callback;
 
+	/// Minimum time in milliseconds between calls to m_progress_callback; 0 reports every
+	/// advance. The final sample number of a capture is always reported.
+	unsigned m_progress_interval = 0;
+
 	/// Callback called on the USB thread on completion
 	std::function<void(unsigned)> m_completion_callback;
 
-	/// Callback called on the USB thread when a device is plugged into the system
+	unsigned m_cancellation = 0;
+
+	/// internal: USB frame number at which synchronized devices in the group start sampling
+	uint16_t m_sof_start = 0;
+	/// internal: whether the running capture started on frame m_sof_start
+	bool m_frame_start = false;
+
+	/// Get the session the group belongs to.
+	Session* session() const { return m_session; }
+
+protected:
+	Group(Session* s): m_session(s) {}
+	friend class Session;
+	friend class Capture;
+
+	Session* const m_session;
+
+	/// Lowest progress of any device in the group and the number of devices at that value.
+	/// Protected by m_lock; m_min_progress may be read without it as a hint.
+	std::atomic<uint64_t> m_min_progress{0};
+	size_t m_min_count = 0;
+	void update_min_progress();
+	void drop_progress(Device* device);
+	/// Last progress value passed to m_progress_callback and when.
+	uint64_t m_reported_progress = 0;
+	std::chrono::steady_clock::time_point m_reported_time;
+	void report_progress();
+
+	uint64_t m_sample_rate = 0;
+	uint64_t m_nsamples = 0;
+	/// Approximate time at which sample 0 of the running capture was taken
+	std::chrono::steady_clock::time_point m_start_time;
+
+	/// Capture currently running or most recently run. Protected by m_lock.
+	std::shared_ptr<Capture> m_capture;
+	/// Capture prepared by arm() and not yet fired. Protected by m_lock.
+	std::shared_ptr<Capture> m_armed;
+	/// Whether the running capture has received any samples yet
+	std::atomic<bool> m_data_seen{false};
+	void prepare(std::shared_ptr<Capture> capture);
+	void launch(std::shared_ptr<Capture> capture);
+
+	std::mutex m_lock;
+	std::condition_variable m_completion;
+};
+
+/// Outcome of flashing one device with Session::flash_firmware() or flash_firmware_all()
+struct FlashResult {
+	/// serial number of the device before it was flashed
+	std::string serial;
+	/// USB port path the device and its bootloader are attached to
+	std::string path;
+	bool ok = false;
+	/// reason flashing failed when not ok
+	std::string error;
+	/// flash pages covered by the image
+	unsigned pages = 0;
+	/// pages that differed from the image and were rewritten
+	unsigned written = 0;
+	/// rewritten pages whose readback matched the image
+	unsigned verified = 0;
+	/// page being written when flashing failed, -1 if the failure wasn't page specific
+	int failed_page = -1;
+	/// whether flashing stopped because it was cancelled
+	bool cancelled = false;
+};
+
+/// Progress of a FlashJob, as of the last flash page handled
+struct FlashProgress {
+	/// pages compared or written so far, out of the pages covered by the image
+	unsigned pages = 0;
+	unsigned total_pages = 0;
+	/// pages that had to be rewritten so far, and their size in bytes
+	unsigned written = 0;
+	uint64_t bytes = 0;
+	/// seconds since the job started
+	double elapsed = 0;
+	/// rewrite throughput in bytes per second
+	double bytes_per_second = 0;
+	/// estimated seconds until the job finishes
+	double eta = 0;
+};
+
+
+/// Outcome of writing calibration data to one device with Session::import_calibration() or
+/// Session::calibrate()
+struct CalibrationResult {
+	/// serial number of the device
+	std::string serial;
+	/// calibration file used, empty if none matched the device; for calibrate() the file
+	/// the measured points were saved to, if any
+	std::string file;
+	/// result of writing the calibration as for Device::write_calibration(), or of
+	/// Device::load_calibration() for host-side calibration; -ENOENT if no file matched.
+	/// calibrate() also fails with -ERANGE when a reading is too far off to be a correctly
+	/// connected device, -EIO when the device stopped sampling and -ECANCELED when cancelled.
+	int status = 0;
+	/// what went wrong when calibrate() failed
+	std::string error;
+	/// (reference, measured) points taken by calibrate() for each record of a calibration file
+	vector<vector<std::pair<float, float>>> points;
+	/// coefficients written by calibrate(), in the layout of Device::calibration()
+	vector<vector<float>> coefficients;
+};
+
+/// Test setup for Session::calibrate(). All devices are wired to the same reference voltage,
+/// e.g. a bench supply or each device's own 2.5V pin, whose actual value has been measured.
+struct CalibrationSetup {
+	/// measured voltage of the reference
+	float reference = 2.5;
+	/// resistor in ohms between each channel and the reference for calibrating currents;
+	/// +/-100mA must be reachable within the 0-5V output range, e.g. 2.5-25 ohms for 2.5V
+	float resistance = 10;
+	/// samples taken for each reading, the first quarter of which are discarded while
+	/// the channels settle
+	uint64_t samples = 40000;
+	/// directory to save each device's measured points to as a calibration file named after
+	/// its serial number and the time, empty to not save them
+	std::string dir;
+};
+
+class Session: public Group {
+public:
+	Session();
+	~Session();
+
+	static const char* get_libsmu_version() { return LIBSMU_VERSION; };
+
+	int update_available_devices();
+
+	/// Devices that are present on the system, but aren't necessarily in bound to this session.
+	/// Only `Device::serial` and `Device::info` may be called on a Device that is not added to
+	/// the session.
+	vector<std::shared_ptr<Device>> m_available_devices;
+
+	/// Remove a device from the list of available devices.
+	/// Devices are automatically added to this list on attach.
+	/// Devies must be removed from this list on detach.
+	/// This method may not be called while the session is active
+	void destroy_available(Device*);
+
+	/// Create a new, empty device group using this session's USB handling. The group is
+	/// owned by the session and stays valid until it is passed to remove_group().
+	Group* add_group();
+
+	/// Remove a group created by add_group(), returning its devices to no group.
+	/// This method may not be called while the group is active.
+	void remove_group(Group*);
+
+	/// Write calibration data from a directory of calibration files to all matching devices,
+	/// by default all devices in the session. A file matches a device when its name contains
+	/// the device's serial number; if several do, the last in name order is used, so that
+	/// date-stamped names pick the newest. Files are parsed and devices written in parallel.
+	/// With `host` true the files are applied with Device::load_calibration() instead of
+	/// being written to the EEPROM, and are remembered by serial number so that the same
+	/// calibration is applied when a device is reattached.
+	vector<CalibrationResult> import_calibration(const char* dir, vector<Device*> devices = vector<Device*>(),
+		bool host = false);
+
+	/// Calibrate devices against the reference described by `setup`, by default all devices in
+	/// the session. All devices are measured at once in a group of their own, stage by stage:
+	/// channels to GND, to the reference, open, and through the resistor to the reference.
+	/// `prompt` is called with instructions for the operator before each stage and returns
+	/// false to cancel; without it the stages run back to back. Devices that pass every stage
+	/// have the resulting coefficients written to their EEPROM in parallel and any host-side
+	/// calibration dropped; the others keep their previous calibration. Returns a report per
+	/// device in the order given.
+	vector<CalibrationResult> calibrate(const CalibrationSetup& setup, vector<Device*> devices = vector<Device*>(),
+		std::function<bool(const char* instructions)> prompt = nullptr);
+
+	/// Update device firmware for a given device. When device is NULL the
+	/// first attached device will be used instead. Only flash pages that differ from the
+	/// image are rewritten, and every rewritten page is verified. Throws on failure.
+	FlashResult flash_firmware(const char *file, Device* device = NULL);
+
+	/// Update device firmware like flash_firmware(), but on a separate thread. `progress` is
+	/// called from that thread after every flash page. Errors are reported in the job's
+	/// result instead of being thrown. The session must outlive the job.
+	std::shared_ptr<FlashJob> flash_firmware_async(const char *file, Device* device = NULL,
+		std::function<void(const FlashProgress& progress)> progress = nullptr);
+
+	/// Update device firmware on several devices concurrently, by default all devices in the
+	/// session. Each device's bootloader is matched to it by USB port path, so the devices
+	/// must stay plugged into the same ports. `progress` is called from the flashing threads
+	/// as pages are written. Returns a result per device in the order given; errors are
+	/// reported there rather than thrown, except for an unreadable firmware file.
+	vector<FlashResult> flash_firmware_all(const char *file, vector<Device*> devices = vector<Device*>(),
+		std::function<void(const FlashResult& device, unsigned pages, unsigned total)> progress = nullptr);
+
+	/// internal: called by hotplug events on the worker thread
+	void attached(libusb_device* device);
+	void detached(libusb_device* device);
+
+	/// internal: Queue work to be run on the session's worker thread. Used for anything
+	/// that has to happen in response to USB events but may block, e.g. capture continuations.
+	void post(std::function<void()> work);
+
+	/// internal: Native handle of the thread handling USB events, e.g. for measuring the
+	/// CPU time it uses.
+	std::thread::native_handle_type usb_thread_handle() { return m_usb_thread.native_handle(); }
+
+	/// Callback called on the worker thread when a device is removed from the system
 	std::function<void(Device* device)> m_hotplug_detach_callback;
 
-	/// Callback called on the USB thread when a device is removed from the system
+	/// Callback called on the worker thread when a device is plugged into the system
 	std::function<void(Device* device)> m_hotplug_attach_callback;
 
-	unsigned m_cancellation = 0;
-
 protected:
-	uint64_t m_min_progress = 0;
+	friend class Group;
+
+	vector<std::unique_ptr<Group>> m_groups;
+
+	/// Host-side calibration files by device serial number. Protected by m_lock_devlist.
+	std::unordered_map<std::string, std::string> m_host_calibration;
+
+	void flash_device(const char *file, Device* device, FlashResult& result,
+		std::function<void(unsigned pages, unsigned total)> progress, const std::atomic<bool>* cancel);
+
+	/// Held while starting a group so concurrent group starts don't interleave their
+	/// control transfers.
+	std::mutex m_start_lock;
 
 	void start_usb_thread();
 	std::thread m_usb_thread;
 	bool m_usb_thread_loop;
 
-	std::mutex m_lock;
+	void start_worker_thread();
+	std::thread m_worker_thread;
+	bool m_worker_thread_loop;
+	std::mutex m_worker_lock;
+	std::condition_variable m_worker_cv;
+	std::deque<std::function<void()>> m_work;
+
 	std::mutex m_lock_devlist;
-	std::condition_variable m_completion;
 
 	libusb_context* m_usb_cx;
 
+	/// Hash tables over m_available_devices, rebuilt whenever the device list changes.
+	struct DeviceIndex {
+		std::unordered_map<std::string, std::shared_ptr<Device>> serial;
+		std::unordered_map<std::string, std::shared_ptr<Device>> path;
+		std::unordered_map<unsigned, std::shared_ptr<Device>> handle;
+	};
+	/// Protected by m_index_lock.
+	DeviceIndex m_index;
+
+	/// The one lock device lookups take, so that they never wait for m_lock_devlist during
+	/// hotplug or for a group's m_lock. Protects m_index and Device::m_group, which lookups
+	/// check to find only the devices of a group. Nothing else is locked while holding it.
+	std::mutex m_index_lock;
+
+	/// Handles assigned so far, keyed by serial. Protected by m_lock_devlist.
+	std::unordered_map<std::string, unsigned> m_handles;
+	unsigned m_next_handle = 1;
+
+	/// Add a device to m_available_devices, assigning its handle. Caller holds m_lock_devlist.
+	void register_device(std::shared_ptr<Device> dev);
+
+	/// Rebuild the device index. Caller holds m_lock_devlist.
+	void update_index();
+
 	std::shared_ptr<Device> probe_device(libusb_device* device);
 	std::shared_ptr<Device> find_existing_device(libusb_device* device);
 };
 
+/// Handle to a capture started with Session::start_async().
+class Capture: public std::enable_shared_from_this<Capture> {
+public:
+	/// Number of samples requested, 0 for a continuous capture.
+	const uint64_t m_nsamples;
+
+	/// Check whether the capture has completed without blocking.
+	bool done();
+
+	/// Block until the capture has completed or `timeout` milliseconds have passed, or without a
+	/// timeout for WAIT_FOREVER. Returns true if the capture has completed.
+	bool wait(unsigned timeout = WAIT_FOREVER);
+
+	/// Request cancellation of the capture. Does not block; use wait() for that. A capture
+	/// that hasn't been started yet, e.g. one chained with then_run(), completes with
+	/// LIBUSB_TRANSFER_CANCELLED instead of starting.
+	void cancel();
+
+	/// Get the completion status of the capture: 0 if it ran to completion, otherwise the
+	/// libusb error or LIBUSB_TRANSFER_CANCELLED status that stopped it.
+	unsigned status();
+
+	/// Get the group the capture runs on.
+	Group* group() const { return m_group; }
+
+	/// Time from the start of arming to firing the capture, i.e. the setup work that
+	/// Group::arm() moves out of the start path. Zero until the capture has been fired.
+	std::chrono::microseconds arm_to_fire();
+
+	/// Time from firing the capture until the first transfer of samples arrived from any
+	/// device. The first sample was taken up to one transfer's duration before that.
+	/// Zero until samples have arrived.
+	std::chrono::microseconds fire_to_data();
+
+	/// Call `callback` on the session worker thread once the capture has completed.
+	/// Callbacks added after completion are queued immediately.
+	void then(std::function<void(Capture&)> callback);
+
+	/// Start a follow-up capture of `nsamples` as soon as this one completes successfully,
+	/// calling `prepare` first on the worker thread, e.g. to change signal sources. If this
+	/// capture fails or is cancelled, the returned capture completes with the same status
+	/// without being started.
+	std::shared_ptr<Capture> then_run(uint64_t nsamples, std::function<void()> prepare = nullptr);
+
+protected:
+	Capture(Group* g, uint64_t nsamples): m_nsamples(nsamples), m_group(g) {}
+	friend class Group;
+
+	/// internal: Mark the capture complete and dispatch its callbacks.
+	void complete(unsigned status);
+
+	Group* const m_group;
+	std::mutex m_lock;
+	std::condition_variable m_completion;
+	bool m_done = false;
+	unsigned m_status = 0;
+	/// set by cancel(), so that a capture cancelled before being started never starts
+	bool m_cancelled = false;
+	bool cancelled();
+	vector<std::function<void(Capture&)>> m_callbacks;
+
+	std::chrono::steady_clock::time_point m_armed_at;
+	std::chrono::steady_clock::time_point m_fired_at;
+	std::chrono::steady_clock::time_point m_data_at;
+};
+
+/// Handle to a firmware update started with Session::flash_firmware_async().
+class FlashJob {
+public:
+	/// Destroying a running job cancels it and waits for it to stop.
+	~FlashJob();
+
+	/// Check whether the job has finished without blocking.
+	bool done();
+
+	/// Block until the job has finished or `timeout` milliseconds have passed, or without a
+	/// timeout for WAIT_FOREVER. Returns true if the job has finished.
+	bool wait(unsigned timeout = WAIT_FOREVER);
+
+	/// Request cancellation. Flashing stops before the next page is written; the page being
+	/// written is always completed. The device is left in the bootloader, so flashing can
+	/// be retried. Does not block; use wait() for that.
+	void cancel() { m_cancel = true; }
+
+	/// Get the latest progress.
+	FlashProgress progress();
+
+	/// Wait for the job to finish and get its result.
+	FlashResult result();
+
+protected:
+	FlashJob() {}
+	friend class Session;
+
+	std::thread m_thread;
+	std::atomic<bool> m_cancel{false};
+	std::mutex m_lock;
+	std::condition_variable m_completion;
+	bool m_done = false;
+	FlashProgress m_progress;
+	FlashResult m_result;
+};
+
+/// Signals per sample handed to Device::measure_blocks() and Device::measure_raw_blocks()
+/// callbacks: A voltage, A current, B voltage and B current.
+static const unsigned BLOCK_SIGNALS = 4;
+
 class Device {
 public:
 	virtual ~Device();
@@ -218,6 +615,15 @@ public:
 	virtual const char* fwver() const { return this->m_fw_version; }
 	virtual const char* hwver() const { return this->m_hw_version; }
 
+	/// Get the USB port path of the device, e.g. "1-2.3" for bus 1, hub port 2, port 3.
+	/// This method may be called on a device that is not added to the session.
+	virtual const char* path() const { return this->m_path; }
+
+	/// Get the session handle of the device. Handles are nonzero and stay the same for a
+	/// given serial number across hotplug events for the lifetime of the session.
+	/// This method may be called on a device that is not added to the session.
+	unsigned handle() const { return m_handle; }
+
 	/// Set the mode of the specified channel.
 	/// This method may not be called while the session is active.
 	virtual void set_mode(unsigned channel, unsigned mode) = 0;
@@ -226,8 +632,9 @@ public:
 	int ctrl_transfer(unsigned bmRequestType, unsigned bRequest, unsigned wValue, unsigned wIndex,
 		               unsigned char *data, unsigned wLength, unsigned timeout);
 
-	/// Force the device into SAM-BA command mode.
-	void samba_mode();
+	/// Force the device into SAM-BA command mode. With `wait` false, return right after the
+	/// request instead of giving the bootloader a second to enumerate.
+	void samba_mode(bool wait = true);
 
 	/// Get the default sample rate.
 	virtual int get_default_rate() { return 10000; }
@@ -245,9 +652,36 @@ public:
 	/// Write the device calibration data into the EEPROM.
 	virtual int write_calibration(const char* cal_file_name) { return 0; }
 
+	/// Write calibration coefficients into the EEPROM, in the layout returned by calibration().
+	virtual int set_calibration(const vector<vector<float>>& cal) { return 0; }
+
+	/// Calibrate from a calibration file kept on the host instead of the EEPROM coefficients,
+	/// interpolating piecewise-linearly between all of the file's points rather than
+	/// reducing them to an offset and two gains. NULL returns to the EEPROM calibration.
+	/// Calibration is compiled into lookup tables either way, so it costs nothing per sample.
+	virtual int load_calibration(const char* cal_file_name) { return 0; }
+
 	/// Get the device calibration data from the EEPROM.
 	virtual void calibration(vector<vector<float>>* cal) {};
 
+	/// Get the (reference, measured) points of the host-side calibration applied with
+	/// load_calibration(), one vector per record; none while the EEPROM calibration is used.
+	virtual void calibration_points(vector<vector<std::pair<float, float>>>* points) { points->clear(); }
+
+	/// Configure received samples to also be passed to `callback` a transfer at a time, on the
+	/// USB thread. Samples are interleaved by channel and signal, each of the `count` samples
+	/// being BLOCK_SIGNALS values [A voltage, A current, B voltage, B current]. Pass an empty
+	/// function to disable. This method may not be called while the session is active.
+	void measure_blocks(std::function<void(const float* samples, size_t count)> callback) {
+		m_block_callback = callback;
+	}
+
+	/// Like measure_blocks(), but pass the raw 16-bit ADC codes as received from the device,
+	/// before calibration is applied.
+	void measure_raw_blocks(std::function<void(const uint16_t* codes, size_t count)> callback) {
+		m_raw_block_callback = callback;
+	}
+
 protected:
 	Device(Session* s, libusb_device* d);
 	virtual int init();
@@ -257,10 +691,26 @@ protected:
 
 	virtual void on() = 0;
 	virtual void off() = 0;
-	virtual void start_run(uint64_t nsamples) = 0;
 	virtual void cancel() = 0;
 
+	/// Prepare to capture `nsamples` with samples numbered from `sampleno`, doing everything
+	/// short of starting the device.
+	virtual void arm(uint64_t nsamples, uint64_t sampleno = 0) = 0;
+
+	/// Start an armed device at USB frame `sof`, or immediately for 0, and queue its
+	/// transfers. Returns false if the device could not be started.
+	virtual bool fire(uint16_t sof) = 0;
+
+	/// Get the USB frame number `delay` milliseconds from now, for use as a start frame.
+	virtual uint16_t start_frame(unsigned delay) { return 0; }
+
+	/// Measure and source uncalibrated values while `bypass` is true, for calibrating.
+	virtual void bypass_calibration(bool bypass) {}
+
 	Session* const m_session;
+	/// Group the device has been added to, NULL if none. Written under
+	/// Session::m_index_lock.
+	Group* m_group = NULL;
 	libusb_device* const m_device = NULL;
 	libusb_device_handle* m_usb = NULL;
 
@@ -269,12 +719,28 @@ protected:
 	uint64_t m_in_sampleno = 0;
 	uint64_t m_out_sampleno = 0;
 
+	/// m_in_sampleno as of the last completed transfer, readable from any thread
+	std::atomic<uint64_t> m_progress{0};
+
+	/// Whether the device still counts towards its group's running capture. Protected by m_state.
+	bool m_active = false;
+	/// Whether the device disappeared during the running capture
+	std::atomic<bool> m_detached{false};
+
 	std::mutex m_state;
 
+	std::function<void(const float* samples, size_t count)> m_block_callback;
+	vector<float> m_block;
+	std::function<void(const uint16_t* codes, size_t count)> m_raw_block_callback;
+	vector<uint16_t> m_raw_block;
+
 	char m_fw_version[32];
 	char m_hw_version[32];
 	char serial_num[32];
+	char m_path[32];
+	unsigned m_handle = 0;
 	friend class Session;
+	friend class Group;
 };
 
 enum Dest {
@@ -0,0 +1,167 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+// Optional C++20 coroutine support. The rest of libsmu only requires C++11; this header
+// is only usable from code compiled with coroutine support.
+
+#ifndef _LIBSMU_CORO_HPP
+#define _LIBSMU_CORO_HPP
+
+#if !defined(__cpp_impl_coroutine)
+#error "libsmu_coro.hpp requires a compiler with C++20 coroutine support"
+#endif
+
+#include <algorithm>
+#include <coroutine>
+#include "libsmu.hpp"
+
+/// Awaiter for a Capture. The awaiting coroutine is resumed on the session worker thread
+/// as soon as the USB thread sees the capture complete; no thread blocks in the meantime.
+/// `co_await` evaluates to the capture's status, 0 on success.
+struct CaptureAwaiter {
+	std::shared_ptr<Capture> capture;
+
+	bool await_ready() { return capture->done(); }
+	void await_suspend(std::coroutine_handle<> h) {
+		capture->then([h](Capture&) { h.resume(); });
+	}
+	unsigned await_resume() { return capture->status(); }
+};
+
+/// Allows `co_await session.start_async(nsamples)`.
+inline CaptureAwaiter operator co_await(std::shared_ptr<Capture> capture) {
+	return CaptureAwaiter{capture};
+}
+
+/// Start a capture on a session or device group and await it, i.e.
+/// `co_await capture(session, nsamples)`.
+inline CaptureAwaiter capture(Group& group, uint64_t nsamples) {
+	return CaptureAwaiter{group.start_async(nsamples)};
+}
+
+/// Asynchronous stream of decoded sample blocks from a device, one block per USB transfer
+/// in the layout used by Device::measure_blocks(). Blocks are queued on the USB thread and
+/// handed to the awaiting coroutine on the session worker thread. When more than
+/// `max_blocks` are pending the oldest block is dropped and counted in overruns().
+/// Block storage is allocated up front and recycled, so once every slot has held a block
+/// of the transfer size, receiving a block doesn't allocate.
+///
+/// Create the stream before starting the session and destroy it after the session has
+/// stopped, since it installs and removes the device's block callback.
+class SampleStream {
+public:
+	SampleStream(Session& session, Device* dev, size_t max_blocks = 64):
+		m_session(session), m_dev(dev), m_max_blocks(std::max<size_t>(max_blocks, 1)), m_stride(0),
+		m_blocks(m_max_blocks)
+	{
+		auto info = m_dev->info();
+		for (unsigned ch = 0; ch < info->channel_count; ch++)
+			m_stride += m_dev->channel_info(ch)->signal_count;
+		m_dev->measure_blocks([this](const float* samples, size_t count) {
+			push(samples, count);
+		});
+	}
+
+	~SampleStream() {
+		m_dev->measure_blocks(nullptr);
+	}
+
+	SampleStream(const SampleStream&) = delete;
+	SampleStream& operator=(const SampleStream&) = delete;
+
+	struct NextAwaiter {
+		SampleStream& stream;
+
+		bool await_ready() {
+			std::lock_guard<std::mutex> lock(stream.m_lock);
+			return stream.m_count || stream.m_closed;
+		}
+		bool await_suspend(std::coroutine_handle<> h) {
+			std::lock_guard<std::mutex> lock(stream.m_lock);
+			// a block may have arrived since await_ready()
+			if (stream.m_count || stream.m_closed)
+				return false;
+			stream.m_waiter = h;
+			return true;
+		}
+		/// Returns the next block, or an empty block once the stream is closed and drained.
+		const vector<float>& await_resume() {
+			std::lock_guard<std::mutex> lock(stream.m_lock);
+			// hand the previous block's storage back to the slot for reuse
+			stream.m_current.clear();
+			if (stream.m_count) {
+				stream.m_current.swap(stream.m_blocks[stream.m_first]);
+				stream.m_first = (stream.m_first + 1) % stream.m_max_blocks;
+				stream.m_count--;
+			}
+			return stream.m_current;
+		}
+	};
+
+	/// Await the next block of samples, i.e. `auto& block = co_await stream.next();`. The
+	/// block stays valid until the next one is awaited.
+	NextAwaiter next() { return NextAwaiter{*this}; }
+
+	/// Number of floats per sample in a block.
+	size_t stride() const { return m_stride; }
+
+	/// Stop the stream; an awaiting coroutine receives the remaining blocks and then an
+	/// empty block. Typically called from a Capture::then() callback.
+	void close() {
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_closed = true;
+		wake();
+	}
+
+	/// Number of blocks dropped because the consumer fell behind.
+	uint64_t overruns() {
+		std::lock_guard<std::mutex> lock(m_lock);
+		return m_overruns;
+	}
+
+protected:
+	/// Called on the USB thread for every received transfer.
+	void push(const float* samples, size_t count) {
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (m_closed)
+			return;
+		if (m_count == m_max_blocks) {
+			m_first = (m_first + 1) % m_max_blocks;
+			m_count--;
+			m_overruns++;
+		}
+		// assign() reuses the slot's storage when it is already large enough
+		m_blocks[(m_first + m_count) % m_max_blocks].assign(samples, samples + count * m_stride);
+		m_count++;
+		wake();
+	}
+
+	/// Resume the waiting coroutine on the worker thread. Caller holds m_lock.
+	void wake() {
+		if (m_waiter) {
+			auto h = m_waiter;
+			m_waiter = nullptr;
+			m_session.post([h]() { h.resume(); });
+		}
+	}
+
+	Session& m_session;
+	Device* const m_dev;
+	const size_t m_max_blocks;
+	/// number of floats per sample
+	size_t m_stride;
+
+	std::mutex m_lock;
+	/// ring of m_max_blocks slots, holding m_count blocks starting at m_first
+	vector<vector<float>> m_blocks;
+	size_t m_first = 0;
+	size_t m_count = 0;
+	/// block last handed to the consumer, whose storage goes back to a slot on the next one
+	vector<float> m_current;
+	std::coroutine_handle<> m_waiter;
+	bool m_closed = false;
+	uint64_t m_overruns = 0;
+};
+
+#endif // _LIBSMU_CORO_HPP
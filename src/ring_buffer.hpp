@@ -0,0 +1,76 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#ifndef _LIBSMU_RING_BUFFER_HPP
+#define _LIBSMU_RING_BUFFER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+/// Lock-free ring buffer for one producer and one consumer thread, e.g. for handing samples
+/// from Device::measure_blocks() on the USB thread to a thread that writes them out, without
+/// either side ever blocking the other. T must be trivially copyable. The capacity is
+/// rounded up to a power of two.
+template <typename T>
+class RingBuffer {
+public:
+	explicit RingBuffer(size_t capacity) {
+		size_t size = 1;
+		while (size < capacity)
+			size <<= 1;
+		m_buf.resize(size);
+		m_mask = size - 1;
+	}
+
+	size_t capacity() const { return m_buf.size(); }
+
+	/// Number of elements that can be read. Exact on the consumer thread, a lower bound elsewhere.
+	size_t size() const {
+		return m_write.load(std::memory_order_acquire) - m_read.load(std::memory_order_acquire);
+	}
+
+	/// Number of elements that can be written. Exact on the producer thread.
+	size_t space() const { return capacity() - size(); }
+
+	/// Producer: write up to `count` elements, returning how many fit.
+	size_t write(const T* data, size_t count) {
+		size_t w = m_write.load(std::memory_order_relaxed);
+		size_t r = m_read.load(std::memory_order_acquire);
+		count = std::min(count, capacity() - (w - r));
+		size_t pos = w & m_mask;
+		size_t first = std::min(count, capacity() - pos);
+		memcpy(&m_buf[pos], data, first * sizeof(T));
+		memcpy(&m_buf[0], data + first, (count - first) * sizeof(T));
+		m_write.store(w + count, std::memory_order_release);
+		return count;
+	}
+
+	/// Consumer: read up to `count` elements, returning how many were available.
+	size_t read(T* data, size_t count) {
+		size_t r = m_read.load(std::memory_order_relaxed);
+		size_t w = m_write.load(std::memory_order_acquire);
+		count = std::min(count, w - r);
+		size_t pos = r & m_mask;
+		size_t first = std::min(count, capacity() - pos);
+		memcpy(data, &m_buf[pos], first * sizeof(T));
+		memcpy(data + first, &m_buf[0], (count - first) * sizeof(T));
+		m_read.store(r + count, std::memory_order_release);
+		return count;
+	}
+
+	/// Consumer: drop all elements currently readable.
+	void clear() { m_read.store(m_write.load(std::memory_order_acquire), std::memory_order_release); }
+
+private:
+	std::vector<T> m_buf;
+	size_t m_mask;
+	/// total elements written and read; only their difference matters, so wrapping is fine
+	std::atomic<size_t> m_write{0};
+	std::atomic<size_t> m_read{0};
+};
+
+#endif // _LIBSMU_RING_BUFFER_HPP
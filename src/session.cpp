@@ -7,9 +7,17 @@
 #include "libsmu.hpp"
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 #include <libusb.h>
 #include <string.h>
+#include <climits>
+#include <cerrno>
+#include <cmath>
+#include <ctime>
 #include "device_m1000.hpp"
+#include "calibration.hpp"
 
 using std::shared_ptr;
 
@@ -17,9 +25,7 @@ extern "C" int LIBUSB_CALL hotplug_callback_usbthread(
 	libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data);
 
 /// session constructor
-Session::Session() {
-	m_active_devices = 0;
-
+Session::Session(): Group(this) {
 	if (int r = libusb_init(&m_usb_cx) != 0) {
 		smu_debug("libusb init failed: %i\n", r);
 		abort();
@@ -27,7 +33,7 @@ Session::Session() {
 
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 		smu_debug("Using libusb hotplug\n");
-		if (int r = libusb_hotplug_register_callback(NULL,
+		if (int r = libusb_hotplug_register_callback(m_usb_cx,
 			(libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
 			(libusb_hotplug_flag) 0,
 			LIBUSB_HOTPLUG_MATCH_ANY,
@@ -43,6 +49,7 @@ Session::Session() {
 		smu_debug("Libusb hotplug not supported. Only devices already attached will be used.\n");
 	}
 	start_usb_thread();
+	start_worker_thread();
 
 	if (getenv("LIBUSB_DEBUG")) {
 		libusb_set_debug(m_usb_cx, 4);
@@ -51,14 +58,31 @@ Session::Session() {
 
 /// session destructor
 Session::~Session() {
+	// Let queued work finish before tearing down the devices it may refer to
+	m_worker_lock.lock();
+	m_worker_thread_loop = false;
+	m_worker_lock.unlock();
+	m_worker_cv.notify_all();
+	if (m_worker_thread.joinable()) {
+		m_worker_thread.join();
+	}
+
 	std::lock_guard<std::mutex> lock(m_lock_devlist);
 	// Run device destructors before libusb_exit
 	m_usb_thread_loop = 0;
+	m_groups.clear();
 	m_devices.clear();
 	m_available_devices.clear();
+	{
+		DeviceIndex index;
+		std::lock_guard<std::mutex> index_lock(m_index_lock);
+		std::swap(m_index, index);
+	}
 	if (m_usb_thread.joinable()) {
 		m_usb_thread.join();
 	}
+	// hotplug events that arrived after the worker stopped still hold device references
+	m_work.clear();
 	libusb_exit(m_usb_cx);
 }
 
@@ -67,8 +91,12 @@ void Session::attached(libusb_device *device) {
 	shared_ptr<Device> dev = probe_device(device);
 	if (dev) {
 		std::lock_guard<std::mutex> lock(m_lock_devlist);
-		m_available_devices.push_back(dev);
+		register_device(dev);
+		update_index();
 		smu_debug("Session::attached ser: %s\n", dev->serial());
+		auto cal = m_host_calibration.find(dev->serial());
+		if (cal != m_host_calibration.end())
+			dev->load_calibration(cal->second.c_str());
 		if (this->m_hotplug_attach_callback) {
 			this->m_hotplug_attach_callback(&*dev);
 		}
@@ -87,68 +115,307 @@ void Session::detached(libusb_device *device)
 	}
 }
 
+/// get the USB port path of a device, e.g. "1-2.3"
+static void usb_path(libusb_device* device, char* path, size_t len) {
+	uint8_t ports[7];
+	int count = libusb_get_port_numbers(device, ports, sizeof(ports));
+	int off = snprintf(path, len, "%u", libusb_get_bus_number(device));
+	for (int i = 0; i < count && off > 0 && (size_t)off < len; i++) {
+		off += snprintf(path + off, len - off, i == 0 ? "-%u" : ".%u", ports[i]);
+	}
+}
+
+// SAM3U memory map used while flashing
+static const uint32_t FLASH_BASE = 0x80000;
+static const uint32_t FLASH_PAGE_SIZE = 256;
+static const uint32_t EEFC_FCR = 0x400E0804;
+static const uint32_t EEFC_FSR = 0x400E0808;
+static const uint32_t EEFC_KEY = 0x5A000000;
+// SRAM above the area used by the SAM-BA monitor, below its stack
+static const uint32_t SRAM_APPLET = 0x20001000;
+static const uint32_t SRAM_BUFFER = 0x20001100;
+static const uint32_t SRAM_BUFFER_SIZE = 0x4000;
+// top of SRAM0, where the monitor keeps its stack
+static const uint32_t SRAM_STACK = 0x20008000;
+
+// The SAM-BA G command starts code the way a Cortex-M reset does, loading SP from the word
+// at the given address and PC from the next one, so the applet starts with a vector table.
+static const uint32_t APPLET_CODE = SRAM_APPLET + 8;
+static const uint32_t applet_vectors[] = { SRAM_STACK, APPLET_CODE | 1 };
+
+// Thumb code copying words from SRAM into the flash page latch, which only accepts 32 bit
+// writes. Arguments follow the code: destination, source and word count.
+//   ldr r0, dst; ldr r1, src; ldr r2, words; b 2f
+//   1: ldmia r1!, {r3}; stmia r0!, {r3}; subs r2, #1
+//   2: cmp r2, #0; bne 1b; bx lr
+static const uint16_t word_copy_applet[] = {
+	0x4804, 0x4905, 0x4a05, 0xe002, 0xc908, 0xc008, 0x3a01, 0x2a00, 0xd1fa, 0x4770,
+};
+static const uint32_t APPLET_DST = APPLET_CODE + sizeof(word_copy_applet);
+static const uint32_t APPLET_SRC = APPLET_DST + 4;
+static const uint32_t APPLET_WORDS = APPLET_SRC + 4;
+
 /// Internal function to write raw SAM-BA commands to a libusb handle.
-static void samba_usb_write(libusb_device_handle *handle, const char* data) {
+static void samba_usb_write(libusb_device_handle *handle, const char* data, size_t len, unsigned timeout) {
 	int transferred, ret;
-	ret = libusb_bulk_transfer(handle, 0x01, (unsigned char *)data, strlen(data), &transferred, 1);
+	ret = libusb_bulk_transfer(handle, 0x01, (unsigned char *)data, len, &transferred, timeout);
 	if (ret < 0) {
 		std::string libusb_error_str(libusb_strerror((enum libusb_error)ret));
 		throw std::runtime_error("failed to write SAM-BA command: " + libusb_error_str);
 	}
 }
 
-/// Internal function to read raw SAM-BA commands to a libusb handle.
-static void samba_usb_read(libusb_device_handle *handle, unsigned char* data) {
+static void samba_usb_write(libusb_device_handle *handle, const char* data) {
+	samba_usb_write(handle, data, strlen(data), 100);
+}
+
+/// Internal function to read raw SAM-BA responses from a libusb handle, returning the
+/// number of bytes read.
+static int samba_usb_read(libusb_device_handle *handle, unsigned char* data, unsigned timeout) {
 	int transferred, ret;
-	ret = libusb_bulk_transfer(handle, 0x82, data, 512, &transferred, 1);
+	ret = libusb_bulk_transfer(handle, 0x82, data, 512, &transferred, timeout);
 	if (ret < 0) {
 		std::string libusb_error_str(libusb_strerror((enum libusb_error)ret));
 		throw std::runtime_error("failed to read SAM-BA response: " + libusb_error_str);
 	}
+	return transferred;
+}
+
+/// Write a 32 bit word. In binary mode the monitor doesn't respond.
+static void samba_write_word(libusb_device_handle *handle, uint32_t addr, uint32_t value) {
+	char cmd[24];
+	snprintf(cmd, sizeof(cmd), "W%.8X,%.8X#", addr, value);
+	samba_usb_write(handle, cmd);
+}
+
+/// Read a 32 bit word, returned as 4 little endian bytes in binary mode.
+static uint32_t samba_read_word(libusb_device_handle *handle, uint32_t addr) {
+	char cmd[24];
+	unsigned char data[512];
+	snprintf(cmd, sizeof(cmd), "w%.8X,4#", addr);
+	samba_usb_write(handle, cmd);
+	if (samba_usb_read(handle, data, 100) < 4)
+		throw std::runtime_error("short SAM-BA read response");
+	return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+/// Send a block of data to memory with the send-file command.
+static void samba_send(libusb_device_handle *handle, uint32_t addr, const char* data, size_t len) {
+	char cmd[24];
+	snprintf(cmd, sizeof(cmd), "S%.8X,%.8X#", addr, (unsigned)len);
+	samba_usb_write(handle, cmd);
+	samba_usb_write(handle, data, len, 1000);
+}
+
+/// Read a block of memory with the receive-file command.
+static void samba_receive(libusb_device_handle *handle, uint32_t addr, char* data, size_t len) {
+	char cmd[24];
+	snprintf(cmd, sizeof(cmd), "R%.8X,%.8X#", addr, (unsigned)len);
+	samba_usb_write(handle, cmd);
+	size_t received = 0;
+	while (received < len) {
+		int transferred, ret;
+		ret = libusb_bulk_transfer(handle, 0x82, (unsigned char *)data + received, len - received, &transferred, 1000);
+		if (ret < 0) {
+			std::string libusb_error_str(libusb_strerror((enum libusb_error)ret));
+			throw std::runtime_error("failed to read SAM-BA data: " + libusb_error_str);
+		}
+		received += transferred;
+	}
+}
+
+/// CRC-32 (IEEE 802.3) of a block of data.
+static uint32_t crc32(const char* data, size_t len) {
+	uint32_t crc = 0xffffffff;
+	for (size_t i = 0; i < len; i++) {
+		crc ^= (uint8_t)data[i];
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+/// Run code through the vector table at the given address: SP is loaded from the first word
+/// and PC from the second. The monitor resumes once the code returns.
+static void samba_go(libusb_device_handle *handle, uint32_t addr) {
+	char cmd[24];
+	snprintf(cmd, sizeof(cmd), "G%.8X#", addr);
+	samba_usb_write(handle, cmd);
+}
+
+/// Poll the flash controller until its current command has finished.
+static void eefc_wait(libusb_device_handle *handle, unsigned timeout) {
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+	while (true) {
+		uint32_t fsr = samba_read_word(handle, EEFC_FSR);
+		if (fsr & 0x2)
+			throw std::runtime_error("flash controller rejected command");
+		if (fsr & 0x4)
+			throw std::runtime_error("flash region is locked");
+		if (fsr & 0x1)
+			return;
+		if (std::chrono::steady_clock::now() > deadline)
+			throw std::runtime_error("timed out waiting for flash controller");
+	}
+}
+
+static const uint16_t SAMBA_VENDOR_ID = 0x03eb;
+static const uint16_t SAMBA_PRODUCT_ID = 0x6124;
+
+/// Read a firmware image, padded with erased flash to a whole number of pages.
+static std::vector<char> read_firmware(const char* file) {
+	std::ifstream firmware (file, std::ios::in | std::ios::binary);
+	if (!firmware.is_open()) {
+		throw std::runtime_error("failed to open firmware file");
+	}
+	firmware.seekg(0, std::ios::end);
+	long firmware_size = firmware.tellg();
+	firmware.seekg(0, std::ios::beg);
+	long padded_size = (firmware_size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+	std::vector<char> buf(padded_size, (char)0xff);
+	firmware.read(buf.data(), firmware_size);
+	return buf;
+}
+
+static bool is_samba_device(libusb_device* usb_dev) {
+	struct libusb_device_descriptor usb_info;
+	if (libusb_get_device_descriptor(usb_dev, &usb_info) != 0)
+		return false;
+	return usb_info.idVendor == SAMBA_VENDOR_ID && usb_info.idProduct == SAMBA_PRODUCT_ID;
+}
+
+/// Open a device in SAM-BA mode and write `image` to its flash, calling `progress` with the
+/// number of pages handled so far. Only pages that differ from the current flash contents
+/// are written, and each written page is read back and checked by CRC. Setting `cancel`
+/// stops before the next page is written, leaving the device in the bootloader.
+static void samba_flash(libusb_device* usb_dev, const std::vector<char>& image, FlashResult& result,
+		std::function<void(unsigned pages, unsigned total)> progress, const std::atomic<bool>* cancel) {
+	struct libusb_device_handle *usb_handle = NULL;
+	unsigned char usb_data[512];
+	unsigned pages = image.size() / FLASH_PAGE_SIZE;
+	std::vector<char> flash(SRAM_BUFFER_SIZE);
+
+	result.pages = pages;
+	result.written = result.verified = 0;
+
+	int ret = libusb_open(usb_dev, &usb_handle);
+	if (ret < 0) {
+		std::string libusb_error_str(libusb_strerror((enum libusb_error)ret));
+		throw std::runtime_error("failed opening USB device: " + libusb_error_str);
+	}
+#ifndef WIN32
+	libusb_detach_kernel_driver(usb_handle, 0);
+	libusb_detach_kernel_driver(usb_handle, 1);
+#endif
+	libusb_claim_interface(usb_handle, 1);
+
+	try {
+		// switch to binary mode: no echo or prompts, and word reads return raw bytes
+		samba_usb_write(usb_handle, "N#");
+		samba_usb_read(usb_handle, usb_data, 100);
+
+		samba_send(usb_handle, SRAM_APPLET, (const char*)applet_vectors, sizeof(applet_vectors));
+		samba_send(usb_handle, APPLET_CODE, (const char*)word_copy_applet, sizeof(word_copy_applet));
+		samba_write_word(usb_handle, APPLET_WORDS, FLASH_PAGE_SIZE / 4);
+
+		// Work through the image a buffer at a time: read back what is in flash, send the
+		// buffer into SRAM if anything differs, and for each differing page copy it into the
+		// flash page latch and have the flash controller erase and write it.
+		for (size_t chunk = 0; chunk < image.size(); chunk += SRAM_BUFFER_SIZE) {
+			size_t chunk_size = std::min<size_t>(SRAM_BUFFER_SIZE, image.size() - chunk);
+			samba_receive(usb_handle, FLASH_BASE + chunk, flash.data(), chunk_size);
+
+			bool sent = false;
+			for (size_t pos = 0; pos < chunk_size; pos += FLASH_PAGE_SIZE) {
+				uint32_t page = (chunk + pos) / FLASH_PAGE_SIZE;
+				if (memcmp(&flash[pos], &image[chunk + pos], FLASH_PAGE_SIZE) == 0) {
+					if (progress)
+						progress(page + 1, pages);
+					continue;
+				}
+				if (cancel && *cancel) {
+					result.cancelled = true;
+					throw std::runtime_error("flashing cancelled");
+				}
+				result.failed_page = page;
+				if (!sent) {
+					samba_send(usb_handle, SRAM_BUFFER, &image[chunk], chunk_size);
+					sent = true;
+				}
+				samba_write_word(usb_handle, APPLET_DST, FLASH_BASE + chunk + pos);
+				samba_write_word(usb_handle, APPLET_SRC, SRAM_BUFFER + pos);
+				samba_go(usb_handle, SRAM_APPLET);
+				samba_write_word(usb_handle, EEFC_FCR, EEFC_KEY | page << 8 | 0x03);
+				eefc_wait(usb_handle, 100);
+				result.written++;
+
+				samba_receive(usb_handle, FLASH_BASE + chunk + pos, &flash[pos], FLASH_PAGE_SIZE);
+				if (crc32(&flash[pos], FLASH_PAGE_SIZE) != crc32(&image[chunk + pos], FLASH_PAGE_SIZE)) {
+					char err[64];
+					snprintf(err, sizeof(err), "verification failed for flash page %u", page);
+					throw std::runtime_error(err);
+				}
+				result.verified++;
+				result.failed_page = -1;
+				if (progress)
+					progress(page + 1, pages);
+			}
+		}
+
+		// disable SAM-BA
+		samba_write_word(usb_handle, EEFC_FCR, EEFC_KEY | 0x010B);
+		eefc_wait(usb_handle, 100);
+		// jump to flash
+		samba_go(usb_handle, 0);
+	} catch (...) {
+		libusb_release_interface(usb_handle, 1);
+		libusb_close(usb_handle);
+		throw;
+	}
+
+	libusb_release_interface(usb_handle, 1);
+	libusb_close(usb_handle);
 }
 
 /// Update device firmware for the specified device or the first device
-/// found, either in the current session or in SAMBA command mode.
-void Session::flash_firmware(const char *file, Device *dev)
+FlashResult Session::flash_firmware(const char *file, Device *dev)
+{
+	FlashResult result;
+	flash_device(file, dev, result, nullptr, nullptr);
+	return result;
+}
+
+/// Update device firmware, filling in `result` as far as flashing gets
+void Session::flash_device(const char *file, Device *dev, FlashResult& result,
+		std::function<void(unsigned pages, unsigned total)> progress, const std::atomic<bool>* cancel)
 {
 	struct libusb_device *usb_dev = NULL;
-	struct libusb_device_handle *usb_handle = NULL;
 	struct libusb_device **usb_devs;
-	struct libusb_device_descriptor usb_info;
-	const uint16_t SAMBA_VENDOR_ID = 0x03eb;
-	const uint16_t SAMBA_PRODUCT_ID = 0x6124;
-	unsigned char usb_data[512];
-	unsigned int device_count, page;
-	int ret;
-
-	std::ifstream firmware (file, std::ios::in | std::ios::binary);
-	long firmware_size;
-	const uint32_t flashbase = 0x80000;
+	int device_count;
 
 	if (!dev && this->m_devices.size() > 1) {
 		throw std::runtime_error("multiple devices attached, flashing only works on a single device");
 	}
 
-	if (!firmware.is_open()) {
-		throw std::runtime_error("failed to open firmware file");
-	}
+	std::vector<char> image = read_firmware(file);
 
 	// force attached m1k into command mode
 	if (dev || !this->m_devices.empty()) {
 		if (!dev)
 			dev = *(this->m_devices.begin());
+		result.serial = dev->serial();
+		result.path = dev->path();
 		dev->samba_mode();
 	}
 
-	device_count = libusb_get_device_list(NULL, &usb_devs);
+	device_count = libusb_get_device_list(m_usb_cx, &usb_devs);
 	if (device_count <= 0) {
 		throw std::runtime_error("error enumerating USB devices");
 	}
 
 	// Walk the list of USB devices looking for the device in SAM-BA mode.
-	for (unsigned int i = 0; i < device_count; i++) {
-		libusb_get_device_descriptor(usb_devs[i], &usb_info);
-		if (usb_info.idVendor == SAMBA_VENDOR_ID && usb_info.idProduct == SAMBA_PRODUCT_ID) {
+	for (int i = 0; i < device_count; i++) {
+		if (is_samba_device(usb_devs[i])) {
 			// Take the first device found, we disregard multiple devices.
 			usb_dev = usb_devs[i];
 			break;
@@ -160,87 +427,491 @@ void Session::flash_firmware(const char *file, Device *dev)
 		throw std::runtime_error("no supported devices plugged in");
 	}
 
-	ret = libusb_open(usb_dev, &usb_handle);
-	if (ret < 0) {
-		std::string libusb_error_str(libusb_strerror((enum libusb_error)ret));
+	try {
+		samba_flash(usb_dev, image, result, progress, cancel);
+	} catch (...) {
 		libusb_free_device_list(usb_devs, 1);
-		throw std::runtime_error("failed opening USB device: " + libusb_error_str);
+		throw;
 	}
-#ifndef WIN32
-	libusb_detach_kernel_driver(usb_handle, 0);
-	libusb_detach_kernel_driver(usb_handle, 1);
-#endif
-	libusb_claim_interface(usb_handle, 1);
+	libusb_free_device_list(usb_devs, 1);
+	result.ok = true;
+}
 
-	// erase flash
-	samba_usb_write(usb_handle, "W400E0804,5A000005#");
-	std::this_thread::sleep_for(std::chrono::milliseconds(10));
-	samba_usb_read(usb_handle, usb_data);
-	// check if flash is erased
-	samba_usb_write(usb_handle, "w400E0808,4#");
-	std::this_thread::sleep_for(std::chrono::milliseconds(10));
-	samba_usb_read(usb_handle, usb_data);
-	samba_usb_read(usb_handle, usb_data);
-	samba_usb_read(usb_handle, usb_data);
-
-	// read firmware file into buffer
-	firmware.seekg(0, std::ios::end);
-	firmware_size = firmware.tellg();
-	firmware_size = firmware_size + (256 - firmware_size % 256);
-	firmware.seekg(0, std::ios::beg);
-	auto buf = std::unique_ptr<char[]>{ new char[firmware_size] };
-	firmware.read(buf.get(), firmware_size);
-	firmware.close();
-
-	// write firmware
-	page = 0;
-	char cmd[20];
-	uint32_t data;
-	for (auto pos = 0; pos < firmware_size; pos += 4) {
-		data = (uint8_t)buf[pos] | (uint8_t)buf[pos+1] << 8 |
-			(uint8_t)buf[pos+2] << 16 | (uint8_t)buf[pos+3] << 24;
-		snprintf(cmd, sizeof(cmd), "W%.8X,%.8X#", flashbase + pos, data);
-		samba_usb_write(usb_handle, cmd);
-		samba_usb_read(usb_handle, usb_data);
-		samba_usb_read(usb_handle, usb_data);
-		// On page boundaries, write the page.
-		if ((pos & 0xFC) == 0xFC) {
-			snprintf(cmd, sizeof(cmd), "W400E0804,5A00%.2X03#", page);
-			samba_usb_write(usb_handle, cmd);
-			std::this_thread::sleep_for(std::chrono::milliseconds(10));
-			samba_usb_read(usb_handle, usb_data);
-			samba_usb_read(usb_handle, usb_data);
-			// Verify page is written.
-			samba_usb_write(usb_handle, "w400E0808,4#");
-			std::this_thread::sleep_for(std::chrono::milliseconds(10));
-			samba_usb_read(usb_handle, usb_data);
-			samba_usb_read(usb_handle, usb_data);
-			samba_usb_read(usb_handle, usb_data);
-			// TODO: check page status
-			page++;
-		}
-	}
-
-	// disable SAM-BA
-	samba_usb_write(usb_handle, "W400E0804,5A00010B#");
-	samba_usb_read(usb_handle, usb_data);
-	samba_usb_read(usb_handle, usb_data);
-	// jump to flash
-	samba_usb_write(usb_handle, "G00000000#");
-	samba_usb_read(usb_handle, usb_data);
+/// Update device firmware on a separate thread
+shared_ptr<FlashJob> Session::flash_firmware_async(const char *file, Device *dev,
+		std::function<void(const FlashProgress& progress)> progress)
+{
+	shared_ptr<FlashJob> job(new FlashJob());
+	std::string path(file);
+	FlashJob* j = job.get();
+	job->m_thread = std::thread([=]() {
+		auto start = std::chrono::steady_clock::now();
+		FlashResult result;
+		try {
+			flash_device(path.c_str(), dev, result, [&](unsigned pages, unsigned total) {
+				FlashProgress p;
+				p.pages = pages;
+				p.total_pages = total;
+				p.written = result.written;
+				p.bytes = (uint64_t)result.written * FLASH_PAGE_SIZE;
+				p.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				p.bytes_per_second = p.elapsed > 0 ? p.bytes / p.elapsed : 0;
+				p.eta = pages ? p.elapsed * (total - pages) / pages : 0;
+				{
+					std::lock_guard<std::mutex> lock(j->m_lock);
+					j->m_progress = p;
+				}
+				if (progress)
+					progress(p);
+			}, &j->m_cancel);
+		} catch (const std::exception& e) {
+			result.ok = false;
+			result.error = e.what();
+		}
+		std::lock_guard<std::mutex> lock(j->m_lock);
+		j->m_result = result;
+		j->m_done = true;
+		j->m_completion.notify_all();
+	});
+	return job;
+}
+
+FlashJob::~FlashJob() {
+	// the job can't outlive its thread; stop at the next page boundary
+	m_cancel = true;
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+bool FlashJob::done() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_done;
+}
+
+bool FlashJob::wait(unsigned timeout) {
+	std::unique_lock<std::mutex> lk(m_lock);
+	if (timeout == WAIT_FOREVER) {
+		m_completion.wait(lk, [&]{ return m_done; });
+		return true;
+	}
+	return m_completion.wait_for(lk, std::chrono::milliseconds(timeout), [&]{ return m_done; });
+}
+
+FlashProgress FlashJob::progress() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_progress;
+}
+
+FlashResult FlashJob::result() {
+	wait();
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_result;
+}
+
+/// Update device firmware for several devices at once
+vector<FlashResult> Session::flash_firmware_all(const char *file, vector<Device*> devices,
+		std::function<void(const FlashResult& device, unsigned pages, unsigned total)> progress)
+{
+	std::vector<char> image = read_firmware(file);
+
+	if (devices.empty())
+		devices.assign(m_devices.begin(), m_devices.end());
+
+	vector<FlashResult> results(devices.size());
+	for (size_t i = 0; i < devices.size(); i++) {
+		results[i].serial = devices[i]->serial();
+		results[i].path = devices[i]->path();
+		try {
+			devices[i]->samba_mode(false);
+		} catch (const std::exception& e) {
+			results[i].error = e.what();
+		}
+	}
+
+	// Wait for the bootloaders to show up. They enumerate on the same ports the devices were
+	// plugged into, which is the only way to tell them apart since SAM-BA has no serial.
+	vector<libusb_device*> samba(devices.size(), NULL);
+	struct libusb_device **usb_devs = NULL;
+	int device_count = 0;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (true) {
+		if (usb_devs)
+			libusb_free_device_list(usb_devs, 1);
+		device_count = libusb_get_device_list(m_usb_cx, &usb_devs);
+		if (device_count < 0) {
+			throw std::runtime_error("error enumerating USB devices");
+		}
+		size_t missing = 0;
+		for (size_t i = 0; i < devices.size(); i++) {
+			samba[i] = NULL;
+			for (int d = 0; d < device_count; d++) {
+				char path[32];
+				usb_path(usb_devs[d], path, sizeof(path));
+				if (results[i].path == path && is_samba_device(usb_devs[d])) {
+					samba[i] = usb_devs[d];
+					break;
+				}
+			}
+			if (!samba[i] && results[i].error.empty())
+				missing++;
+		}
+		if (missing == 0 || std::chrono::steady_clock::now() > deadline)
+			break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+
+	vector<std::thread> threads;
+	for (size_t i = 0; i < devices.size(); i++) {
+		if (!results[i].error.empty())
+			continue;
+		if (!samba[i]) {
+			results[i].error = "device did not enter SAM-BA mode";
+			continue;
+		}
+		threads.emplace_back([&, i]() {
+			try {
+				samba_flash(samba[i], image, results[i], [&](unsigned pages, unsigned total) {
+					if (progress)
+						progress(results[i], pages, total);
+				}, nullptr);
+				results[i].ok = true;
+			} catch (const std::exception& e) {
+				results[i].error = e.what();
+			}
+		});
+	}
+	for (auto& t: threads)
+		t.join();
 
-	libusb_release_interface(usb_handle, 1);
-	libusb_close(usb_handle);
 	libusb_free_device_list(usb_devs, 1);
+	return results;
+}
+
+/// write calibration data from per-serial files in a directory
+vector<CalibrationResult> Session::import_calibration(const char* dir, vector<Device*> devices, bool host)
+{
+	if (devices.empty())
+		devices.assign(m_devices.begin(), m_devices.end());
+
+	vector<CalibrationResult> results(devices.size());
+	vector<std::string> files;
+	int ret = list_directory(dir, files);
+	std::sort(files.begin(), files.end());
+
+	for (size_t i = 0; i < devices.size(); i++) {
+		results[i].serial = devices[i]->serial();
+		results[i].status = ret < 0 ? ret : -ENOENT;
+		if (ret < 0)
+			continue;
+		for (auto& file: files) {
+			size_t name = file.find_last_of("/\\");
+			name = name == std::string::npos ? 0 : name + 1;
+			if (file.find(results[i].serial, name) != std::string::npos)
+				results[i].file = file;
+		}
+	}
+
+	vector<std::thread> threads;
+	for (size_t i = 0; i < devices.size(); i++) {
+		if (results[i].file.empty())
+			continue;
+		if (host) {
+			std::lock_guard<std::mutex> lock(m_lock_devlist);
+			m_host_calibration[results[i].serial] = results[i].file;
+		}
+		threads.emplace_back([&, i]() {
+			if (host) {
+				results[i].status = devices[i]->load_calibration(results[i].file.c_str());
+				return;
+			}
+			vector<CalibrationRecord> records;
+			vector<vector<float>> cal;
+			int status = parse_calibration_file(results[i].file.c_str(), records);
+			if (status == 0)
+				status = calibration_coefficients(records, cal);
+			if (status == 0)
+				status = devices[i]->set_calibration(cal);
+			results[i].status = status;
+		});
+	}
+	for (auto& t: threads)
+		t.join();
+
+	return results;
+}
+
+namespace {
+/// Mean A voltage, A current, B voltage and B current of one device over a reading
+struct CalibrationReading {
+	double sum[4] = {0, 0, 0, 0};
+	uint64_t count = 0;
+	uint64_t seen = 0;
+	float mean(unsigned k) const { return sum[k] / count; }
+};
+}
+
+/// Run `group` with both channels of all devices in `mode`, sourcing `value`, and average
+/// each device's samples once the channels have settled.
+static vector<CalibrationReading> calibration_reading(Group* group, const vector<Device*>& devices,
+	unsigned mode, float value, uint64_t nsamples)
+{
+	vector<CalibrationReading> readings(devices.size());
+	for (size_t i = 0; i < devices.size(); i++) {
+		CalibrationReading* r = &readings[i];
+		devices[i]->measure_blocks([=](const float* samples, size_t count) {
+			for (size_t j = 0; j < count; j++, r->seen++) {
+				if (r->seen < nsamples / 4 || r->seen >= nsamples)
+					continue;
+				for (unsigned k = 0; k < 4; k++)
+					r->sum[k] += samples[j*4+k];
+				r->count++;
+			}
+		});
+		for (unsigned ch = 0; ch < 2; ch++) {
+			devices[i]->set_mode(ch, mode);
+			if (mode != DISABLED)
+				devices[i]->signal(ch, mode == SVMI ? 0 : 1)->source_constant(value);
+		}
+	}
+	group->run(nsamples);
+	return readings;
+}
+
+vector<CalibrationResult> Session::calibrate(const CalibrationSetup& setup, vector<Device*> devices,
+	std::function<bool(const char* instructions)> prompt)
+{
+	if (devices.empty())
+		devices.assign(m_devices.begin(), m_devices.end());
+
+	vector<CalibrationResult> results(devices.size());
+	for (size_t i = 0; i < devices.size(); i++)
+		results[i].serial = devices[i]->serial();
+	if (devices.empty())
+		return results;
+
+	const float ref = setup.reference;
+	const float res = setup.resistance;
+	auto fail = [&](size_t i, int status, std::string error) {
+		if (results[i].status == 0) {
+			results[i].status = status;
+			results[i].error = error;
+		}
+	};
+
+	// currents are calibrated at +/-100mA, sourced through the resistor from the reference
+	if (!(res > 0 && ref - 0.1 * res >= 0 && ref + 0.1 * res <= 5) || setup.samples < 4) {
+		for (size_t i = 0; i < devices.size(); i++)
+			fail(i, -EINVAL, "invalid calibration setup");
+		return results;
+	}
+
+	// Check a reading of signal k (A voltage, A current, B voltage, B current) against
+	// what a correctly wired, uncalibrated device should read, returning the reading.
+	auto check = [&](size_t i, const CalibrationReading& r, unsigned k, float value, float expected,
+			const char* what) {
+		if (r.count == 0) {
+			fail(i, -EIO, "no samples received");
+		} else if (std::fabs(value - expected) > (k & 1 ? 0.025 : 0.25)) {
+			char error[128];
+			snprintf(error, sizeof(error), "channel %c %s: expected %.3f%c, got %.3f%c",
+				k < 2 ? 'A' : 'B', what, expected, k & 1 ? 'A' : 'V', value, k & 1 ? 'A' : 'V');
+			fail(i, -ERANGE, error);
+		}
+	};
+
+	vector<vector<CalibrationRecord>> records(devices.size(), vector<CalibrationRecord>(CALIBRATION_RECORDS));
+	auto point = [&](size_t i, unsigned ch, unsigned record, float reference, float measured) {
+		records[i][ch * 4 + record].points.push_back(std::make_pair(reference, measured));
+	};
+
+	// measure everything in a group of our own, raw
+	Group* group = add_group();
+	vector<Group*> groups(devices.size());
+	vector<std::function<void(const float*, size_t)>> callbacks(devices.size());
+	for (size_t i = 0; i < devices.size(); i++) {
+		groups[i] = devices[i]->m_group;
+		callbacks[i] = devices[i]->m_block_callback;
+		group->add_device(devices[i]);
+		devices[i]->bypass_calibration(true);
+	}
+	group->configure(devices[0]->get_default_rate());
+
+	auto stages = [&]() -> bool {
+		char instructions[256];
+		vector<CalibrationReading> r;
+
+		// voltage measurement offset and gain
+		if (prompt && !prompt("Connect CH A and CH B of every device to GND."))
+			return false;
+		r = calibration_reading(group, devices, DISABLED, 0, setup.samples);
+		for (size_t i = 0; i < devices.size(); i++) {
+			for (unsigned ch = 0; ch < 2; ch++) {
+				check(i, r[i], ch * 2, r[i].mean(ch * 2), 0, "measuring GND");
+				point(i, ch, 0, 0, r[i].mean(ch * 2));
+			}
+		}
+		snprintf(instructions, sizeof(instructions),
+			"Connect CH A and CH B of every device to the %.4fV reference.", ref);
+		if (prompt && !prompt(instructions))
+			return false;
+		r = calibration_reading(group, devices, DISABLED, 0, setup.samples);
+		for (size_t i = 0; i < devices.size(); i++) {
+			for (unsigned ch = 0; ch < 2; ch++) {
+				check(i, r[i], ch * 2, r[i].mean(ch * 2), ref, "measuring the reference");
+				point(i, ch, 0, ref, r[i].mean(ch * 2));
+			}
+		}
+
+		// the rest is measured with the now calibrated voltage measurement
+		vector<vector<PiecewiseLinear>> volts(devices.size());
+		for (size_t i = 0; i < devices.size(); i++) {
+			for (unsigned ch = 0; ch < 2; ch++)
+				volts[i].emplace_back(records[i][ch * 4]);
+		}
+
+		// current measurement offset, voltage source offset and gain
+		if (prompt && !prompt("Disconnect CH A and CH B of every device."))
+			return false;
+		for (float v: {0.0f, 2.5f}) {
+			r = calibration_reading(group, devices, SVMI, v, setup.samples);
+			for (size_t i = 0; i < devices.size(); i++) {
+				for (unsigned ch = 0; ch < 2; ch++) {
+					float actual = volts[i][ch](r[i].mean(ch * 2));
+					check(i, r[i], ch * 2, actual, v, "sourcing voltage");
+					point(i, ch, 2, v, actual);
+					if (v == 0) {
+						check(i, r[i], ch * 2 + 1, r[i].mean(ch * 2 + 1), 0, "measuring no current");
+						point(i, ch, 1, 0, r[i].mean(ch * 2 + 1));
+					}
+				}
+			}
+		}
+
+		// current measurement and source gains, from the voltage across the resistor
+		snprintf(instructions, sizeof(instructions),
+			"Connect CH A and CH B of every device to the reference through a %.1f ohm resistor each.", res);
+		if (prompt && !prompt(instructions))
+			return false;
+		for (float i_src: {0.1f, -0.1f}) {
+			r = calibration_reading(group, devices, SVMI, ref + i_src * res, setup.samples);
+			for (size_t i = 0; i < devices.size(); i++) {
+				for (unsigned ch = 0; ch < 2; ch++) {
+					float actual = (volts[i][ch](r[i].mean(ch * 2)) - ref) / res;
+					check(i, r[i], ch * 2 + 1, actual, i_src, "current through the resistor");
+					point(i, ch, 1, actual, r[i].mean(ch * 2 + 1));
+				}
+			}
+		}
+		for (float i_src: {0.0f, 0.1f, -0.1f}) {
+			r = calibration_reading(group, devices, SIMV, i_src, setup.samples);
+			for (size_t i = 0; i < devices.size(); i++) {
+				for (unsigned ch = 0; ch < 2; ch++) {
+					float actual = (volts[i][ch](r[i].mean(ch * 2)) - ref) / res;
+					check(i, r[i], ch * 2 + 1, actual, i_src, "sourcing current");
+					point(i, ch, 3, i_src, actual);
+				}
+			}
+		}
+		return true;
+	};
+	bool completed = stages();
+
+	for (size_t i = 0; i < devices.size(); i++) {
+		devices[i]->m_block_callback = callbacks[i];
+		devices[i]->bypass_calibration(false);
+		if (groups[i])
+			groups[i]->add_device(devices[i]);
+	}
+	remove_group(group);
+
+	if (!completed) {
+		for (size_t i = 0; i < devices.size(); i++)
+			fail(i, -ECANCELED, "cancelled");
+		return results;
+	}
+
+	char stamp[32];
+	time_t now = time(NULL);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+
+	vector<std::thread> threads;
+	for (size_t i = 0; i < devices.size(); i++) {
+		if (results[i].status != 0)
+			continue;
+		int status = calibration_coefficients(records[i], results[i].coefficients);
+		for (auto& record: records[i])
+			results[i].points.push_back(record.points);
+		if (status < 0) {
+			fail(i, status, "readings don't form a calibration");
+			continue;
+		}
+		if (!setup.dir.empty()) {
+			results[i].file = setup.dir + "/" + results[i].serial + "-" + stamp + ".txt";
+			status = write_calibration_file(results[i].file.c_str(), records[i]);
+			if (status < 0) {
+				fail(i, status, "failed to save calibration file");
+				continue;
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_lock_devlist);
+			m_host_calibration.erase(results[i].serial);
+		}
+		threads.emplace_back([&, i]() {
+			devices[i]->load_calibration(NULL);
+			int status = devices[i]->set_calibration(results[i].coefficients);
+			if (status < 0)
+				fail(i, status, "failed to write calibration data");
+			else
+				results[i].status = status;
+		});
+	}
+	for (auto& t: threads)
+		t.join();
+
+	return results;
 }
 
 /// remove a specified Device from the list of available devices
 void Session::destroy_available(Device *dev) {
+	if (dev && dev->m_group)
+		dev->m_group->remove_device(dev);
 	std::lock_guard<std::mutex> lock(m_lock_devlist);
-	if (dev)
-		for (unsigned i = 0; i < m_available_devices.size(); i++)
-			if (m_available_devices[i]->serial() == dev->serial())
-				m_available_devices.erase(m_available_devices.begin()+i);
+	if (dev) {
+		for (auto it = m_available_devices.begin(); it != m_available_devices.end(); ++it) {
+			if (it->get() == dev) {
+				m_available_devices.erase(it);
+				break;
+			}
+		}
+		update_index();
+	}
+}
+
+/// add a probed device to the list of available devices
+void Session::register_device(shared_ptr<Device> dev) {
+	std::string serial(dev->serial());
+	auto h = m_handles.find(serial);
+	if (h != m_handles.end()) {
+		dev->m_handle = h->second;
+	} else {
+		dev->m_handle = m_next_handle++;
+		m_handles[serial] = dev->m_handle;
+	}
+	m_available_devices.push_back(dev);
+}
+
+/// rebuild the index of the list of available devices
+void Session::update_index() {
+	DeviceIndex index;
+	for (auto d: m_available_devices) {
+		index.serial[d->serial()] = d;
+		index.path[d->path()] = d;
+		index.handle[d->handle()] = d;
+	}
+	// hash the devices outside of the lock and only swap the tables in under it
+	std::lock_guard<std::mutex> lock(m_index_lock);
+	std::swap(m_index, index);
 }
 
 /// low-level callback for hotplug events, proxies to session methods
@@ -248,10 +919,14 @@ extern "C" int LIBUSB_CALL hotplug_callback_usbthread(
 	libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data) {
 	(void) ctx;
 	Session *sess = (Session *) user_data;
+	// Probing a new device takes several control transfers and the user callbacks may
+	// reconfigure groups, so handle the event on the worker thread and keep the USB thread
+	// servicing the transfers of running devices.
+	shared_ptr<libusb_device> ref(libusb_ref_device(device), libusb_unref_device);
 	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
-		sess->attached(device);
+		sess->post([=]() { sess->attached(ref.get()); });
 	} else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
-		sess->detached(device);
+		sess->post([=]() { sess->detached(ref.get()); });
 	}
 	return 0;
 }
@@ -264,10 +939,37 @@ void Session::start_usb_thread() {
 	});
 }
 
+/// spawn thread for work that must not run on the USB thread
+void Session::start_worker_thread() {
+	m_worker_thread_loop = true;
+	m_worker_thread = std::thread([=]() {
+		std::unique_lock<std::mutex> lk(m_worker_lock);
+		while (true) {
+			m_worker_cv.wait(lk, [&]{ return !m_work.empty() || !m_worker_thread_loop; });
+			// drain queued work before exiting
+			if (m_work.empty())
+				break;
+			auto work = std::move(m_work.front());
+			m_work.pop_front();
+			lk.unlock();
+			work();
+			lk.lock();
+		}
+	});
+}
+
+/// queue work for the worker thread
+void Session::post(std::function<void()> work) {
+	std::lock_guard<std::mutex> lock(m_worker_lock);
+	m_work.push_back(std::move(work));
+	m_worker_cv.notify_one();
+}
+
 /// update list of attached USB devices
 int Session::update_available_devices() {
 	m_lock_devlist.lock();
 	m_available_devices.clear();
+	update_index();
 	m_lock_devlist.unlock();
 	libusb_device** list;
 	int num = libusb_get_device_list(m_usb_cx, &list);
@@ -277,7 +979,8 @@ int Session::update_available_devices() {
 		shared_ptr<Device> dev = probe_device(list[i]);
 		if (dev) {
 			m_lock_devlist.lock();
-			m_available_devices.push_back(dev);
+			register_device(dev);
+			update_index();
 			m_lock_devlist.unlock();
 		}
 	}
@@ -318,29 +1021,68 @@ shared_ptr<Device> Session::probe_device(libusb_device* device) {
 }
 
 shared_ptr<Device> Session::find_existing_device(libusb_device* device) {
-	std::lock_guard<std::mutex> lock(m_lock_devlist);
-	for (auto d: m_available_devices) {
-		if (d->m_device == device) {
-			return d;
-		}
+	char path[32];
+	usb_path(device, path, sizeof(path));
+	std::lock_guard<std::mutex> lock(m_index_lock);
+	auto d = m_index.path.find(path);
+	if (d != m_index.path.end() && d->second->m_device == device) {
+		return d->second;
 	}
 	return NULL;
 }
 
 /// get the device matching a given serial from the session
-Device* Session::get_device(const char* serial) {
-	for (auto d: m_devices) {
-		if (strncmp(d->serial(), serial, 31) == 0) {
-			return d;
-		}
+Device* Group::get_device(const char* serial) {
+	if (!serial)
+		return NULL;
+	std::lock_guard<std::mutex> lock(m_session->m_index_lock);
+	auto& index = m_session->m_index.serial;
+	auto d = index.find(std::string(serial, strnlen(serial, 31)));
+	if (d != index.end() && d->second->m_group == this) {
+		return d->second.get();
+	}
+	return NULL;
+}
+
+/// get the device at a given USB port path from the session
+Device* Group::get_device_by_path(const char* path) {
+	if (!path)
+		return NULL;
+	std::lock_guard<std::mutex> lock(m_session->m_index_lock);
+	auto& index = m_session->m_index.path;
+	auto d = index.find(path);
+	if (d != index.end() && d->second->m_group == this) {
+		return d->second.get();
 	}
 	return NULL;
 }
 
-/// adds a new device to the session
-Device* Session::add_device(Device* device) {
+/// get the device matching a given handle from the session
+Device* Group::get_device_by_handle(unsigned handle) {
+	std::lock_guard<std::mutex> lock(m_session->m_index_lock);
+	auto& index = m_session->m_index.handle;
+	auto d = index.find(handle);
+	if (d != index.end() && d->second->m_group == this) {
+		return d->second.get();
+	}
+	return NULL;
+}
+
+/// adds a new device to the group
+Device* Group::add_device(Device* device) {
 	if ( device ) {
-		m_devices.insert(device);
+		if (device->m_group == this)
+			return device;
+		if (device->m_group)
+			device->m_group->remove_device(device);
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_devices.insert(device);
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_session->m_index_lock);
+			device->m_group = this;
+		}
 		smu_debug("device insert: %s\n", device->serial());
 		device->added();
 		return device;
@@ -348,118 +1090,508 @@ Device* Session::add_device(Device* device) {
 	return NULL;
 }
 
-/// removes an existing device from the session
-void Session::remove_device(Device* device) {
-	if ( device ) {
-		m_devices.erase(device);
-		device->removed();
+/// removes an existing device from the group
+void Group::remove_device(Device* device) {
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (!device || !m_devices.erase(device)) {
+			smu_debug("no device removed\n");
+			return;
+		}
+		// stop waiting for the device's progress
+		if (device->m_active)
+			drop_progress(device);
+	}
+
+	device->lock();
+	bool active = device->m_active;
+	device->m_active = false;
+	{
+		std::lock_guard<std::mutex> lock(m_session->m_index_lock);
+		device->m_group = NULL;
+	}
+	device->unlock();
+	if (active) {
+		// removed mid-run: let its transfers drain and complete on its behalf
+		device->cancel();
+		completion();
+	}
+	device->removed();
+}
+
+/// adds a device to a running group
+int Group::join(Device* device, uint64_t sampleno) {
+	if (!device || device->m_group == this)
+		return -EINVAL;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (m_active_devices == 0 || m_sample_rate == 0 || (m_nsamples && sampleno >= m_nsamples))
+			return -EINVAL;
+		// frame aligned starts can only begin on a frame boundary
+		if (m_frame_start && sampleno * 1000 % m_sample_rate)
+			return -EINVAL;
+	}
+
+	// progress has to be in place before the device is visible to the minimum scan
+	device->m_progress = sampleno;
+	device->m_detached = false;
+	add_device(device);
+	device->configure(m_sample_rate);
+	device->on();
+	device->arm(m_nsamples, sampleno);
+
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - m_start_time).count();
+	int64_t delay = (int64_t)(sampleno * 1000 / m_sample_rate) - elapsed;
+	uint16_t frame = 0;
+	if (m_frame_start) {
+		// Count from the frame the group started on. The frame counter wraps every 2048 ms,
+		// which the host clock is more than good enough to tell apart.
+		uint16_t now = device->start_frame(0) >> 3;
+		uint16_t start = ((m_sof_start >> 3) + sampleno * 1000 / m_sample_rate) & 0x7FF;
+		int64_t frames = (start - now) & 0x7FF;
+		if (std::abs(frames - delay) > 100)
+			frames = -1;
+		delay = frames;
+		frame = start << 3;
+	}
+	// The start frame is an 11 bit millisecond counter, so it can't be more than about two
+	// seconds out. Leave a few frames for the start request itself.
+	if (delay < 5 || delay > 2000) {
+		device->off();
+		remove_device(device);
+		return -EINVAL;
 	}
-	else {
-		smu_debug("no device removed\n");
+	if (!m_frame_start)
+		frame = device->start_frame(delay);
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_active_devices++;
+	}
+	if (!device->fire(frame)) {
+		completion();
+		device->off();
+		remove_device(device);
+		return -EIO;
+	}
+	return 0;
+}
+
+/// creates a new device group
+Group* Session::add_group() {
+	m_groups.emplace_back(new Group(this));
+	return m_groups.back().get();
+}
+
+/// removes a device group, releasing its devices
+void Session::remove_group(Group* group) {
+	for (auto it = m_groups.begin(); it != m_groups.end(); ++it) {
+		if (it->get() == group) {
+			auto devices = group->m_devices;
+			for (auto d: devices)
+				group->remove_device(d);
+			m_groups.erase(it);
+			return;
+		}
 	}
 }
 
 /// configures sampling for all devices
-void Session::configure(uint64_t sampleRate) {
+void Group::configure(uint64_t sampleRate) {
+	m_sample_rate = sampleRate;
 	for (auto i: m_devices) {
 		i->configure(sampleRate);
 	}
 }
 
 /// stream nsamples, then stop
-void Session::run(uint64_t nsamples) {
+void Group::run(uint64_t nsamples, bool power_off) {
 	start(nsamples);
-	end();
+	end(power_off);
 }
 
 /// wait for completion of sample stream, disable all devices
-void Session::end() {
-	// completion lock
-	std::unique_lock<std::mutex> lk(m_lock);
-	auto now = std::chrono::system_clock::now();
-	auto res = m_completion.wait_until(lk, now + std::chrono::milliseconds(1000), [&]{ return m_active_devices == 0; });
-	//	m_completion.wait(lk, [&]{ return m_active_devices == 0; });
-	// wait on m_completion, return m_active_devices compared with 0
-	if (!res) {
+void Group::end(bool power_off) {
+	// allow for the expected capture time plus a second of slack
+	uint64_t timeout = 1000;
+	if (m_nsamples && m_sample_rate)
+		timeout += m_nsamples * 1000 / m_sample_rate;
+	if (!wait_for_completion(std::min<uint64_t>(timeout, WAIT_FOREVER - 1))) {
 		smu_debug("timed out\n");
 	}
+	if (!power_off)
+		return;
 	for (auto i: m_devices) {
 		i->off();
 	}
 }
+
+/// check for completion of sample stream without blocking
+bool Group::done() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_active_devices == 0;
+}
+
 /// wait for completion of sample stream
-void Session::wait_for_completion() {
+bool Group::wait_for_completion(unsigned timeout) {
 	// completion lock
 	std::unique_lock<std::mutex> lk(m_lock);
-	m_completion.wait(lk, [&]{ return m_active_devices == 0; });
+	if (timeout == WAIT_FOREVER) {
+		m_completion.wait(lk, [&]{ return m_active_devices == 0; });
+		return true;
+	}
+	return m_completion.wait_for(lk, std::chrono::milliseconds(timeout), [&]{ return m_active_devices == 0; });
 }
 
 /// start streaming data
-void Session::start(uint64_t nsamples) {
+void Group::start(uint64_t nsamples) {
+	start_async(nsamples);
+}
+
+/// start streaming data, returning a handle to the capture
+shared_ptr<Capture> Group::start_async(uint64_t nsamples) {
+	shared_ptr<Capture> capture(new Capture(this, nsamples));
+	launch(capture);
+	return capture;
+}
+
+/// prepare a capture without starting it
+shared_ptr<Capture> Group::arm(uint64_t nsamples) {
+	shared_ptr<Capture> capture(new Capture(this, nsamples));
+	prepare(capture);
+	return capture;
+}
+
+/// start streaming data for a given capture
+void Group::launch(shared_ptr<Capture> capture) {
+	prepare(capture);
+	fire();
+}
+
+/// power on the devices and get them ready to start, short of actually starting them
+void Group::prepare(shared_ptr<Capture> capture) {
+	capture->m_armed_at = std::chrono::steady_clock::now();
 	m_min_progress = 0;
+	m_min_count = m_devices.size();
+	m_reported_progress = 0;
+	m_reported_time = std::chrono::steady_clock::time_point();
+	m_data_seen = false;
 	m_cancellation = 0;
+	m_sof_start = 0;
+	m_nsamples = capture->m_nsamples;
 	for (auto i : m_devices) {
 		i->on();
-		if (m_devices.size() > 1) {
-			i->sync();
+		i->arm(capture->m_nsamples);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_capture = capture;
+		// count every device up front so an early finisher can't complete the capture
+		m_active_devices = m_devices.size();
+		m_armed = capture;
+	}
+}
+
+/// start the armed capture
+void Group::fire() {
+	shared_ptr<Capture> capture;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		capture.swap(m_armed);
+	}
+	if (!capture) {
+		smu_debug("group not armed\n");
+		return;
+	}
+
+	// cancelled while being armed, before Capture::cancel() could find it running
+	if (capture->cancelled()) {
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			if (m_cancellation == 0)
+				m_cancellation = LIBUSB_TRANSFER_CANCELLED;
+			m_active_devices = 0;
+			m_completion.notify_all();
 		}
+		capture->complete(LIBUSB_TRANSFER_CANCELLED);
+		return;
 	}
+
+	// starting issues a burst of control transfers per device; don't interleave them with
+	// another group's, which would throw off the synchronized start frame
+	std::lock_guard<std::mutex> start_lock(m_session->m_start_lock);
+
+	// Synchronized devices start on a common USB frame, far enough ahead for the start
+	// request to reach every device. One frame read covers the whole group. A device whose
+	// request arrives after the frame would only start once the 11 bit frame counter wraps
+	// around about two seconds later, so keep a generous margin.
+	unsigned lead = 0;
+	if (m_devices.size() > 1) {
+		lead = std::max<unsigned>(0x1f, 4 + 4 * m_devices.size());
+		m_sof_start = (*m_devices.begin())->start_frame(lead);
+	}
+	m_frame_start = lead != 0;
+
+	auto now = std::chrono::steady_clock::now();
+	m_start_time = now + std::chrono::milliseconds(lead);
+	{
+		std::lock_guard<std::mutex> lock(capture->m_lock);
+		capture->m_fired_at = now;
+	}
+
+	if (m_devices.empty()) {
+		capture->complete(0);
+		return;
+	}
+
 	for (auto i : m_devices) {
-		i->start_run(nsamples);
-		m_active_devices += 1;
+		if (!i->fire(m_sof_start)) {
+			// the device was counted as active when the capture was armed
+			handle_error(LIBUSB_ERROR_IO, "Group::fire");
+			completion();
+		}
 	}
+
+	// the last devices may have been asked to start after the start frame had passed
+	if (lead && std::chrono::steady_clock::now() - now >= std::chrono::milliseconds(lead))
+		handle_error(LIBUSB_ERROR_TIMEOUT, "Group::fire: start frame missed");
 }
 
 /// cancel all pending USB transactions
-void Session::cancel() {
-	m_cancellation = LIBUSB_TRANSFER_CANCELLED;
+void Group::cancel() {
+	shared_ptr<Capture> armed;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		armed.swap(m_armed);
+		// keep an error that caused the cancellation
+		if (m_cancellation == 0)
+			m_cancellation = LIBUSB_TRANSFER_CANCELLED;
+		if (armed) {
+			m_active_devices = 0;
+			m_completion.notify_all();
+		}
+	}
+
+	// an armed capture has nothing in flight yet, so complete it here
+	if (armed) {
+		armed->complete(LIBUSB_TRANSFER_CANCELLED);
+		return;
+	}
 	for (auto i: m_devices) {
 		i->cancel();
 	}
 }
 
 /// Called on the USB thread when a device encounters an error
-void Session::handle_error(int status, const char * tag) {
-	std::lock_guard<std::mutex> lock(m_lock);
-	// a canceled transfer completing is not an error...
-	if ((m_cancellation == 0) && (status != LIBUSB_TRANSFER_CANCELLED) ) {
+void Group::handle_error(int status, const char * tag) {
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		// a canceled transfer completing is not an error...
+		if ((m_cancellation != 0) || (status == LIBUSB_TRANSFER_CANCELLED))
+			return;
 		smu_debug("error condition at %s: %s\n", tag, libusb_error_name(status));
 		m_cancellation = status;
-		cancel();
 	}
+	// cancel() takes m_lock itself
+	cancel();
 }
 
 /// called upon completion of a sample stream
-void Session::completion() {
+void Group::completion() {
 	// On USB thread
-	m_active_devices -= 1;
 	std::lock_guard<std::mutex> lock(m_lock);
+	m_active_devices -= 1;
 	if (m_active_devices == 0) {
+		// deliver progress held back by the rate limit
+		if (m_progress_callback) {
+			report_progress();
+		}
 		if (m_completion_callback) {
 			m_completion_callback(m_cancellation != 0);
 		}
+		if (m_capture) {
+			m_capture->complete(m_cancellation);
+		}
 		m_completion.notify_all();
 	}
 }
 
-void Session::progress() {
+/// Called on the USB thread when a device has been unplugged during a capture
+void Group::device_lost(Device* device) {
+	smu_debug("device lost: %s\n", device->serial());
+	std::lock_guard<std::mutex> lock(m_lock);
+	drop_progress(device);
+}
+
+/// stop counting a device towards the minimum progress; caller holds m_lock
+void Group::drop_progress(Device* device) {
+	if (device->m_progress == m_min_progress && m_min_count > 0 && --m_min_count == 0)
+		update_min_progress();
+}
+
+/// rescan the devices for the minimum progress; caller holds m_lock
+void Group::update_min_progress() {
 	uint64_t min_progress = ULLONG_MAX;
+	m_min_count = 0;
 	for (auto i: m_devices) {
-		if (i->m_in_sampleno < min_progress) {
-			min_progress = i->m_in_sampleno;
+		if (i->m_detached)
+			continue;
+		uint64_t p = i->m_progress.load(std::memory_order_relaxed);
+		if (p < min_progress) {
+			min_progress = p;
+			m_min_count = 1;
+		} else if (p == min_progress) {
+			m_min_count++;
 		}
 	}
-
-	if (min_progress > m_min_progress) {
+	if (m_min_count)
 		m_min_progress = min_progress;
-		if (m_progress_callback) {
-			m_progress_callback(m_min_progress);
+}
+
+void Group::progress(uint64_t prev, uint64_t sampleno) {
+	// On USB thread. Only rescan the devices once the last device at the old minimum has
+	// moved on, which keeps the cost at O(N) per round of transfers rather than per transfer.
+	if (prev == 0 && !m_data_seen.exchange(true)) {
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (m_capture) {
+			std::lock_guard<std::mutex> capture_lock(m_capture->m_lock);
+			m_capture->m_data_at = std::chrono::steady_clock::now();
+		}
+	}
+	if (prev != m_min_progress.load(std::memory_order_relaxed) || sampleno == prev)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (prev != m_min_progress || m_min_count == 0 || --m_min_count > 0)
+			return;
+		update_min_progress();
+	}
+
+	if (m_progress_callback) {
+		auto now = std::chrono::steady_clock::now();
+		if (m_progress_interval == 0 ||
+				now - m_reported_time >= std::chrono::milliseconds(m_progress_interval)) {
+			m_reported_time = now;
+			report_progress();
+		}
+	}
+}
+
+/// pass the current progress to the progress callback if it hasn't seen it yet
+void Group::report_progress() {
+	if (m_min_progress > m_reported_progress) {
+		m_reported_progress = m_min_progress;
+		m_progress_callback(m_min_progress);
+	}
+}
+
+bool Capture::done() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_done;
+}
+
+bool Capture::cancelled() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_cancelled;
+}
+
+bool Capture::wait(unsigned timeout) {
+	std::unique_lock<std::mutex> lk(m_lock);
+	if (timeout == WAIT_FOREVER) {
+		m_completion.wait(lk, [&]{ return m_done; });
+		return true;
+	}
+	return m_completion.wait_for(lk, std::chrono::milliseconds(timeout), [&]{ return m_done; });
+}
+
+void Capture::cancel() {
+	// Set before checking whether the capture is running: either it isn't yet and
+	// Group::fire() sees the flag, or it is and the group gets cancelled.
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_cancelled = true;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_group->m_lock);
+		if (m_group->m_capture.get() != this)
+			return;
+	}
+	if (!done())
+		m_group->cancel();
+}
+
+std::chrono::microseconds Capture::arm_to_fire() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_fired_at == std::chrono::steady_clock::time_point())
+		return std::chrono::microseconds(0);
+	return std::chrono::duration_cast<std::chrono::microseconds>(m_fired_at - m_armed_at);
+}
+
+std::chrono::microseconds Capture::fire_to_data() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_data_at == std::chrono::steady_clock::time_point())
+		return std::chrono::microseconds(0);
+	return std::chrono::duration_cast<std::chrono::microseconds>(m_data_at - m_fired_at);
+}
+
+unsigned Capture::status() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_status;
+}
+
+void Capture::then(std::function<void(Capture&)> callback) {
+	std::unique_lock<std::mutex> lk(m_lock);
+	if (!m_done) {
+		m_callbacks.push_back(callback);
+		return;
+	}
+	lk.unlock();
+	auto self = shared_from_this();
+	m_group->m_session->post([self, callback]() { callback(*self); });
+}
+
+shared_ptr<Capture> Capture::then_run(uint64_t nsamples, std::function<void()> prepare) {
+	shared_ptr<Capture> next(new Capture(m_group, nsamples));
+	then([next, prepare](Capture& prev) {
+		if (prev.status() != 0) {
+			next->complete(prev.status());
+			return;
+		}
+		if (next->cancelled()) {
+			next->complete(LIBUSB_TRANSFER_CANCELLED);
+			return;
 		}
+		if (prepare)
+			prepare();
+		next->m_group->launch(next);
+	});
+	return next;
+}
+
+/// Called with the session lock held, usually on the USB thread
+void Capture::complete(unsigned status) {
+	vector<std::function<void(Capture&)>> callbacks;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_done = true;
+		m_status = status;
+		callbacks.swap(m_callbacks);
+		m_completion.notify_all();
+	}
+	if (callbacks.empty())
+		return;
+	// continuations may block, so never run them on the USB thread
+	auto self = shared_from_this();
+	for (auto callback: callbacks) {
+		m_group->m_session->post([self, callback]() { callback(*self); });
 	}
 }
 
 Device::Device(Session* s, libusb_device* d): m_session(s), m_device(d) {
 	libusb_ref_device(m_device);
+	usb_path(m_device, m_path, sizeof(m_path));
 }
 
 // generic device init - libusb_open
@@ -483,11 +1615,12 @@ int Device::ctrl_transfer(unsigned bmRequestType, unsigned bRequest, unsigned wV
 }
 
 // Force the device into SAM-BA command mode.
-void Device::samba_mode() {
+void Device::samba_mode(bool wait) {
 	int ret;
 
 	ret = this->ctrl_transfer(0x40, 0xbb, 0, 0, NULL, 0, 500);
-	std::this_thread::sleep_for(std::chrono::seconds(1));
+	if (wait)
+		std::this_thread::sleep_for(std::chrono::seconds(1));
 	if (ret < 0 && (ret != LIBUSB_ERROR_IO && ret != LIBUSB_ERROR_PIPE)) {
 		std::string libusb_error_str(libusb_strerror((enum libusb_error)ret));
 		throw std::runtime_error("failed to enable SAM-BA command mode: " + libusb_error_str);
@@ -0,0 +1,36 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#include "stats.hpp"
+#include <algorithm>
+
+void SignalStats::add(const float* samples, size_t n, size_t stride)
+{
+	if (!n)
+		return;
+	// accumulate the block in locals so the loop doesn't store to memory
+	double s = 0, sq = 0;
+	float lo = min, hi = max;
+	for (size_t i = 0; i < n; i++) {
+		float v = samples[i * stride];
+		s += v;
+		sq += (double)v * v;
+		lo = std::min(lo, v);
+		hi = std::max(hi, v);
+	}
+	count += n;
+	sum += s;
+	sum_squares += sq;
+	min = lo;
+	max = hi;
+}
+
+void SignalStats::merge(const SignalStats& other)
+{
+	count += other.count;
+	sum += other.sum;
+	sum_squares += other.sum_squares;
+	min = std::min(min, other.min);
+	max = std::max(max, other.max);
+}
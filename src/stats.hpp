@@ -0,0 +1,36 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+#ifndef _LIBSMU_STATS_HPP
+#define _LIBSMU_STATS_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+/// Running statistics of one signal, updated a block of samples at a time, e.g. from a
+/// Device::measure_blocks() callback. Trivially copyable, so that snapshots can be handed
+/// between threads through a RingBuffer.
+struct SignalStats {
+	uint64_t count = 0;
+	double sum = 0;
+	double sum_squares = 0;
+	float min = INFINITY;
+	float max = -INFINITY;
+
+	/// Add `count` samples spaced `stride` values apart, e.g. stride 4 to take one signal
+	/// out of a measure_blocks() block.
+	void add(const float* samples, size_t count, size_t stride = 1);
+
+	/// Add the samples accumulated by `other`.
+	void merge(const SignalStats& other);
+
+	/// Forget all samples.
+	void reset() { *this = SignalStats(); }
+
+	double mean() const { return count ? sum / count : NAN; }
+	double rms() const { return count ? std::sqrt(sum_squares / count) : NAN; }
+};
+
+#endif // _LIBSMU_STATS_HPP
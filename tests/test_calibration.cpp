@@ -0,0 +1,60 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+// Checks parse_calibration() on well-formed and malformed calibration data; needs no
+// hardware.
+
+#include "calibration.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static unsigned failures = 0;
+
+/// Parse `data` and check the result and, on success, the number of points per record.
+static void check(const char* what, const std::string& data, int expected,
+	const std::vector<size_t>& points = std::vector<size_t>())
+{
+	std::vector<CalibrationRecord> records;
+	int ret = parse_calibration(data.data(), data.size(), records);
+	if (ret != expected) {
+		fprintf(stderr, "%s: got %d, expected %d\n", what, ret, expected);
+		failures++;
+		return;
+	}
+	if (ret < 0)
+		return;
+	bool match = records.size() == points.size();
+	for (size_t i = 0; match && i < records.size(); i++)
+		match = records[i].points.size() == points[i];
+	if (!match) {
+		fprintf(stderr, "%s: wrong number of records or points\n", what);
+		failures++;
+	}
+}
+
+int main(void)
+{
+	check("records", "# Channel A, measure V\n</>\n<0.0000, 0.0012>\n<2.5000, 2.4987>\n<\\>\n"
+		"</>\n<0.0000, -0.0001>\n<\\>\n", 0, {2, 1});
+	check("CRLF line ends", "</>\r\n<0, 0.001>\r\n<1, 1.002>\r\n<\\>\r\n", 0, {2});
+	check("blank lines in a record", "</>\n\n<0, 0.001>\n  \t\n<1, 1.002>\n\n<\\>\n", 0, {2});
+	check("blank CRLF lines in a record", "</>\r\n\r\n<0, 0.001>\r\n<\\>\r\n", 0, {1});
+	check("empty", "", 0);
+
+	check("empty record", "</>\n<\\>\n", -EINVAL);
+	check("unterminated record", "</>\n<0, 0.001>\n", -EINVAL);
+	check("text in a record", "</>\n<0, 0.001>\nnot a point\n<\\>\n", -EINVAL);
+	check("missing value", "</>\n<0, >\n<\\>\n", -EINVAL);
+	check("not finite", "</>\n<0, 1e999>\n<\\>\n", -EINVAL);
+	const char nul[] = "</>\n<0, 1\0.5>\n<\\>\n";
+	check("NUL in a number", std::string(nul, sizeof(nul) - 1), -EINVAL);
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
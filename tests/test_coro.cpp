@@ -0,0 +1,100 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+// Builds libsmu_coro.hpp with C++20 coroutines and checks the asynchronous capture API:
+// cancelling chained captures on an empty group, and, if a device is attached, streaming a
+// capture through a SampleStream and checking that every sample arrives.
+
+#include "libsmu_coro.hpp"
+#include <cstdio>
+#include <exception>
+#include <future>
+#include <libusb.h>
+
+/// Coroutine that starts running right away and needs no handle kept.
+struct Task {
+	struct promise_type {
+		Task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+/// Capture `nsamples` and count the samples received through `stream`, or -1 if the
+/// capture failed.
+static Task consume(Session& session, SampleStream& stream, uint64_t nsamples, std::promise<int64_t>& result)
+{
+	auto capture = session.start_async(nsamples);
+	capture->then([&stream](Capture&) { stream.close(); });
+
+	int64_t samples = 0;
+	while (true) {
+		auto& block = co_await stream.next();
+		if (block.empty())
+			break;
+		samples += block.size() / stream.stride();
+	}
+	unsigned status = co_await capture;
+	result.set_value(status ? -1 : samples);
+}
+
+/// Cancel a capture chained with then_run() before its predecessor has finished: it and
+/// the captures chained to it must complete as cancelled without being started. An empty
+/// group completes captures as soon as they are started, so this needs no hardware.
+static bool check_cancel_chained(Session& session)
+{
+	Group* group = session.add_group();
+	std::atomic<bool> prepared{false};
+	auto first = group->arm(1000);
+	auto second = first->then_run(1000, [&prepared]() { prepared = true; });
+	auto third = second->then_run(1000);
+	second->cancel();
+	group->fire();
+	bool ok = third->wait(1000) && first->status() == 0 &&
+		second->status() == LIBUSB_TRANSFER_CANCELLED &&
+		third->status() == LIBUSB_TRANSFER_CANCELLED && !prepared;
+
+	// without cancellation the chain runs
+	auto fourth = group->start_async(1000)->then_run(1000, [&prepared]() { prepared = true; });
+	ok = ok && fourth->wait(1000) && fourth->status() == 0 && prepared;
+
+	session.remove_group(group);
+	if (!ok)
+		fprintf(stderr, "cancelling a chained capture didn't stop it from running\n");
+	return ok;
+}
+
+int main(void)
+{
+	Session session;
+	if (!check_cancel_chained(session))
+		return 1;
+	if (session.update_available_devices() || session.m_available_devices.empty()) {
+		printf("no devices attached, only checked the build and chained captures\n");
+		return 0;
+	}
+	Device* dev = session.add_device(&*session.m_available_devices[0]);
+	for (unsigned ch = 0; ch < dev->info()->channel_count; ch++)
+		dev->set_mode(ch, DISABLED);
+	session.configure(dev->get_default_rate());
+
+	const uint64_t nsamples = 100000;
+	// enough slots that a stalled worker thread doesn't lose blocks of a short capture
+	SampleStream stream(session, dev, 1024);
+	std::promise<int64_t> result;
+	auto received = result.get_future();
+	consume(session, stream, nsamples, result);
+	int64_t samples = received.get();
+	session.end();
+
+	if (samples != (int64_t)nsamples || stream.overruns()) {
+		fprintf(stderr, "received %lld of %llu samples, %llu blocks dropped\n", (long long)samples,
+			(unsigned long long)nsamples, (unsigned long long)stream.overruns());
+		return 1;
+	}
+	printf("received %llu samples\n", (unsigned long long)nsamples);
+	return 0;
+}
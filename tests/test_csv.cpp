@@ -0,0 +1,137 @@
+// Released under the terms of the BSD License
+// (C) 2014-2016
+//   Analog Devices, Inc.
+
+// Checks format_float() and format_float_fixed() against strtof() and printf() for
+// special values and a spread of random floats; needs no hardware.
+
+#include "csv.hpp"
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+static unsigned failures = 0;
+
+static void fail(const char* what, float value, const std::string& got, const std::string& expected)
+{
+	if (failures++ < 20)
+		fprintf(stderr, "%s(%.9g): got \"%s\", expected \"%s\"\n", what, value, got.c_str(), expected.c_str());
+}
+
+/// significant digits of a decimal in plain or exponent notation
+static unsigned significant_digits(const std::string& text)
+{
+	std::string digits;
+	for (char c: text) {
+		if (c == 'e')
+			break;
+		if (c >= '0' && c <= '9')
+			digits += c;
+	}
+	size_t first = digits.find_first_not_of('0');
+	if (first == std::string::npos)
+		return 1;
+	size_t last = digits.find_last_not_of('0');
+	return last - first + 1;
+}
+
+static void check_shortest(float value)
+{
+	char buf[FORMAT_FLOAT_MAX + 1];
+	std::string got(buf, format_float(buf, value));
+
+	if (std::isnan(value)) {
+		if (got != "nan")
+			fail("format_float", value, got, "nan");
+		return;
+	}
+	if (strtof(got.c_str(), NULL) != value || std::signbit(strtof(got.c_str(), NULL)) != std::signbit(value)) {
+		fail("format_float", value, got, "text reading back as the value");
+		return;
+	}
+	if (value == 0 || std::isinf(value))
+		return;
+
+	// the fewest digits printf needs to round-trip
+	char shortest[64];
+	for (int precision = 0; precision < 9; precision++) {
+		snprintf(shortest, sizeof(shortest), "%.*e", precision, value);
+		if (strtof(shortest, NULL) == value)
+			break;
+	}
+	if (significant_digits(got) > significant_digits(shortest))
+		fail("format_float", value, got, shortest);
+}
+
+static void check_fixed(float value, unsigned decimals)
+{
+	char buf[FORMAT_FLOAT_MAX + 1];
+	std::string got(buf, format_float_fixed(buf, value, decimals));
+	char expected[128];
+	if (std::isnan(value))
+		snprintf(expected, sizeof(expected), "nan");
+	else
+		snprintf(expected, sizeof(expected), "%.*f", decimals, value);
+	if (got != expected)
+		fail("format_float_fixed", value, got, expected);
+}
+
+/// random floats of every exponent, from a fixed seed
+static float random_float(uint64_t& state)
+{
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	uint32_t bits = (uint32_t)state;
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+int main(void)
+{
+	const float special[] = {
+		0.0f, -0.0f, 1.0f, -1.0f, 0.1f, 0.5f, 1.5f, 2.5f, -1488734.5f, 2463.9111328125f,
+		1e-45f, FLT_MIN, FLT_MAX, -FLT_MAX, -3.4e38f, 16777216.0f, 9.999999e9f,
+		INFINITY, -INFINITY, NAN,
+	};
+	for (float value: special) {
+		check_shortest(value);
+		for (unsigned decimals = 0; decimals <= 9; decimals++)
+			check_fixed(value, decimals);
+	}
+
+	uint64_t state = 88172645463325252ull;
+	for (unsigned i = 0; i < 300000; i++)
+		check_shortest(random_float(state));
+	for (unsigned i = 0; i < 100000; i++) {
+		float value = random_float(state);
+		for (unsigned decimals = 0; decimals <= 9; decimals++)
+			check_fixed(value, decimals);
+	}
+	// values in the range of device samples, where halfway cases are common
+	for (unsigned i = 0; i < 100000; i++) {
+		float value = (float)((int32_t)random_float(state) % 100000000) / 8192;
+		for (unsigned decimals = 0; decimals <= 9; decimals++)
+			check_fixed(value, decimals);
+	}
+
+	// the longest cells must fit in what rows() reserves
+	CsvFormat format(',', 9);
+	const float frame[] = {-3.4e38f, FLT_MAX, -FLT_MAX, 1.0f};
+	std::string out;
+	format.rows(frame, 1, 4, out);
+	char expected[512];
+	snprintf(expected, sizeof(expected), "%.9f,%.9f,%.9f,%.9f\n", frame[0], frame[1], frame[2], frame[3]);
+	if (out != expected)
+		fail("CsvFormat::rows", frame[0], out, expected);
+
+	if (failures) {
+		fprintf(stderr, "%u failures\n", failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}